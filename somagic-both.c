@@ -35,32 +35,30 @@
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #ifdef DEBUG
 #include <execinfo.h>
 #endif
 #include <unistd.h>
 #include <getopt.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define VERSION "1.0"
 #define VENDOR 0x1c88
 #define PRODUCT 0x003c
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
-/* Control the number of concurrent ISO transfers we have running */
+/* ISO transfers allocated: up to this many are kept in flight (see --iso-transfers), the rest are spares */
 #define NUM_ISO_TRANSFERS 20
-#define NUM_ISO_SND_TRANSFERS 16
-
-struct libusb_transfer *vid_free[NUM_ISO_TRANSFERS];
-
-int vid_free_item = 0;
-
-int frames_generated = 0;
-int stop_sending_requests = 0;
-int pending_requests = 0;
-int lines_per_field;
+#define DEFAULT_ISO_DEPTH (NUM_ISO_TRANSFERS - 4)
 
-struct libusb_device_handle *devh;
+/* Duration of a high speed microframe, which carries one iso packet */
+#define MICROFRAME_US 125
+#define NUM_ISO_SND_TRANSFERS 16
 
 enum tv_standards {
 	NTSC,         /* 525/60 */
@@ -79,46 +77,161 @@ enum input_types {
 	SVIDEO        /* S-VIDEO          */
 };
 
-/* Options */
-/* Control the number of frames to generate: -1 = unlimited (default) */
-int frame_count = -1;
+enum sync_state {
+	HSYNC,
+	SYNCZ1,
+	SYNCZ2,
+	SYNCAV,
+};
+
+struct video_state_t {
+	uint16_t line;
+	uint16_t col;
+
+	enum sync_state state;
+
+	uint8_t field;
+	uint8_t blank;
+
+	unsigned char frame[720 * 2 * 627 * 2];
+};
+
+/* A capture device: its options, USB handle, and capture state */
+struct somagic_device {
+	struct libusb_device_handle *devh;
+
+	/* Options */
+	/* Control the number of frames to generate: -1 = unlimited (default) */
+	int frame_count;
+
+	/* Television standard (see tv_standards) */
+	int tv_standard;
+
+	/* Input select (see input_types) */
+	int input_type;
+
+	/* Luminance mode (CVBS only): 0 = 4.1 MHz, 1 = 3.8 MHz, 2 = 2.6 MHz, 3 = 2.9 MHz */
+	int luminance_mode;
+
+	/* Luminance prefilter: 0 = bypassed, 1 = active */
+	int luminance_prefilter;
+
+	/* Hue phase in degrees: -128 to 127 (-180 to 178.59375), increments of 1.40625 degrees */
+	uint8_t hue;
 
-/* Television standard (see tv_standards) */
-int tv_standard = PAL;
+	/* Chrominance saturation: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
+	uint8_t saturation;
 
-/* Input select (see input_types) */
-int input_type = CVBS;
+	/* Luminance contrast: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
+	uint8_t contrast;
 
-/* Luminance mode (CVBS only): 0 = 4.1 MHz, 1 = 3.8 MHz, 2 = 2.6 MHz, 3 = 2.9 MHz */
-int luminance_mode = 0;
+	/* Luminance brightness: 0 to 255 */
+	uint8_t brightness;
 
-/* Luminance prefilter: 0 = bypassed, 1 = active */
-int luminance_prefilter = 0;
+	/* Luminance aperture factor: 0 = 0, 1 = 0.25, 2 = 0.5, 3 = 1.0 */
+	int luminance_aperture;
 
-/* Hue phase in degrees: -128 to 127 (-180 to 178.59375), increments of 1.40625 degrees */
-uint8_t hue = 0;
+	/* Number of ISO transfers kept in flight: 1 to NUM_ISO_TRANSFERS */
+	int iso_depth;
 
-/* Chrominance saturation: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
-uint8_t saturation = 64;
+	/* Capture state */
+	int frames_generated;
+	int stop_sending_requests;
+	int pending_requests;
+	int lines_per_field;
 
-/* Luminance contrast: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
-uint8_t contrast = 71;
+	struct video_state_t vs;
 
-/* Luminance brightness: 0 to 255 */
-uint8_t brightness = 128;
+	/* Idle transfers, submitted by schedule_transfers() */
+	struct libusb_transfer *vid_free[NUM_ISO_TRANSFERS];
+	int vid_free_item;
 
-/* Luminance aperture factor: 0 = 0, 1 = 0.25, 2 = 0.5, 3 = 1.0 */
-int luminance_aperture = 1;
+	/* When the last transfer in flight completed: 0 = transfers in flight */
+	uint64_t idle_since;
+
+	/* Statistics */
+	int transfers_completed;
+	int transfer_errors;
+	int packet_errors;
+	uint64_t missed_microframes;  /* passed with no transfer in flight */
+
+	/* Interface mode switch: 1 while in sound mode */
+	int iso_mode;
+	uint8_t async_ctl_buf[64];
+	uint8_t async_set_intf_buf[64];
+
+	struct somagic_device *next;
+};
+
+/* libusb context shared by all devices */
+static libusb_context *usb_context = NULL;
+
+/* All devices, for the emergency exit */
+static struct somagic_device *device_list = NULL;
+
+/* Print statistics on exit: 0 = no, 1 = yes */
+static int print_statistics = 0;
+
+/* Allocate a device with the default options */
+static struct somagic_device *somagic_device_new()
+{
+	struct somagic_device *dev;
+
+	dev = calloc(1, sizeof *dev);
+	if (dev == NULL) {
+		return NULL;
+	}
+	dev->frame_count = -1;
+	dev->tv_standard = PAL;
+	dev->input_type = CVBS;
+	dev->saturation = 64;
+	dev->contrast = 71;
+	dev->brightness = 128;
+	dev->luminance_aperture = 1;
+	dev->iso_depth = DEFAULT_ISO_DEPTH;
+	dev->vs.state = HSYNC;
+
+	dev->next = device_list;
+	device_list = dev;
+	return dev;
+}
+
+static uint64_t timestamp_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_stats(struct somagic_device *dev)
+{
+	fprintf(stderr, "Frames generated: %d\n", dev->frames_generated);
+	fprintf(stderr, "Transfers completed: %d\n", dev->transfers_completed);
+	fprintf(stderr, "Transfer errors: %d\n", dev->transfer_errors);
+	fprintf(stderr, "Iso packet errors: %d\n", dev->packet_errors);
+	fprintf(stderr, "Missed microframes (no transfer in flight): %llu\n", (unsigned long long)dev->missed_microframes);
+}
 
 void release_usb_device(int ret)
 {
+	struct somagic_device *dev;
+
 	fprintf(stderr, "Emergency exit\n");
-	ret = libusb_release_interface(devh, 0);
-	if (!ret) {
-		perror("Failed to release interface");
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (print_statistics) {
+			print_stats(dev);
+		}
+		if (dev->devh == NULL) {
+			continue;
+		}
+		ret = libusb_release_interface(dev->devh, 0);
+		if (!ret) {
+			perror("Failed to release interface");
+		}
+		libusb_close(dev->devh);
 	}
-	libusb_close(devh);
-	libusb_exit(NULL);
+	libusb_exit(usb_context);
 	exit(1);
 }
 
@@ -129,7 +242,7 @@ struct libusb_device *find_device(int vendor, int product)
 	struct libusb_device_descriptor descriptor;
 	int i;
 	ssize_t count;
-	count = libusb_get_device_list(NULL, &list);
+	count = libusb_get_device_list(usb_context, &list);
 	for (i = 0; i < count; i++) {
 		struct libusb_device *item = list[i];
 		libusb_get_device_descriptor(item, &descriptor);
@@ -187,27 +300,6 @@ void trace()
 }
 #endif
 
-enum sync_state {
-	HSYNC,
-	SYNCZ1,
-	SYNCZ2,
-	SYNCAV,
-};
-
-struct video_state_t {
-	uint16_t line;
-	uint16_t col;
-
-	enum sync_state state;
-
-	uint8_t field;
-	uint8_t blank;
-};
-
-static struct video_state_t vs = { .line = 0, .col = 0, .state = 0, .field = 0, .blank = 0};
-
-unsigned char frame[720 * 2 * 627 * 2] = { 0 };
-
 static void put_data(struct video_state_t *vs, uint8_t c)
 {
 	int line_pos;
@@ -219,11 +311,38 @@ static void put_data(struct video_state_t *vs, uint8_t c)
 	if (vs->col > 720 * 2)
 		vs->col = 720 * 2;
 
-	frame[line_pos] = c;
+	vs->frame[line_pos] = c;
 }
 
-static void process(struct video_state_t *vs, uint8_t c)
+/*
+ * Store a run of video data with a single copy. The result is the same as
+ * calling put_data() for each byte: once the column reaches the sanity
+ * limit, every remaining byte lands on the clamped column, so only the last
+ * one is kept.
+ */
+static void put_span(struct video_state_t *vs, uint8_t *data, int length)
 {
+	int line_pos;
+	int count;
+
+	if (length <= 0) {
+		return;
+	}
+
+	line_pos = (2 * vs->line + vs->field) * (720 * 2) + vs->col;
+	count = MIN(length, 720 * 2 + 1 - vs->col);
+	memcpy(vs->frame + line_pos, data, count);
+	if (count < length) {
+		vs->frame[line_pos + count - 1] = data[length - 1];
+	}
+
+	vs->col = MIN(vs->col + length, 720 * 2);
+}
+
+static void process(struct somagic_device *dev, uint8_t c)
+{
+	struct video_state_t *vs = &dev->vs;
+
 	/*
 	 * Timing reference code (TRC):
 	 *     [ff 00 00 SAV] [ff 00 00 EAV]
@@ -311,13 +430,13 @@ static void process(struct video_state_t *vs, uint8_t c)
 			blank_edge = vs->blank ^ blank_edge;
 
 			if (vs->field == 0 && field_edge) {
-				if (frames_generated < frame_count || frame_count == -1) {
-					write(1, frame, 720 * 2 * lines_per_field * 2);
-					frames_generated++;
+				if (dev->frames_generated < dev->frame_count || dev->frame_count == -1) {
+					write(1, vs->frame, 720 * 2 * dev->lines_per_field * 2);
+					dev->frames_generated++;
 				}
 				
-				if (frames_generated >= frame_count && frame_count != -1) {
-					stop_sending_requests = 1;
+				if (dev->frames_generated >= dev->frame_count && dev->frame_count != -1) {
+					dev->stop_sending_requests = 1;
 				}
 			}
 
@@ -329,6 +448,96 @@ static void process(struct video_state_t *vs, uint8_t c)
 	}
 }
 
+/*
+ * TRC scanners: return a pointer to the first 0xff byte in [data, end), or
+ * end if there is none. In BT.656 data 0xff only appears as the first byte
+ * of a timing reference code, so everything before it is video data.
+ */
+static uint8_t *trc_scan_scalar(uint8_t *data, uint8_t *end)
+{
+	uint8_t *next;
+
+	next = memchr(data, 0xff, end - data);
+	return next ? next : end;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static uint8_t *trc_scan_sse2(uint8_t *data, uint8_t *end)
+{
+	const __m128i sync = _mm_set1_epi8((char)0xff);
+	int mask;
+
+	while (end - data >= 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), sync));
+		if (mask) {
+			return data + __builtin_ctz(mask);
+		}
+		data += 16;
+	}
+	return trc_scan_scalar(data, end);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *trc_scan_avx2(uint8_t *data, uint8_t *end)
+{
+	const __m256i sync = _mm256_set1_epi8((char)0xff);
+	unsigned int mask;
+
+	while (end - data >= 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data), sync));
+		if (mask) {
+			return data + __builtin_ctz(mask);
+		}
+		data += 32;
+	}
+	return trc_scan_sse2(data, end);
+}
+#endif
+
+static uint8_t *(*trc_scan)(uint8_t *data, uint8_t *end) = trc_scan_scalar;
+
+/* Select the fastest TRC scanner supported by this CPU */
+static void trc_scan_select()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		trc_scan = trc_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		trc_scan = trc_scan_sse2;
+	}
+#endif
+}
+
+/*
+ * Process a block of video data.
+ * Only the bytes of a (possible) TRC are fed through the process() state
+ * machine; the video data between TRCs is located with trc_scan() and copied
+ * with put_span(). The state machine keeps its state between calls, so a TRC that
+ * crosses a block or packet boundary is still found.
+ */
+static void process_block(struct somagic_device *dev, uint8_t *data, int length)
+{
+	struct video_state_t *vs = &dev->vs;
+	uint8_t *end = data + length;
+	uint8_t *next;
+
+	while (data < end) {
+		if (vs->state != HSYNC) {
+			process(dev, *data++);
+			continue;
+		}
+		next = trc_scan(data, end);
+		put_span(vs, data, next - data);
+		data = next;
+		if (data < end) {
+			/* 0xff, the 1st byte of a TRC */
+			process(dev, *data++);
+		}
+	}
+}
+
 void control_rx(struct libusb_transfer *tfr)
 {
 //	fprintf(stderr,"control_rx: done, status=%d\n", tfr->status);
@@ -336,11 +545,6 @@ void control_rx(struct libusb_transfer *tfr)
 }
 
 
-uint8_t async_ctl_buf[64];
-uint8_t async_set_intf_buf[64];
-
-static int iso_mode = 0;
-
 
 
 
@@ -348,75 +552,117 @@ static int iso_mode = 0;
 
 void int_set_1_rx( struct libusb_transfer *tfr)
 {
+	struct somagic_device *dev = tfr->user_data;
+
 	libusb_free_transfer(tfr);
-	iso_mode = 1;
+	dev->iso_mode = 1;
 
 }
 
 void int_set_2_rx( struct libusb_transfer *tfr)
 {
+	struct somagic_device *dev = tfr->user_data;
+
 	libusb_free_transfer(tfr);
-	iso_mode = 0;
+	dev->iso_mode = 0;
 	
 }
 
-void set_vid_mode( libusb_device_handle *dev_handle)
+void set_vid_mode(struct somagic_device *dev)
 {
 	struct libusb_transfer *async_ctl = libusb_alloc_transfer(0);
 
-	libusb_fill_control_setup(async_ctl_buf,  LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, 2);
+	libusb_fill_control_setup(dev->async_ctl_buf,  LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, 2);
 
-	libusb_fill_control_transfer( async_ctl, dev_handle, async_ctl_buf, control_rx, NULL, 1000); 
+	libusb_fill_control_transfer( async_ctl, dev->devh, dev->async_ctl_buf, control_rx, NULL, 1000); 
 
 	struct libusb_transfer *async_set_intf = libusb_alloc_transfer(0);
 
 	
 	memcpy(libusb_control_transfer_get_data( async_ctl ),"\x01\x05",2); 
-	libusb_fill_control_setup(async_set_intf_buf,  1, 0x0b, 2, 0, 0);
+	libusb_fill_control_setup(dev->async_set_intf_buf,  1, 0x0b, 2, 0, 0);
 	
 	libusb_submit_transfer( async_ctl );
 
-	libusb_fill_control_transfer( async_set_intf, dev_handle, async_set_intf_buf, int_set_2_rx, NULL, 1000); 
+	libusb_fill_control_transfer( async_set_intf, dev->devh, dev->async_set_intf_buf, int_set_2_rx, dev, 1000); 
 	libusb_submit_transfer( async_set_intf );
 }
 
 
-void set_snd_mode( libusb_device_handle *dev_handle)
+void set_snd_mode(struct somagic_device *dev)
 {
 	
 	struct libusb_transfer *async_ctl = libusb_alloc_transfer(0);
 
-	libusb_fill_control_setup(async_ctl_buf,  LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, 2);
+	libusb_fill_control_setup(dev->async_ctl_buf,  LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, 2);
 
-	libusb_fill_control_transfer( async_ctl, dev_handle, async_ctl_buf, control_rx, NULL, 1000); 
+	libusb_fill_control_transfer( async_ctl, dev->devh, dev->async_ctl_buf, control_rx, NULL, 1000); 
 
 	struct libusb_transfer *async_set_intf = libusb_alloc_transfer(0);
 
 	
 	memcpy(libusb_control_transfer_get_data( async_ctl ),"\x00\x02",2); 
-	libusb_fill_control_setup(async_set_intf_buf,  1, 0x0b, 1, 0, 0);
+	libusb_fill_control_setup(dev->async_set_intf_buf,  1, 0x0b, 1, 0, 0);
 	
 	libusb_submit_transfer( async_ctl );
 
-	libusb_fill_control_transfer( async_set_intf, dev_handle, async_set_intf_buf, int_set_1_rx, NULL, 1000); 
+	libusb_fill_control_transfer( async_set_intf, dev->devh, dev->async_set_intf_buf, int_set_1_rx, dev, 1000); 
 	libusb_submit_transfer( async_set_intf );
 	
 }
 
 
+/*
+ * Submit idle transfers until iso_depth are in flight. Called as each
+ * transfer completes, before and after its data is processed, so a spare
+ * takes its place at once and the isochronous schedule never runs dry. The
+ * microframes that pass while no transfer is in flight are counted as missed.
+ */
+static void schedule_transfers(struct somagic_device *dev)
+{
+	struct libusb_transfer *tfr;
+	int ret;
+
+	while (!dev->stop_sending_requests && dev->pending_requests < dev->iso_depth && dev->vid_free_item > 0) {
+		tfr = dev->vid_free[--dev->vid_free_item];
+		ret = libusb_submit_transfer(tfr);
+		if (ret != 0) {
+			fprintf(stderr, "libusb_submit_transfer failed with error %d\n", ret);
+			exit(1);
+		}
+		if (dev->idle_since) {
+			dev->missed_microframes += (timestamp_us() - dev->idle_since) / MICROFRAME_US;
+			dev->idle_since = 0;
+		}
+		dev->pending_requests++;
+	}
+}
+
 void gotdata(struct libusb_transfer *tfr)
 {
-	//int ret;
+	struct somagic_device *dev = tfr->user_data;
 	int num = tfr->num_iso_packets;
 	int i;
 
-	pending_requests--;
+	dev->pending_requests--;
+	if (dev->pending_requests == 0) {
+		dev->idle_since = timestamp_us();
+	}
+	schedule_transfers(dev);
+
+	dev->transfers_completed++;
+	if (tfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		dev->transfer_errors++;
+	}
 
 	for (i = 0; i < num; i++) {
 		unsigned char *data = libusb_get_iso_packet_buffer_simple(tfr, i);
 		int length = tfr->iso_packet_desc[i].actual_length;
 		int pos = 0;
-		int k;
+
+		if (tfr->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) {
+			dev->packet_errors++;
+		}
 //fprintf(stderr," %d", length);
 		while (pos < length) {
 			/*
@@ -426,9 +672,7 @@ void gotdata(struct libusb_transfer *tfr)
 			*/
 			if (data[pos] == 0xaa && data[pos + 1] == 0xaa && data[pos + 2] == 0x00 &&  data[pos + 3] == 0x00 ) {
 				/* process the received data, excluding the 4 marker bytes */
-				for (k = 4; k < 0x400; k++) {
-					process(&vs, data[k + pos]);
-				}
+				process_block(dev, data + 4 + pos, 0x400 - 4);
 			} else if (data[pos] == 0xaa && data[pos + 1] == 0xaa && data[pos + 2] == 0x00 &&  data[pos + 3] == 0x01 ) {
 				/* blocks [0xaa 0xaa 0x00 0x01 are AUDIO blocks (when device setup correctly) 
 				 write these to fd #2 (stderr)*/
@@ -441,25 +685,11 @@ void gotdata(struct libusb_transfer *tfr)
 		}
 	}
 
-	//add transfer to free transfer list
-	if( vid_free_item < NUM_ISO_TRANSFERS ){
-		vid_free[vid_free_item] = tfr;
-		vid_free_item++;
-	}
-// 	if (!stop_sending_requests) {
-// 		reqcount++;
-// 		if( iso_mode == 1 ) set_vid_mode( tfr->dev_handle );
-// 		ret = libusb_submit_transfer(tfr);
-// 		if (ret != 0) {
-// 			fprintf(stderr, "libusb_submit_transfer failed with error %d\n", ret);
-// 			exit(1);
-// 
-// 		}
-// 		pending_requests++;
-// 	}
+	dev->vid_free[dev->vid_free_item++] = tfr;
+	schedule_transfers(dev);
 }
 
-uint8_t somagic_read_reg(uint16_t reg)
+uint8_t somagic_read_reg(struct somagic_device *dev, uint16_t reg)
 {
 	int ret;
 	uint8_t buf[13];
@@ -468,14 +698,14 @@ uint8_t somagic_read_reg(uint16_t reg)
 	buf[5] = reg >> 8;
 	buf[6] = reg & 0xff;
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
 	if (ret != 8) {
 //		fprintf(stderr, "read_reg msg returned %d, bytes: ", ret);
 		//print_bytes(buf, ret);
 		//fprintf(stderr, "\n");
 	}
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
 	if (ret != 13) {
 		//fprintf(stderr, "read_reg control msg returned %d, bytes: ", ret);
 		//print_bytes(buf, ret);
@@ -485,7 +715,7 @@ uint8_t somagic_read_reg(uint16_t reg)
 	return buf[7];
 }
 
-static int somagic_write_reg(uint16_t reg, uint8_t val)
+static int somagic_write_reg(struct somagic_device *dev, uint16_t reg, uint8_t val)
 {
 	int ret;
 	uint8_t buf[8];
@@ -495,7 +725,7 @@ static int somagic_write_reg(uint16_t reg, uint8_t val)
 	buf[6] = reg & 0xff;
 	buf[7] = val;
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
 	if (ret != 8) {
 		//fprintf(stderr, "write reg control msg returned %d, bytes: ", ret);
 		//print_bytes(buf, ret);
@@ -505,7 +735,7 @@ static int somagic_write_reg(uint16_t reg, uint8_t val)
 	return ret;
 }
 
-static uint8_t somagic_read_i2c(uint8_t dev_addr, uint8_t reg)
+static uint8_t somagic_read_i2c(struct somagic_device *dev, uint8_t dev_addr, uint8_t reg)
 {
 	//int ret;
 	uint8_t buf[13];
@@ -515,7 +745,7 @@ static uint8_t somagic_read_i2c(uint8_t dev_addr, uint8_t reg)
 	buf[1] = dev_addr;
 	buf[5] = reg;
 
-	libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
 	//fprintf(stderr, "-> i2c_read msg returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
@@ -525,13 +755,13 @@ static uint8_t somagic_read_i2c(uint8_t dev_addr, uint8_t reg)
 
 	buf[1] = dev_addr;
 
-	libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
 	//fprintf(stderr, "-> i2c_read msg returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
 
 	memset(buf, 0xff, 0x000000d);
-	libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
 	//fprintf(stderr, "<- i2c_read msg returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
@@ -540,7 +770,7 @@ static uint8_t somagic_read_i2c(uint8_t dev_addr, uint8_t reg)
 	return buf[5];
 }
 
-static int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
+static int somagic_write_i2c(struct somagic_device *dev, uint8_t dev_addr, uint8_t reg, uint8_t val)
 {
 	int ret;
 	uint8_t buf[8];
@@ -551,7 +781,7 @@ static int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
 	buf[5] = reg;
 	buf[6] = val;
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
 	if (ret != 8) {
 		//fprintf(stderr, "write_i2c returned %d, bytes: ", ret);
 		//print_bytes(buf, ret);
@@ -601,6 +831,8 @@ void usage()
 	fprintf(stderr, "                                 0     0.00000\n");
 	fprintf(stderr, "                                 1     1.40635\n");
 	fprintf(stderr, "                               127   178.59375\n");
+	fprintf(stderr, "      --iso-transfers=COUNT  Number of ISO transfers kept in flight,\n");
+	fprintf(stderr, "                             1 to 20 (default: 16)\n");
 	fprintf(stderr, "      --luminance=MODE       CVBS luminance mode (default: 0)\n");
 	fprintf(stderr, "                             Mode  Center Frequency\n");
 	fprintf(stderr, "                                0  4.1 MHz (default)\n");
@@ -634,6 +866,8 @@ void usage()
 	fprintf(stderr, "                              -128  -2.000000 (inverse)\n");
 	fprintf(stderr, "  -s, --s-video              Use S-VIDEO input\n");
 	fprintf(stderr, "      --secam                SECAM             [625 lines, 25 Hz]\n");
+	fprintf(stderr, "      --stats                Print transfer statistics, such as the number of\n");
+	fprintf(stderr, "                             missed microframes, on exit\n");
 	fprintf(stderr, "      --help                 Display usage\n");
 	fprintf(stderr, "      --version              Display version information\n");
 	fprintf(stderr, "\n");
@@ -657,7 +891,8 @@ int main(int argc, char **argv)
 	int i = 0;
 	uint8_t status;
 	uint8_t work; 
-	struct libusb_device *dev;
+	struct libusb_device *usb_dev;
+	struct somagic_device *dev;
 
 	/* buffer for control messages */
 	unsigned char buf[65535];
@@ -667,6 +902,12 @@ int main(int argc, char **argv)
 	unsigned char isobuf[NUM_ISO_TRANSFERS][64 * 3072];
 
 	
+	dev = somagic_device_new();
+	if (dev == NULL) {
+		perror("Failed to allocate memory for the device");
+		return 1;
+	}
+
 	/* parsing */
 	int c;
 	int option_index = 0;
@@ -683,6 +924,8 @@ int main(int argc, char **argv)
 		{"pal-m", 0, 0, 0},             /* index 9 */
 		{"pal-combination-n", 0, 0, 0}, /* index 10 */
 		{"secam", 0, 0, 0},             /* index 11 */
+		{"iso-transfers", 1, 0, 0},     /* index 12 */
+		{"stats", 0, 0, 0},             /* index 13 */
 		{"brightness", 1, 0, 'B'},
 		{"cvbs", 0, 0, 'c'},
 		{"contrast", 1, 0, 'C'},
@@ -711,42 +954,52 @@ int main(int argc, char **argv)
 				version();
 				return 0;
 			case 2: /* --luminance */
-				luminance_mode = atoi(optarg);
-				if (luminance_mode < 0 || luminance_mode > 3) {
-					fprintf(stderr, "Invalid luminance mode '%i', must be from 0 to 3\n", luminance_mode);
+				dev->luminance_mode = atoi(optarg);
+				if (dev->luminance_mode < 0 || dev->luminance_mode > 3) {
+					fprintf(stderr, "Invalid luminance mode '%i', must be from 0 to 3\n", dev->luminance_mode);
 					return 1;
 				}
 				break;
 			case 3: /* --lum-aperture*/
-				luminance_aperture = atoi(optarg);
-				if (luminance_aperture < 0 || luminance_aperture > 3) {
-					fprintf(stderr, "Invalid luminance aperture '%i', must be from 0 to 3\n", luminance_mode);
+				dev->luminance_aperture = atoi(optarg);
+				if (dev->luminance_aperture < 0 || dev->luminance_aperture > 3) {
+					fprintf(stderr, "Invalid luminance aperture '%i', must be from 0 to 3\n", dev->luminance_mode);
 					return 1;
 				}
 				break;
 			case 4: /* --lum-prefilter*/
-				luminance_prefilter = 1;
+				dev->luminance_prefilter = 1;
 				break;
 			case 5: /* --ntsc-4.43-50 */
-				tv_standard = NTSC_50;
+				dev->tv_standard = NTSC_50;
 				break;
 			case 6: /* --ntsc-4.43-60 */
-				tv_standard = NTSC_60;
+				dev->tv_standard = NTSC_60;
 				break;
 			case 7: /* --ntsc-n */
-				tv_standard = NTSC_N;
+				dev->tv_standard = NTSC_N;
 				break;
 			case 8: /* --pal-4.43 */
-				tv_standard = PAL_60;
+				dev->tv_standard = PAL_60;
 				break;
 			case 9: /* --pal-m */
-				tv_standard = PAL_M;
+				dev->tv_standard = PAL_M;
 				break;
 			case 10: /* --pal-combination-n */
-				tv_standard = PAL_COMBO_N;
+				dev->tv_standard = PAL_COMBO_N;
 				break;
 			case 11: /* --secam */
-				tv_standard = SECAM;
+				dev->tv_standard = SECAM;
+				break;
+			case 12: /* --iso-transfers */
+				dev->iso_depth = atoi(optarg);
+				if (dev->iso_depth < 1 || dev->iso_depth > NUM_ISO_TRANSFERS) {
+					fprintf(stderr, "Invalid iso transfers count '%i', must be from 1 to %d\n", dev->iso_depth, NUM_ISO_TRANSFERS);
+					return 1;
+				}
+				break;
+			case 13: /* --stats */
+				print_statistics = 1;
 				break;
 			default:
 				usage();
@@ -759,10 +1012,10 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Invalid brightness value '%i', must be from 0 to 255\n", i);
 				return 1;
 			}
-			brightness = i;
+			dev->brightness = i;
 			break;
 		case 'c':
-			input_type = CVBS;
+			dev->input_type = CVBS;
 			break;
 		case 'C':
 			i = atoi(optarg);
@@ -770,10 +1023,10 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Invalid contrast value '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			contrast = (int8_t)i;
+			dev->contrast = (int8_t)i;
 			break;
 		case 'f':
-			frame_count = atoi(optarg);
+			dev->frame_count = atoi(optarg);
 			break;
 		case 'H':
 			i = atoi(optarg);
@@ -781,16 +1034,16 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Invalid hue phase '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			hue = (int8_t)i;
+			dev->hue = (int8_t)i;
 			break;
 		case 'n':
-			tv_standard = NTSC;
+			dev->tv_standard = NTSC;
 			break;
 		case 'p':
-			tv_standard = PAL;
+			dev->tv_standard = PAL;
 			break;
 		case 's':
-			input_type = SVIDEO;
+			dev->input_type = SVIDEO;
 			break;
 		case 'S':
 			i = atoi(optarg);
@@ -798,7 +1051,7 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Invalid saturation value '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			saturation = (int8_t)i;
+			dev->saturation = (int8_t)i;
 			break;
 		default:
 			usage();
@@ -809,109 +1062,111 @@ int main(int argc, char **argv)
 		usage();
 		return 1;
 	}
-	if (input_type == SVIDEO && luminance_mode != 0) {
+	if (dev->input_type == SVIDEO && dev->luminance_mode != 0) {
 		fprintf(stderr, "Luminance mode must be 0 for S-VIDEO\n");
 		return 1;
 	}
 
-	libusb_init(NULL);
-	libusb_set_debug(NULL, 0);
+	trc_scan_select();
+
+	libusb_init(&usb_context);
+	libusb_set_debug(usb_context, 0);
 
-	dev = find_device(VENDOR, PRODUCT);
-	if (!dev) {
+	usb_dev = find_device(VENDOR, PRODUCT);
+	if (!usb_dev) {
 		fprintf(stderr, "USB device %04x:%04x was not found. Has device initialization been performed?\n", VENDOR, PRODUCT);
 		return 1;
 	}
 
-	ret = libusb_open(dev, &devh);
-	if (!devh) {
+	ret = libusb_open(usb_dev, &dev->devh);
+	if (!dev->devh) {
 		perror("Failed to open USB device");
 		return 1;
 	}
-	libusb_unref_device(dev);
+	libusb_unref_device(usb_dev);
 	
 	signal(SIGTERM, release_usb_device);
-	ret = libusb_claim_interface(devh, 0);
+	ret = libusb_claim_interface(dev->devh, 0);
 	if (ret != 0) {
 		fprintf(stderr, "claim failed with error %d\n", ret);
 		exit(1);
 	}
 	
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
+	ret = libusb_set_interface_alt_setting(dev->devh, 0, 0);
 	if (ret != 0) {
 		fprintf(stderr, "set_interface_alt_setting failed with error %d\n", ret);
 		exit(1);
 	}
 
-	ret = libusb_get_descriptor(devh, 0x0000001, 0x0000000, buf, 0x0000012);
+	ret = libusb_get_descriptor(dev->devh, 0x0000001, 0x0000000, buf, 0x0000012);
 	fprintf(stderr, "1 get descriptor returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 0x0000009);
+	ret = libusb_get_descriptor(dev->devh, 0x0000002, 0x0000000, buf, 0x0000009);
 	//fprintf(stderr, "2 get descriptor returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 0x0000042);
+	ret = libusb_get_descriptor(dev->devh, 0x0000002, 0x0000000, buf, 0x0000042);
 	//fprintf(stderr, "3 get descriptor returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
 
-	ret = libusb_release_interface(devh, 0);
+	ret = libusb_release_interface(dev->devh, 0);
 	if (ret != 0) {
 		//fprintf(stderr, "failed to release interface before set_configuration: %d\n", ret);
 	}
-	ret = libusb_set_configuration(devh, 0x0000001);
+	ret = libusb_set_configuration(dev->devh, 0x0000001);
 	//fprintf(stderr, "4 set configuration returned %d\n", ret);
-	ret = libusb_claim_interface(devh, 0);
+	ret = libusb_claim_interface(dev->devh, 0);
 	if (ret != 0) {
 		//fprintf(stderr, "claim after set_configuration failed with error %d\n", ret);
 	}
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
+	ret = libusb_set_interface_alt_setting(dev->devh, 0, 0);
 	//fprintf(stderr, "4 set alternate setting returned %d\n", ret);
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
 	//fprintf(stderr, "5 control msg returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
 
-	somagic_write_reg(0x3a, 0x80);
-	somagic_write_reg(0x3b, 0x00);
+	somagic_write_reg(dev, 0x3a, 0x80);
+	somagic_write_reg(dev, 0x3b, 0x00);
 
 	/* Reset audio chip? */
-	somagic_write_reg(0x34, 0x01);
-	somagic_write_reg(0x35, 0x00);
+	somagic_write_reg(dev, 0x34, 0x01);
+	somagic_write_reg(dev, 0x35, 0x00);
 
-	status = somagic_read_reg(0x3080);
+	status = somagic_read_reg(dev, 0x3080);
 	fprintf(stderr, "status is %02x\n", status);
 
 	/* Reset audio chip? */
-	somagic_write_reg(0x34, 0x11);
-	somagic_write_reg(0x35, 0x11);
+	somagic_write_reg(dev, 0x34, 0x11);
+	somagic_write_reg(dev, 0x35, 0x11);
 
 	/* SAAxxx: toggle reset of SAAxxx */
-	somagic_write_reg(0x3b, 0x80);
+	somagic_write_reg(dev, 0x3b, 0x80);
 
 	/* SAAxxx: bring from reset */
-	somagic_write_reg(0x3b, 0x00);
+	somagic_write_reg(dev, 0x3b, 0x00);
 
 	/* Subaddress 0x01, Horizontal Increment delay */
 	/* Recommended position */
-	somagic_write_i2c(0x4a, 0x01, 0x08);
+	somagic_write_i2c(dev, 0x4a, 0x01, 0x08);
 
 	/* Subaddress 0x02, Analog input control 1 */
-	if (input_type == CVBS) {
+	if (dev->input_type == CVBS) {
 		/* Analog function select FUSE = Amplifier plus anti-alias filter bypassed */
 		/* Update hysteresis for 9-bit gain = Off */
 		/* Mode = 0, CVBS (automatic gain) from AI11 (pin 4) */
-		somagic_write_i2c(0x4a, 0x02, 0xc0);
+		somagic_write_i2c(dev, 0x4a, 0x02, 0xc0);
 	} else {
 		/* Analog function select FUSE = Amplifier plus anti-alias filter bypassed */
 		/* Update hysteresis for 9-bit gain = Off */
 		/* Mode = 7, Y (automatic gain) from AI12 (pin 7) + C (gain adjustable via GAI28 to GAI20) from AI22 (pin 1) */
-		somagic_write_i2c(0x4a, 0x02, 0xc7);
+		somagic_write_i2c(dev, 0x4a, 0x02, 0xc7);
 	}
 
 	/* Subaddress 0x03, Analog input control 2 */ 
-	if (input_type == CVBS) {
+	if (dev->input_type == CVBS) {
 		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
 		/* Static gain control channel 2 (GAI28), sign bit of gain control = 1 */
 		/* Gain control fix (GAFIX) = Automatic gain controlled by MODE3 to MODE0 */
@@ -919,7 +1174,7 @@ int main(int argc, char **argv)
 		/* White peak off (WPOFF) = White peak off */ 
 		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
 		/* Normal clamping if decoder is in unlocked state */
-		somagic_write_i2c(0x4a, 0x03, 0x33); 
+		somagic_write_i2c(dev, 0x4a, 0x03, 0x33); 
 	} else {
 		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
 		/* Static gain control channel 2 (GAI28), sign bit of gain control = 0 */
@@ -928,24 +1183,24 @@ int main(int argc, char **argv)
 		/* White peak off (WPOFF) = White peak off */ 
 		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
 		/* Normal clamping if decoder is in unlocked state */
-		somagic_write_i2c(0x4a, 0x03, 0x31); 
+		somagic_write_i2c(dev, 0x4a, 0x03, 0x31); 
 	}
 
 	/* Subaddress 0x04, Gain control analog/Analog input control 3 (AICO3); static gain control channel 1 GAI1 */
 	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI18 value) */
-	somagic_write_i2c(0x4a, 0x04, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x04, 0x00);
 
 	/* Subaddress 0x05, Gain control analog/Analog input control 4 (AICO4); static gain control channel 2 GAI2 */
 	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI28 value) */
-	somagic_write_i2c(0x4a, 0x05, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x05, 0x00);
 
 	/* Subaddress 0x06, Horizontal sync start/begin */
 	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
-	somagic_write_i2c(0x4a, 0x06, 0xe9);
+	somagic_write_i2c(dev, 0x4a, 0x06, 0xe9);
 
 	/* Subaddress 0x07, Horizontal sync stop */
 	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
-	somagic_write_i2c(0x4a, 0x07, 0x0d);
+	somagic_write_i2c(dev, 0x4a, 0x07, 0x0d);
 
 	/* Subaddress 0x08, Sync control */ 
 	/* Automatic field detection (AUFD) = Automatic field detection */
@@ -954,40 +1209,40 @@ int main(int argc, char **argv)
 	/* Horizontal time constant selection = Fast locking mode (recommended setting) */
 	/* Horizontal PLL (HPLL) = PLL closed */
 	/* Vertical noise reduction (VNOI) = Normal mode (recommended setting) */
-	somagic_write_i2c(0x4a, 0x08, 0x98);
+	somagic_write_i2c(dev, 0x4a, 0x08, 0x98);
 
 	/* Subaddress 0x09, Luminance control */ 
 	/* Update time interval for analog AGC value (UPTCV) = Horizontal update (once per line) */
 	/* Vertical blanking luminance bypass (VBLB) = Active luminance processing */
 	/* Chrominance trap bypass (BYPS) = Chrominance trap active; default for CVBS mode */
-	work = ((luminance_prefilter & 0x01) << 6) | ((luminance_mode & 0x03) << 4) | (luminance_aperture & 0x03);
-	if (input_type == SVIDEO) {
+	work = ((dev->luminance_prefilter & 0x01) << 6) | ((dev->luminance_mode & 0x03) << 4) | (dev->luminance_aperture & 0x03);
+	if (dev->input_type == SVIDEO) {
 		/* Chrominance trap bypass (BYPS) = Chrominance trap bypassed; default for S-video mode */
 		work |= 0x80;
 	}
 	//fprintf(stderr, "Subaddress 0x09 set to %02x\n", work); 
-	somagic_write_i2c(0x4a, 0x09, work);
+	somagic_write_i2c(dev, 0x4a, 0x09, work);
 
 	/* Subaddress 0x0a, Luminance brightness control */
 	/* Offset = 128 (ITU level) */
-	somagic_write_i2c(0x4a, 0x0a, brightness);
+	somagic_write_i2c(dev, 0x4a, 0x0a, dev->brightness);
 
 	/* Subaddress 0x0b, Luminance contrast control */
 	/* Gain = 1.0 */
-	somagic_write_i2c(0x4a, 0x0b, contrast);
+	somagic_write_i2c(dev, 0x4a, 0x0b, dev->contrast);
 
 	/* Subaddress 0x0c, Chrominance saturation control */
-	somagic_write_i2c(0x4a, 0x0c, saturation); 
+	somagic_write_i2c(dev, 0x4a, 0x0c, dev->saturation); 
 
 	/* Subaddress 0x0d, Chrominance hue control */
-	somagic_write_i2c(0x4a, 0x0d, hue);
+	somagic_write_i2c(dev, 0x4a, 0x0d, dev->hue);
 
 	/* Subaddress 0x0e, Chrominance control */
 	/* Chrominance bandwidth (CHBW0 and CHBW1) = Nominal bandwidth (800 kHz) */
 	/* Fast color time constant (FCTC) = Nominal time constant */
 	/* Disable chrominance comb filter (DCCF) = Chrominance comb filter on (during lines determined by VREF = 1) */
 	/* Clear DTO (CDTO) = Disabled */
-	switch (tv_standard) {
+	switch (dev->tv_standard) {
         case PAL:
 	case NTSC:
 		work = 0x01;
@@ -1008,24 +1263,24 @@ int main(int argc, char **argv)
 		work = 0x50;
 		break;
 	}
-	somagic_write_i2c(0x4a, 0x0e, work);
+	somagic_write_i2c(dev, 0x4a, 0x0e, work);
 
 	/* Subaddress 0x0f, Chrominance gain control */
 	/* Chrominance gain value = ??? (Note: only meaningful if ACGF is off) */
 	/* Automatic chrominance gain control ACGC = On */
-	somagic_write_i2c(0x4a, 0x0f, 0x2a);
+	somagic_write_i2c(dev, 0x4a, 0x0f, 0x2a);
 
 	/* Subaddress 0x10, Format/delay control */
 	/* Output format selection (OFTS0 and OFTS1), V-flag generation in SAV/EAV-codes = V-flag in SAV/EAV is generated by VREF */
 	/* Fine position of HS (HDEL0 and HDEL1) (steps in 2/LLC) = 0 */
 	/* VREF pulse position and length (VRLN) = see Table 46 in SAA7113H documentation */
 	/* Luminance delay compensation (steps in 2/LLC) = 0 */
-	somagic_write_i2c(0x4a, 0x10, 0x40);
+	somagic_write_i2c(dev, 0x4a, 0x10, 0x40);
 	/*
-	if (input_type == CVBS) {
-		somagic_write_i2c(0x4a, 0x10, 0x40);
+	if (dev->input_type == CVBS) {
+		somagic_write_i2c(dev, 0x4a, 0x10, 0x40);
 	} else {
-		somagic_write_i2c(0x4a, 0x10, 0x00);
+		somagic_write_i2c(dev, 0x4a, 0x10, 0x00);
 	}
 	*/
 
@@ -1038,141 +1293,141 @@ int main(int argc, char **argv)
 	/* Output enable real-time (OERT) = RTS0, RTCO active, RTS1 active, if RTSE13 to RTSE10 = 0000 */
 	/* YUV decoder bypassed (VIPB) = Processed data to VPO output */
 	/* Color on (COLO) = Automatic color killer */
-	somagic_write_i2c(0x4a, 0x11, 0x0c);
+	somagic_write_i2c(dev, 0x4a, 0x11, 0x0c);
 
 	/* Subaddress 0x12, RTS0 output control/Output control 2 */
 	/* RTS1 output control = 3-state, pin RTS1 is used as DOT input */
 	/* RTS0 output control = VIPB (subaddress 0x11, bit 1) = 0: reserved */ 
-	somagic_write_i2c(0x4a, 0x12, 0x01);
+	somagic_write_i2c(dev, 0x4a, 0x12, 0x01);
 
 	/* Subaddress 0x13, Output control 3 */
-	if (input_type == CVBS) {
+	if (dev->input_type == CVBS) {
 		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD7 to AD0 (LSBs) on VPO7 to VPO0 */
 		/* Selection bit for status byte functionality (OLDSB) = Default status information */
 		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
 		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
-		somagic_write_i2c(0x4a, 0x13, 0x80);
+		somagic_write_i2c(dev, 0x4a, 0x13, 0x80);
 	} else {
 		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD8 to AD1 (MSBs) on VPO7 to VPO0 */
 		/* Selection bit for status byte functionality (OLDSB) = Default status information */
 		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
 		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
-		somagic_write_i2c(0x4a, 0x13, 0x00);
+		somagic_write_i2c(dev, 0x4a, 0x13, 0x00);
 	}
 
 	/* Subaddress 0x15, Start of VGATE pulse (01-transition) and polarity change of FID pulse/V_GATE1_START */
 	/* Note: Dependency on subaddress 0x17 value */
 	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
-	somagic_write_i2c(0x4a, 0x15, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x15, 0x00);
 
 	/* Subaddress 0x16, Stop of VGATE pulse (10-transition)/V_GATE1_STOP */
 	/* Note: Dependency on subaddress 0x17 value */
 	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
-	somagic_write_i2c(0x4a, 0x16, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x16, 0x00);
 
 	/* Subaddress 0x17, VGATE MSBs/V_GATE1_MSB */
 	/* VSTA8, MSB VGATE start = 0 */
 	/* VSTO8, MSB VGATE stop = 0 */
-	somagic_write_i2c(0x4a, 0x17, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x17, 0x00);
 
 	/* Subaddress 0x40, AC1 */
-	if (tv_standard == NTSC || tv_standard == PAL_60 || tv_standard == NTSC_60 || tv_standard == PAL_M) {
+	if (dev->tv_standard == NTSC || dev->tv_standard == PAL_60 || dev->tv_standard == NTSC_60 || dev->tv_standard == PAL_M) {
 		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
 		/* Amplitude searching = Amplitude searching active (default) */
 		/* Framing code error = One framing code error allowed */
 		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
 		/* Field size select = 60 Hz field rate */
-		somagic_write_i2c(0x4a, 0x40, 0x82);
+		somagic_write_i2c(dev, 0x4a, 0x40, 0x82);
 	} else {
 		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
 		/* Amplitude searching = Amplitude searching active (default) */
 		/* Framing code error = One framing code error allowed */
 		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
 		/* Field size select = 50 Hz field rate */
-		somagic_write_i2c(0x4a, 0x40, 0x02);
+		somagic_write_i2c(dev, 0x4a, 0x40, 0x02);
 	}
 
-	if (input_type == CVBS) {
+	if (dev->input_type == CVBS) {
 		/* LCR register 2 to 24 = Intercast, oversampled CVBS data */
-		somagic_write_i2c(0x4a, 0x41, 0x77);
-		somagic_write_i2c(0x4a, 0x42, 0x77);
-		somagic_write_i2c(0x4a, 0x43, 0x77);
-		somagic_write_i2c(0x4a, 0x44, 0x77);
-		somagic_write_i2c(0x4a, 0x45, 0x77);
-		somagic_write_i2c(0x4a, 0x46, 0x77);
-		somagic_write_i2c(0x4a, 0x47, 0x77);
-		somagic_write_i2c(0x4a, 0x48, 0x77);
-		somagic_write_i2c(0x4a, 0x49, 0x77);
-		somagic_write_i2c(0x4a, 0x4a, 0x77);
-		somagic_write_i2c(0x4a, 0x4b, 0x77);
-		somagic_write_i2c(0x4a, 0x4c, 0x77);
-		somagic_write_i2c(0x4a, 0x4d, 0x77);
-		somagic_write_i2c(0x4a, 0x4e, 0x77);
-		somagic_write_i2c(0x4a, 0x4f, 0x77);
-		somagic_write_i2c(0x4a, 0x50, 0x77);
-		somagic_write_i2c(0x4a, 0x51, 0x77);
-		somagic_write_i2c(0x4a, 0x52, 0x77);
-		somagic_write_i2c(0x4a, 0x53, 0x77);
-		somagic_write_i2c(0x4a, 0x54, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x41, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x42, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x43, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x44, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x45, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x46, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x47, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x48, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x49, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4a, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4b, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4c, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4d, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4e, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x4f, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x50, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x51, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x52, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x53, 0x77);
+		somagic_write_i2c(dev, 0x4a, 0x54, 0x77);
 		/* LCR register 2 to 24 = Active video, video component signal, active video region (default) */
-		somagic_write_i2c(0x4a, 0x55, 0xff);
+		somagic_write_i2c(dev, 0x4a, 0x55, 0xff);
 	}
 
 	/* Subaddress 0x58, Framing code for programmable data types/FC */
 	/* Slicer set, Programmable framing code = ??? */
-	somagic_write_i2c(0x4a, 0x58, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x58, 0x00);
 
 	/* Subaddress 0x59, Horizontal offset/HOFF */
 	/* Slicer set, Horizontal offset = Recommended value */
-	somagic_write_i2c(0x4a, 0x59, 0x54);
+	somagic_write_i2c(dev, 0x4a, 0x59, 0x54);
 
 	/* Subaddress 0x5a: Vertical offset/VOFF */
-	if (tv_standard == PAL || tv_standard == PAL_COMBO_N || tv_standard == NTSC_N || tv_standard == SECAM) {
+	if (dev->tv_standard == PAL || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM) {
 		/* Slicer set, Vertical offset = Value for 625 lines input */
-		somagic_write_i2c(0x4a, 0x5a, 0x07);
-		lines_per_field = 288;
+		somagic_write_i2c(dev, 0x4a, 0x5a, 0x07);
+		dev->lines_per_field = 288;
 	} else {
 		/* Slicer set, Vertical offset = Value for 525 lines input */
-		somagic_write_i2c(0x4a, 0x5a, 0x0a);
-		lines_per_field = 240;
+		somagic_write_i2c(dev, 0x4a, 0x5a, 0x0a);
+		dev->lines_per_field = 240;
 	}
 
 	/* Subaddress 0x5b, Field offset, MSBs for vertical and horizontal offsets/HVOFF */
 	/* Slicer set, Field offset = Invert field indicator (even/odd; default) */
-	somagic_write_i2c(0x4a, 0x5b, 0x83);
+	somagic_write_i2c(dev, 0x4a, 0x5b, 0x83);
 
 	/* Subaddress 0x5e, SDID codes */
 	/* Slicer set, SDID codes = SDID5 to SDID0 = 0x00 (default) */
-	somagic_write_i2c(0x4a, 0x5e, 0x00);
+	somagic_write_i2c(dev, 0x4a, 0x5e, 0x00);
 
-	status = somagic_read_i2c(0x4a, 0x10);
+	status = somagic_read_i2c(dev, 0x4a, 0x10);
 	//fprintf(stderr,"i2c_read(0x10) = %02x\n", status);
 
-	status = somagic_read_i2c(0x4a, 0x02);
+	status = somagic_read_i2c(dev, 0x4a, 0x02);
 	//fprintf(stderr,"i2c_stat(0x02) = %02x\n", status);
 
-	somagic_write_reg(0x1740, 0x40);
+	somagic_write_reg(dev, 0x1740, 0x40);
 
-	status = somagic_read_reg(0x3080);
+	status = somagic_read_reg(dev, 0x3080);
 	//fprintf(stderr, "status is %02x\n", status);
 
-	somagic_write_reg(0x1740, 0x00);
+	somagic_write_reg(dev, 0x1740, 0x00);
 	usleep(250 * 1000);
-	somagic_write_reg(0x1740, 0x00);
+	somagic_write_reg(dev, 0x1740, 0x00);
 
-	status = somagic_read_reg(0x3080);
+	status = somagic_read_reg(dev, 0x3080);
 	//fprintf(stderr, "status is %02x\n", status);
 
 	
 	memcpy(buf, "\x01\x02", 2);
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
+	ret = libusb_control_transfer(dev->devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
 	//fprintf(stderr, "190 control msg returned %d, bytes: ", ret);
 	//print_bytes(buf, ret);
 	//fprintf(stderr, "\n");
 
-//	somagic_write_reg(0x1740, 0x05);
+//	somagic_write_reg(dev, 0x1740, 0x05);
 	usleep(30 * 1000);
-	ret = libusb_set_interface_alt_setting(devh, 0, 2);
+	ret = libusb_set_interface_alt_setting(dev->devh, 0, 2);
 	//fprintf(stderr, "192 set alternate setting returned %d\n", ret);
 
 	
@@ -1182,57 +1437,50 @@ int main(int argc, char **argv)
 			//fprintf(stderr, "Failed to allocate USB transfer #%d\n", i);
 			return 1;
 		}
-		libusb_fill_iso_transfer(tfr[i], devh, 0x00000082, isobuf[i], 64 * 3072, 64, gotdata, NULL, 2000);
+		libusb_fill_iso_transfer(tfr[i], dev->devh, 0x00000082, isobuf[i], 64 * 3072, 64, gotdata, dev, 2000);
 		libusb_set_iso_packet_lengths(tfr[i], 3072);
 	}
 	
-	pending_requests = NUM_ISO_TRANSFERS;
 	for (i = 0; i < NUM_ISO_TRANSFERS; i++) {
-		ret = libusb_submit_transfer(tfr[i]);
-		if (ret != 0) {
-			//fprintf(stderr, "libusb_submit_transfer failed with error %d for transfer %d\n", ret, i);
-			exit(1);
-		}
+		dev->vid_free[dev->vid_free_item++] = tfr[i];
 	}
+	schedule_transfers(dev);
 
 
-	set_snd_mode( devh );
+	/* Switch to sound mode and back; the transfers keep being resubmitted meanwhile */
+	set_snd_mode(dev);
 	
-	while( iso_mode != 1 ){
-		libusb_handle_events(NULL);
+	while( dev->iso_mode != 1 ){
+		libusb_handle_events(usb_context);
 	}
 
 	
-	set_vid_mode( devh );
+	set_vid_mode(dev);
 	
-	while( iso_mode != 0 ){
-		libusb_handle_events(NULL);
+	while( dev->iso_mode != 0 ){
+		libusb_handle_events(usb_context);
 	}
 
 	
 
-	while (/*pending_requests > 0*/ 1) {
-		libusb_handle_events(NULL);
-		//fprintf(stderr,"vf=%d sf=%d\n",vid_free_item, snd_free_item );
-
-		if( vid_free_item >= NUM_ISO_TRANSFERS - 4 ){ 
-			//fprintf(stderr,"v\n");
-			for( i = 0 ; i < vid_free_item; i++ ) libusb_submit_transfer( vid_free[i] );
-			vid_free_item = 0;
-		}
-	
+	/* The transfers resubmit themselves (see schedule_transfers()) until --frame-count frames are done */
+	while (dev->pending_requests > 0) {
+		libusb_handle_events(usb_context);
 	}
-	
+	if (print_statistics) {
+		print_stats(dev);
+	}
+
 	for (i = 0; i < NUM_ISO_TRANSFERS; i++) {
 		libusb_free_transfer(tfr[i]);
 	}
 
-	ret = libusb_release_interface(devh, 0);
+	ret = libusb_release_interface(dev->devh, 0);
 	if (ret != 0) {
 		perror("Failed to release interface");
 		return 1;
 	}
-	libusb_close(devh);
-	libusb_exit(NULL);
+	libusb_close(dev->devh);
+	libusb_exit(usb_context);
 	return 0;
 }
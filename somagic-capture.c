@@ -29,21 +29,41 @@
 
 /* This file was originally generated with usbsnoop2libusb.pl from a usbsnoop log file. */
 /* Latest version of the script should be in http://iki.fi/lindi/usb/usbsnoop2libusb.pl */
+#define _GNU_SOURCE  /* CPU affinity */
 #include <ctype.h>
 #ifdef DEBUG
 #include <execinfo.h>
 #endif
 #include <errno.h>
 #include <fcntl.h>
+#include <gcrypt.h>
 #include <getopt.h>
 #include <libusb-1.0/libusb.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
 
 #define PROGRAM_NAME "somagic-capture"
 #define VERSION "1.2"
@@ -55,16 +75,26 @@ static const int PRODUCT[PRODUCT_COUNT] = {
 	0x003e,
 	0x003f
 };
+#define ORIGINAL_PRODUCT 0x0007
+#define SOMAGIC_FIRMWARE_PATH "/lib/firmware/somagic_firmware.bin"
+#define FIRMWARE_COUNT 3
+static const unsigned char SOMAGIC_FIRMWARE_CRC32[FIRMWARE_COUNT][4] = {
+	{'\x34', '\x89', '\xf7', '\x7b'},
+	{'\x1f', '\xfe', '\xde', '\xbb'},
+	{'\x60', '\x1d', '\x37', '\x5f'}
+};
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-static char * program_path;
+/* Isochronous packets per transfer, and the size of each packet */
+#define ISO_PACKETS 64  /* most packets per transfer (see --iso-packets) */
+#define ISO_PACKET_SIZE 3072
+#define MICROFRAME_US 125  /* one iso packet per high speed microframe */
 
-static int frames_generated = 0;
-static int stop_sending_requests = 0;
-static int pending_requests = 0;
-static int lines_per_field;
+/* Most consecutive I2C registers written by one control transfer (see --i2c-burst) */
+#define I2C_BURST_MAX 32
 
-static struct libusb_device_handle *devh;
+static char * program_path;
 
 enum tv_standards {
 	NTSC,         /* 525/60 */
@@ -88,149 +118,145 @@ enum tv_standards {
 #define	VIDEO3 0
 #define	VIDEO4 1
 
-/* Options */
-/* Control the number of frames to generate: -1 = unlimited (default) */
-static int frame_count = -1;
+/* Replay pacing modes (see --replay-pace) */
+enum replay_paces {
+	REPLAY_REALTIME,  /* 50 or 59.94 decoded fields per second */
+	REPLAY_FAST       /* As fast as the data can be decoded */
+};
 
-/* Television standard (see tv_standards) */
-static int tv_standard = PAL;
+/* Frame queue policies, applied when the writer thread falls behind */
+enum queue_policies {
+	QUEUE_BLOCK,        /* Wait for the writer thread */
+	QUEUE_DROP_OLDEST,  /* Discard the oldest queued frame */
+	QUEUE_DROP_NEWEST   /* Discard the frame that was just completed */
+};
 
-/* Input type select (see Input types) */
-static int input_type = CVBS;
+/* Iso transfer autotuning goals (see --autotune) */
+enum autotune_goals {
+	AUTOTUNE_OFF,      /* Keep --iso-transfers and --iso-packets */
+	AUTOTUNE_LATENCY,  /* Fewest packets per transfer that lose no more than the budget */
+	AUTOTUNE_CPU       /* Fewest callbacks per second that lose no more than the budget */
+};
 
-/* CVBS input select */
-static int cvbs_input = VIDEO3;
+/*
+ * Autotuning (see autotune()): transfers allocated, the interval over which
+ * the callbacks are measured, the fewest packets per transfer, the time in
+ * flight kept per worst gap between callbacks and at least, and the loss
+ * budget of 1 in AUTOTUNE_LOSS_BUDGET packets
+ */
+#define AUTOTUNE_TRANSFERS 32
+#define AUTOTUNE_INTERVAL_US 1000000
+#define AUTOTUNE_MIN_PACKETS 8
+#define AUTOTUNE_MARGIN 4
+#define AUTOTUNE_MIN_COVER_US 4000
+#define AUTOTUNE_LOSS_BUDGET 1000
+
+/* Memory for the iso transfer buffers (see --iso-memory) */
+enum iso_memory_types {
+	ISO_MEMORY_DEVICE,     /* usbfs device memory, filled without a copy by the kernel, if it has it, else pages */
+	ISO_MEMORY_PAGES,      /* Page aligned anonymous memory */
+	ISO_MEMORY_HUGEPAGES   /* Huge pages, else pages */
+};
+static const char *iso_memory_names[] = {"device memory", "pages", "huge pages"};
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+enum pixel_formats {
+	PIXEL_UYVY,     /* Packed 4:2:2, as decoded */
+	PIXEL_YUYV,     /* Packed 4:2:2, Y first */
+	PIXEL_I420,     /* Planar 4:2:0: Y, Cb and Cr planes */
+	PIXEL_NV12,     /* Y plane, then a plane of interleaved Cb and Cr at 4:2:0 */
+	PIXEL_YUV422P,  /* Planar 4:2:2: Y, Cb and Cr planes */
+	PIXEL_RGB24,    /* R, G, B, converted as BT.601 limited range */
+	PIXEL_BGRA      /* B, G, R, 255, converted as BT.601 limited range */
+};
+static const char *pixel_format_names[] = {"uyvy", "yuyv", "i420", "nv12", "yuv422p", "rgb24", "bgra"};
 
-/* Luminance mode (CVBS only): 0 = 4.1 MHz, 1 = 3.8 MHz, 2 = 2.6 MHz, 3 = 2.9 MHz */
-static int luminance_mode = 0;
+/* Options (process-wide, see struct somagic_device for the per-device ones) */
+/* Benchmark mode (no capture): 0 = capture, 1 = benchmark the decoders */
+static int benchmark = 0;
 
-/* Luminance prefilter: 0 = bypassed, 1 = active */
-static int luminance_prefilter = 0;
+/* Raw iso stream dump to read instead of capturing from the device: NULL = capture (default) */
+static char *replay_filename = NULL;
 
-/* Hue phase in degrees: -128 to 127 (-180 to 178.59375), increments of 1.40625 degrees */
-static uint8_t hue = 0;
+/* Replay pacing (see replay_paces) */
+static int replay_pace = REPLAY_REALTIME;
 
-/* Chrominance saturation: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
-static uint8_t saturation = 64;
+/* Test-only mode (no capture): 0 = capture, 1 = test-only */
+static int test_only = 0;
 
-/* Luminance contrast: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
-static uint8_t contrast = 71;
+/* Print statistics on exit: 0 = no, 1 = yes */
+static int print_statistics = 0;
 
-/* Luminance brightness: 0 to 255 */
-static uint8_t brightness = 128;
+/* Write the init sequence one control transfer at a time: 0 = no (pipelined), 1 = yes */
+static int serial_init = 0;
 
-/* Luminance aperture factor: 0 = 0, 1 = 0.25, 2 = 0.5, 3 = 1.0 */
-static int luminance_aperture = 1;
+/* Devices to capture from (see --device), as BUS-PORT[.PORT]... or BUS:ADDRESS: none = the first one found */
+static char **device_selection = NULL;
+static int device_selection_count = 0;
 
-/* Video sync and processing algorithm: 1 (Tony Brown), 2 (Michal Demin) */
-static int sync_algorithm = 2;
+/* Capture from every device found: 0 = no, 1 = yes */
+static int all_devices = 0;
 
-/* Video output file descriptor: 1 = stdout (default) */
-static int video_fd = 1;
+/* Number of simulated devices (see --simulate) */
+static int simulated_devices = 1;
 
-/* Control the number of concurrent ISO transfers we have running */
-static int num_iso_transfers = 4;
+/* Number of decode threads: 0 = one per device, up to the number of CPUs */
+static int decode_threads = 0;
 
-/* Test-only mode (no capture): 0 = capture, 1 = test-only */
-static int test_only = 0;
+/* Number of threads converting each frame to the --pixel-format, in bands of lines */
+static int convert_threads = 1;
 
-static void release_usb_device(int ret)
-{
-	fprintf(stderr, "Emergency exit\n");
-	ret = libusb_release_interface(devh, 0);
-	if (!ret) {
-		perror("Failed to release interface");
-	}
-	libusb_close(devh);
-	libusb_exit(NULL);
-	exit(1);
-}
+/* Video output and raw dump filenames, %d is replaced by the device number: NULL = standard output, no dump */
+static char *video_filename = NULL;
+static char *raw_dump_filename = NULL;
 
-static struct libusb_device *find_device(int vendor, int product)
-{
-	struct libusb_device **list;
-	struct libusb_device *dev = NULL;
-	struct libusb_device_descriptor descriptor;
-	struct libusb_device *item;
-	int i;
-	ssize_t count;
-	count = libusb_get_device_list(NULL, &list);
-	for (i = 0; i < count; i++) {
-		item = list[i];
-		libusb_get_device_descriptor(item, &descriptor);
-		if (descriptor.idVendor == vendor && descriptor.idProduct == product) {
-			dev = item;
-		} else {
-			libusb_unref_device(item);
-		}
-	}
-	libusb_free_device_list(list, 0);
-	return dev;
-}
+/* Control socket path (see --control), %d is replaced by the device number: NULL = none */
+static char *control_filename = NULL;
 
-static void print_bytes(unsigned char *bytes, int len)
-{
-	int i;
-	if (len > 0) {
-		for (i = 0; i < len; i++) {
-			fprintf(stderr, "%02x ", (int)bytes[i]);
-		}
-		fprintf(stderr, "\"");
-		for (i = 0; i < len; i++) {
-			fprintf(stderr, "%c", isprint(bytes[i]) ? bytes[i] : '.');
-		}
-		fprintf(stderr, "\"");
-	}
-}
+/* Wait for devices to be plugged in, and capture from each in turn: 0 = no, 1 = yes (see --hotplug) */
+static int hotplug = 0;
 
-#ifdef DEBUG
-static void print_bytes_only(char *bytes, int len)
-{
-	int i;
-	if (len > 0) {
-		for (i = 0; i < len; i++) {
-			if (i % 32 == 0) {
-				fprintf(stderr, "\n%04x\t ", i);
-			}
-			fprintf(stderr, "%02x ", (int)((unsigned char)bytes[i]));
-		}
-	}
-}
-#endif
+/* Firmware for the devices plugged in uninitialized (see --hotplug) */
+static char *firmware_filename = SOMAGIC_FIRMWARE_PATH;
 
-#ifdef DEBUG
-static void trace()
-{
-	void *array[10];
-	size_t size;
+/* Restart the stream of a device that delivers no field for this long, in ms (see --watchdog): 0 = never (default) */
+static int watchdog_timeout = 0;
 
-	/* get void*'s for all entries on the stack */
-	size = backtrace(array, 10);
+/* Restart the stream after this many failed transfers in a row, if the watchdog is enabled */
+#define WATCHDOG_TRANSFER_ERRORS 16
 
-	/* print out all the frames */
-	backtrace_symbols_fd(array, size, 1);
-	exit(1);
-}
-#endif
+/* Complete the transfers on a thread of their own (see --event-thread): 0 = no (main thread), 1 = yes */
+static int event_thread = 0;
 
-/*
- * Write a number of bytes from the iso transfer buffer to the appropriate line and field of the frame buffer.
- * Returns the number of bytes actually used from the buffer
- */
-static int write_buffer(unsigned char *data, unsigned char *end, int count, unsigned char *frame, int line, int field)
-{
-	int dowrite;
-	int line_pos;
-	int lines_per_field = (tv_standard == PAL ? 288 : 240);
-	dowrite = MIN(end - data, count);
+/* SCHED_FIFO priority of the event thread: 0 = normal scheduling */
+static int event_priority = 0;
 
-	line_pos = line * (720 * 2) * 2 + (field * 720 * 2) + ((720 * 2) - count);
+/* CPU the event thread is pinned to: -1 = any */
+static int event_cpu = -1;
 
-	if (line < lines_per_field) {
-		memcpy(line_pos + frame, data, dowrite);
-	}
-	return dowrite;
-}
+/* Set by the event thread once no transfer is pending */
+static atomic_int events_done;
+
+/* How often the main thread looks at the control sockets while the event thread runs */
+#define EVENT_THREAD_POLL_US 20000
+
+/* Video output format: 0 = raw frames, 1 = YUV4MPEG2 stream (see --y4m) */
+static int y4m_output = 0;
+
+/* Pixel format of the video output (see pixel_formats): -1 = UYVY, or planar 4:2:2 with --y4m */
+static int pixel_format = -1;
+
+/* Output each field as soon as it is decoded, as a frame of half the height: 0 = no (frames), 1 = yes (see --field-rate) */
+static int field_rate = 0;
+
+/* The YUV4MPEG2 stream header is on standard output, which stays open from one capture to the next with --hotplug */
+static int y4m_stdout_started = 0;
+
+static volatile sig_atomic_t statistics_requested = 0;
+
+/* Process CPU time when capture started (see print_cpu_stats()) */
+static uint64_t capture_cpu_start = 0;
 
 enum sync_state {
 	HSYNC,
@@ -242,6 +268,9 @@ enum sync_state {
 	REMAINDER
 };
 
+#define ALG1_FRAME_SIZE (720 * 2 * 288 * 2)
+#define ALG2_FRAME_SIZE (720 * 2 * 627 * 2)
+
 struct alg1_video_state_t {
 	int line_remaining;
 	int active_line_count;
@@ -250,164 +279,9 @@ struct alg1_video_state_t {
 
 	enum sync_state state;
 
-	unsigned char frame[720 * 2 * 288 * 2];
+	unsigned char *frame;  /* ALG1_FRAME_SIZE bytes */
 };
 
-static struct alg1_video_state_t alg1_vs = { .line_remaining = 0, .active_line_count = 0, .vblank_found = 0, .field = 0, .state = HSYNC, .frame = { 0 } };
-
-static void alg1_process(struct alg1_video_state_t *vs, unsigned char *buffer, int length)
-{
-	unsigned char *next = buffer;
-	unsigned char *end = buffer + length;
-	int bs = 0; /* bad (lost) sync: 0=no, 1=yes */
-	int hs = 0;
-	int lines_per_field = (tv_standard == PAL ? 288 : 240);
-	unsigned char nc;
-	int skip;
-	int wrote;
-	do {
-		nc = *next;
-		/*
-		 * Timing reference code (TRC):
-		 *     [ff 00 00 SAV] [ff 00 00 EAV]
-		 * Where SAV is 80 or c7, and EAV is 9d or da.
-		 * A line of video will look like (1448 bytes total):
-		 *     [ff 00 00 EAV] [ff 00 00 SAV] [1440 bytes of UYVY video] (repeat on next line)
-		 */
-		switch (vs->state) {
-			case HSYNC:
-				hs++;
-				if (nc == (unsigned char)0xff) {
-					vs->state = SYNCZ1;
-					if (bs == 1) {
-						fprintf(stderr, "resync after %d @%td(%04tx)\n", hs, next - buffer, next - buffer);
-					}
-					bs = 0;
-				} else if (bs != 1) {
-					/*
-					 * The 1st byte in the TRC must be 0xff. It
-					 * wasn't, so sync was either lost or has not
-					 * yet been regained. Sync is regained by
-					 * ignoring bytes until the next 0xff.
-					 */
-					fprintf(stderr, "bad sync on line %d @%td (%04tx)\n", vs->active_line_count, next - buffer, next - buffer);
-					/*
-					 *				print_bytes_only(pbuffer, buffer_pos + 64);
-					 *				print_bytes(pbuffer + buffer_pos, 8);
-					 */
-					bs = 1;
-				}
-				next++;
-				break;
-			case SYNCZ1:
-				if (nc == (unsigned char)0x00) {
-					vs->state = SYNCZ2;
-				} else {
-					/*
-					 * The 2nd byte in the TRC must be 0x00. It
-					 * wasn't, so sync was lost.
-					 */
-					vs->state = HSYNC;
-				}
-				next++;
-				break;
-			case SYNCZ2:
-				if (nc == (unsigned char)0x00) {
-					vs->state = SYNCAV;
-				} else {
-					/*
-					 * The 3rd byte in the TRC must be 0x00. It
-					 * wasn't, so sync was lost.
-					 */
-					vs->state = HSYNC;
-				}
-				next++;
-				break;
-			case SYNCAV:
-				/*
-				 * Found 0xff 0x00 0x00, now expecting SAV or EAV. Might
-				 * also be the SDID (sliced data ID), 0x00.
-				 */
-				if (nc == (unsigned char)0x00) {
-					/*
-					 * SDID detected, so we still haven't found the
-					 * active YUV data.
-					 */
-					vs->state = HSYNC;
-					next++;
-					break;
-				}
-
-				/*
-				 * H = Bit 4 (mask 0x10).
-				 * 0: in SAV, 1: in EAV.
-				 */
-				if (nc & (unsigned char)0x10) {
-					/* EAV (end of active data) */
-					vs->state = HSYNC;
-				} else {
-					/* SAV (start of active data) */
-					/*
-						* F (field bit) = Bit 6 (mask 0x40).
-						* 0: first field, 1: 2nd field.
-						*/
-					vs->field = (nc & (unsigned char)0x40) ? 1 : 0;
-					/*
-						* V (vertical blanking bit) = Bit 5 (mask 0x20).
-						* 1: in VBI, 0: in active video.
-						*/
-					if (nc & (unsigned char)0x20) {
-						/* VBI (vertical blank) */
-						vs->state = VBLANK;
-						vs->vblank_found++;
-						if (vs->active_line_count > (lines_per_field - 8)) {
-							if (vs->field == 0) {
-								if (frames_generated < frame_count || frame_count == -1) {
-									write(video_fd, vs->frame, 720 * 2 * lines_per_field * 2);
-									frames_generated++;
-								}
-								if (frames_generated >= frame_count && frame_count != -1) {
-									stop_sending_requests = 1;
-								}
-							}
-							vs->vblank_found = 0;
-						}
-						vs->active_line_count = 0;
-					} else {
-						/* Line is active video */
-						vs->state = VACTIVE;
-					}
-					vs->line_remaining = 720 * 2;
-				}
-				next++;
-				break;
-			case VBLANK:
-			case VACTIVE:
-			case REMAINDER:
-				if (vs->state == VBLANK || vs->vblank_found < 20) {
-					skip = MIN(vs->line_remaining, (end - next));
-					vs->line_remaining -= skip;
-					next += skip ;
-				} else {
-					wrote = write_buffer(next, end, vs->line_remaining, vs->frame, vs->active_line_count, vs->field);
-					vs->line_remaining -= wrote;
-					next += wrote;
-					if (vs->line_remaining <= 0) {
-						vs->active_line_count++;
-					}
-				}
-				if (vs->line_remaining <= 0) {
-					vs->state = HSYNC;
-				} else {
-					vs->state = REMAINDER;
-					/* no more data in this buffer. exit loop */
-					next = end;
-				}
-				break;
-		} /* end switch */
-	} while (next < end);
-}
-
 struct alg2_video_state_t {
 	uint16_t line;
 	uint16_t col;
@@ -417,699 +291,6143 @@ struct alg2_video_state_t {
 	uint8_t field;
 	uint8_t blank;
 
-	unsigned char frame[720 * 2 * 627 * 2];
+	unsigned char *frame;  /* ALG2_FRAME_SIZE bytes */
 };
 
-static struct alg2_video_state_t alg2_vs = { .line = 0, .col = 0, .state = HSYNC, .field = 0, .blank = 0, .frame = { 0 } };
-
-static void alg2_put_data(struct alg2_video_state_t *vs, uint8_t c)
-{
-	int line_pos;
+/*
+ * Bounded single-producer/single-consumer ring of preallocated buffers.
+ * Each slot carries a sequence number: a slot is free for the producer when
+ * its sequence equals twice the producer position, and holds data for the
+ * consumer when it equals twice the consumer position + 1, which keeps the
+ * two apart even in a ring of one slot. The consumer swaps the buffer of
+ * the slot it pops with a spare buffer of its own, so the slot is free again
+ * at once. Besides the consumer, only the producer moves the consumer
+ * position, and only to discard the oldest entry.
+ */
+struct ring_t {
+	unsigned char *buffer;
+	unsigned char **slot;
+	unsigned char *spare;  /* owned by the consumer */
+	size_t *length;
+	size_t slot_size;
+	int slots;
+
+	atomic_size_t *seq;
+	atomic_size_t head;  /* producer position */
+	atomic_size_t tail;  /* consumer position */
+
+	atomic_int closed;
+	atomic_int waiting;  /* producer is waiting for a free slot */
+	sem_t filled;
+	sem_t freed;
+	sem_t *notify;       /* posted for every entry pushed, &filled unless set otherwise */
+};
 
-	line_pos = (2 * vs->line + vs->field) * (720 * 2) + vs->col;
-	vs->col++;
+/*
+ * Decode worker. The decode work of all devices is spread over a pool of
+ * these; each device is decoded by one worker, so its sync algorithm state
+ * is only ever touched by one thread.
+ */
+struct decode_worker_t {
+	pthread_t thread;
+	sem_t work;          /* posted for every transfer queued to one of its devices */
+	atomic_int closed;
+};
 
-	/* sanity check */
-	if (vs->col > 720 * 2)
-		vs->col = 720 * 2;
+/* A band of lines of a frame to convert (see convert_frame_banded()) */
+struct convert_band_t {
+	pthread_t thread;
+	sem_t work;          /* posted when the band is set */
+	sem_t done;          /* posted when it is converted */
+	atomic_int closed;
+	int format;
+	uint8_t *dst;
+	const uint8_t *src;
+	int height;
+	int field;
+	int first;
+	int last;
+};
 
-	vs->frame[line_pos] = c;
-}
+/*
+ * Registers as last written to, or read back from, the device
+ * (see shadow_update()): all SAA7113 subaddresses, and the bridge
+ * registers written by somagic_init() and somagic_capture(). The LCR
+ * registers are also kept as the SAA7113 reset left them, if read back
+ * (see somagic_read_lcr()).
+ */
+#define BRIDGE_SHADOW_MAX 16
+#define LCR_FIRST 0x41
+#define LCR_COUNT 21
+
+struct register_shadow_t {
+	uint8_t saa7113[0x100];
+	uint8_t saa7113_valid[0x100 / 8];
+	uint16_t bridge_reg[BRIDGE_SHADOW_MAX];
+	uint8_t bridge_val[BRIDGE_SHADOW_MAX];
+	int bridge_count;
+	uint8_t lcr_reset[LCR_COUNT];
+	int lcr_reset_valid;
+};
 
-static void alg2_process(struct alg2_video_state_t *vs, uint8_t c)
-{
-	/*
-	 * Timing reference code (TRC):
-	 *     [ff 00 00 SAV] [ff 00 00 EAV]
-	 * A line of video will look like (1448 bytes total):
-	 *     [ff 00 00 EAV] [ff 00 00 SAV] [1440 bytes of UYVY video] (repeat on next line)
-	 */
-	if (vs->state == HSYNC) {
-		if (c == 0xff) {
-			/* The 1st byte in the TRC must be 0xff. */
-			vs->state++;
-		} else {
-			alg2_put_data(vs, c);
-		}
-	} else if (vs->state == SYNCZ1) {
-		if (c == 0x00) {
-			vs->state++;
-		} else {
-			/*
-			 * The 2nd byte in the TRC must be 0x00. It
-			 * wasn't, so sync was lost.
-			 */
-			vs->state = HSYNC;
+/*
+ * Control socket of a device (see --control), and the command line being
+ * read from its client. The settings are those the control commands have
+ * asked for: they are changed by the thread serving the socket, and copied
+ * to the device under lock by the event loop (see capture_reconfigure()).
+ */
+#define CONTROL_LINE_MAX 128
+
+struct control_settings_t {
+	int input_type;
+	int cvbs_input;
+	int luminance_mode;
+	int luminance_prefilter;
+	int luminance_aperture;
+	uint8_t hue;
+	uint8_t saturation;
+	uint8_t contrast;
+	uint8_t brightness;
+};
 
-			alg2_put_data(vs, 0xff);
-			alg2_put_data(vs, c);
-		}
-	} else if (vs->state == SYNCZ2) {
-		if (c == 0x00) {
-			vs->state++;
-		} else {
-			/*
-			 * The 3rd byte in the TRC must be 0x00. It
-			 * wasn't, so sync was lost.
-			 */
-			vs->state = HSYNC;
+struct control_socket_t {
+	char *path;
+	int listen_fd;
+	int client_fd;
+	char line[CONTROL_LINE_MAX];
+	int line_length;
+	pthread_mutex_t lock;
+	struct control_settings_t settings;
+};
 
-			alg2_put_data(vs, 0xff);
-			alg2_put_data(vs, 0x00);
-			alg2_put_data(vs, c);
-		}
-	} else if (vs->state == SYNCAV) {
-		/*
-		 * Found 0xff 0x00 0x00, now expecting SAV or EAV. Might
-		 * also be the SDID (sliced data ID), 0x00.
-		 */
-		vs->state = HSYNC;
-		if (c == 0x00) {
-			/*
-			 * SDID (sliced data ID) detected, so active YUV data
-			 * still hasn't been found.
-			 */
-			return;
-		}
+/* A control change waits for the end of a field, but no longer than this if no field ends (see capture_reconfigure()) */
+#define RECONFIGURE_WAIT_US 100000
 
-		/*
-		 * H = Bit 4 (mask 0x10).
-		 * 0: in SAV, 1: in EAV.
-		 */
-		if (c & 0x10) {
-			/* EAV (end of active data) */
-			if (!vs->blank) {
-				vs->line++;
-				vs->col = 0;
-				if (vs->line > 625) vs->line = 625; /* sanity check */
-			}
-		} else {
-			int field_edge;
-			int blank_edge;
+struct somagic_device;
 
-			/* SAV (start of active data) */
-			/*
-			 * F (field bit) = Bit 6 (mask 0x40).
-			 * 0: first field, 1: 2nd field.
-			 *
-			 * V (vertical blanking bit) = Bit 5 (mask 0x20).
-			 * 0: in VBI, 1: in active video.
-			 */
-			field_edge = vs->field;
-			blank_edge = vs->blank;
+/*
+ * USB transport. The device is normally reached through libusb, but can be
+ * replaced by a simulation of it (see --simulate). The functions follow their
+ * libusb counterparts, for the device opened by open().
+ */
+struct transport_t {
+	int (*open)(struct somagic_device *dev);
+	void (*close)(struct somagic_device *dev);
+	int (*claim_interface)(struct somagic_device *dev, int interface_number);
+	int (*release_interface)(struct somagic_device *dev, int interface_number);
+	int (*set_configuration)(struct somagic_device *dev, int configuration);
+	int (*set_interface_alt_setting)(struct somagic_device *dev, int interface_number, int alternate_setting);
+	int (*get_descriptor)(struct somagic_device *dev, uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length);
+	int (*control_transfer)(struct somagic_device *dev, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+	int (*submit_transfer)(struct somagic_device *dev, struct libusb_transfer *tfr);
+	int (*cancel_transfer)(struct somagic_device *dev, struct libusb_transfer *tfr);
+	int (*handle_events)(void);  /* for all devices on this transport */
+	int (*hotplug_register)(void);  /* report devices plugged in and out to hotplug_queue_add() */
+	unsigned char *(*dev_mem_alloc)(struct somagic_device *dev, size_t length);  /* NULL = not supported */
+	void (*dev_mem_free)(struct somagic_device *dev, unsigned char *buffer, size_t length);
+};
 
-			vs->field = (c & 0x40) ? 1 : 0;
-			vs->blank = (c & 0x20) ? 1 : 0;
+/*
+ * A capture device: its options, the transport it is reached through, and
+ * all capture, decode and output state. Functions that talk to the device or
+ * handle its data take it as their first argument.
+ */
+struct somagic_device {
+	const struct transport_t *transport;
+	struct libusb_device *usb_dev;      /* device to open, found by find_devices() */
+	int product;                        /* USB product id, ORIGINAL_PRODUCT before the firmware upload */
+	struct libusb_device_handle *devh;
+	struct sim_device_t *sim;           /* simulated device state (see --simulate) */
+	int index;                          /* device number, from 0 */
+	char name[32];                      /* BUS-PORT[.PORT]..., or simN */
+	char prefix[40];                    /* name for messages, empty with a single device */
 
-			field_edge = vs->field ^ field_edge;
-			blank_edge = vs->blank ^ blank_edge;
+	/* Options */
+	/* Control the number of frames to generate: -1 = unlimited (default) */
+	int frame_count;
 
-			if (vs->field == 0 && field_edge) {
-				if (frames_generated < frame_count || frame_count == -1) {
-					write(video_fd, vs->frame, 720 * 2 * lines_per_field * 2);
-					frames_generated++;
-				}
-				if (frames_generated >= frame_count && frame_count != -1) {
-					stop_sending_requests = 1;
-				}
-			}
+	/* Television standard (see tv_standards) */
+	int tv_standard;
 
-			if (vs->blank == 0 && blank_edge) {
-				vs->line = 0;
-				vs->col = 0;
-			}
-		}
-	}
-}
+	/* Input type select (see Input types) */
+	int input_type;
 
-static void gotdata(struct libusb_transfer *tfr)
-{
-	int ret;
-	int num = tfr->num_iso_packets;
-	int i;
-	unsigned char *data;
-	int length;
-	int pos;
-	int k;
+	/* CVBS input select */
+	int cvbs_input;
 
-	pending_requests--;
+	/* Luminance mode (CVBS only): 0 = 4.1 MHz, 1 = 3.8 MHz, 2 = 2.6 MHz, 3 = 2.9 MHz */
+	int luminance_mode;
 
-	for (i = 0; i < num; i++) {
-		data = libusb_get_iso_packet_buffer_simple(tfr, i);
-		length = tfr->iso_packet_desc[i].actual_length;
-		pos = 0;
+	/* Luminance prefilter: 0 = bypassed, 1 = active */
+	int luminance_prefilter;
 
-		while (pos < length) {
-			/*
-			 * Within each packet of the transfer, the video data is divided
-			 * into blocks of 0x400 bytes beginning with [0xaa 0xaa 0x00 0x00].
-			 * Check for this signature and process each block of data individually.
-			 */
-			if (data[pos] == 0xaa && data[pos + 1] == 0xaa && data[pos + 2] == 0x00 && data[pos + 3] == 0x00) {
-				/* Process received video data, excluding the 4 marker bytes */
-				switch (sync_algorithm) {
-				case 1:
-					alg1_process(&alg1_vs, data + 4 + pos, 0x400 - 4);
-					break;
-				case 2:
-					for (k = 4; k < 0x400; k++) {
-						alg2_process(&alg2_vs, data[k + pos]);
-					}
-					break;
-				}
-			} else {
-				fprintf(stderr, "Unexpected block, expected [aa aa 00 00] found [%02x %02x %02x %02x]\n", data[pos], data[pos + 1], data[pos + 2], data[pos + 3]);
-			}
-			pos += 0x400;
-		}
-	}
+	/* Hue phase in degrees: -128 to 127 (-180 to 178.59375), increments of 1.40625 degrees */
+	uint8_t hue;
 
-	if (!stop_sending_requests) {
-		ret = libusb_submit_transfer(tfr);
-		if (ret) {
-			fprintf(stderr, "libusb_submit_transfer failed with error %d\n", ret);
-			exit(1);
-		}
-		pending_requests++;
-	}
-}
+	/* Chrominance saturation: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
+	uint8_t saturation;
 
-static int somagic_write_reg(uint16_t reg, uint8_t val)
-{
-	int ret;
-	uint8_t buf[8];
+	/* Luminance contrast: -128 to 127 (1.984375 to -2.000000), increments of 0.015625 */
+	uint8_t contrast;
 
-	memcpy(buf, "\x0b\x00\x00\x82\x01\x00\x3a\x00", 8);
-	buf[5] = reg >> 8;
-	buf[6] = reg & 0xff;
-	buf[7] = val;
+	/* Luminance brightness: 0 to 255 */
+	uint8_t brightness;
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
-	if (ret != 8) {
-		fprintf(stderr, "write reg control msg returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
-		fprintf(stderr, "\n");
-	}
+	/* Luminance aperture factor: 0 = 0, 1 = 0.25, 2 = 0.5, 3 = 1.0 */
+	int luminance_aperture;
 
-	return ret;
-}
+	/* Video sync and processing algorithm: 1 (Tony Brown), 2 (Michal Demin) */
+	int sync_algorithm;
 
-static int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
-{
-	int ret;
-	uint8_t buf[8];
+	/* Video output file descriptor: 1 = stdout (default) */
+	int video_fd;
 
-	memcpy(buf, "\x0b\x4a\xc0\x01\x01\x01\x08\xf4", 8);
+	/* Control the number of concurrent ISO transfers we have running, and their packets */
+	int num_iso_transfers;
+	int iso_packets;
 
-	buf[1] = dev_addr;
-	buf[5] = reg;
-	buf[6] = val;
+	/* Iso transfer autotuning goal (see autotune_goals) */
+	int autotune;
 
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
-	if (ret != 8) {
-		fprintf(stderr, "write_i2c returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
-		fprintf(stderr, "\n");
-	}
+	/* Memory for the iso buffers (see iso_memory_types) */
+	int iso_memory;
 
-	return ret;
-}
+	/* Most consecutive I2C registers written per control transfer: 1 = no bursts */
+	int i2c_burst_max;
+	int i2c_burst_ok;  /* the firmware has accepted a burst */
 
-static int somagic_capture()
-{
-	int ret;
-	int i = 0;
+	/* Completed transfers that may wait for a decode thread: 0 = decode in the USB callback */
+	int decode_buffers;
+
+	/* Raw iso stream dump file descriptors (see --raw-dump): -1 = no dump (default) */
+	int raw_dump_fd;
+	int raw_index_fd;
+
+	/* Number of completed frames that may wait for the writer thread */
+	int queue_length;
 
-	/* buffers and transfer pointers for isochronous data */
+	/* Frame queue policy (see queue_policies) */
+	int queue_policy;
+
+	/* Startup times (see timestamp_us()): 0 = not yet */
+	uint64_t init_start;
+	uint64_t init_done;
+	atomic_uint_least64_t first_frame;
+
+	/* Control transfers of somagic_write_sequence() and firmware_upload() */
+	struct control_pipeline_t *pipeline;
+	struct firmware_upload_t *upload;
+
+	/* Register shadow, and a request to apply changed options while capturing (see capture_reconfigure()) */
+	struct register_shadow_t shadow;
+	atomic_int reconfigure;
+	int reconfigure_fields;    /* fields_decoded when the request was latched */
+	uint64_t reconfigure_time; /* when it was latched: 0 = not yet */
+
+	/* Control socket: NULL = none */
+	struct control_socket_t *control;
+
+	/* Capture state */
+	int lines_per_field;
+	int frames_generated;
+	int top_field_queued;  /* with --field-rate: the last field queued is a top field */
+	atomic_int fields_decoded;
+	atomic_int stop_sending_requests;
+	int pending_requests;
+	int unplugged;
+	int restarting;  /* do not resubmit, capture_restart() is waiting for the transfers */
+
+	/* Stall watchdog (see capture_watchdog()): fields_decoded when last seen to change, and when */
+	int watchdog_fields;
+	uint64_t watchdog_time;
+	int transfer_error_run;  /* failed transfers in a row */
+	uint64_t stall_time;     /* when the stall was detected: 0 = streaming */
+
+	/* Iso transfers and their buffers, and those not in flight */
 	struct libusb_transfer **tfr;
-	unsigned char (*isobuf)[64 * 3072];
+	unsigned char (*isobuf)[ISO_PACKETS * ISO_PACKET_SIZE];
+	int isobuf_type;      /* memory isobuf is in (see iso_memory_types) */
+	size_t isobuf_size;
+	struct libusb_transfer **idle;
+	int idle_count;
+	int iso_depth;  /* transfers kept in flight, up to num_iso_transfers */
+
+	/* Autotune measurements since autotune_start, and the time in flight aimed at */
+	uint64_t autotune_start;
+	uint64_t last_callback;
+	uint64_t max_callback_gap;
+	int callbacks;
+	int packets_seen;
+	int packets_lost;
+	uint64_t cover_us;
+
+	/* Sync algorithm state, owned by the decode worker while capture is running */
+	struct alg1_video_state_t alg1_vs;
+	struct alg2_video_state_t alg2_vs;
+
+	/* Completed frames, written to video_fd by the writer thread */
+	struct ring_t video_queue;
+	pthread_t video_writer_thread;
+
+	/* Completed transfers (iso_chunk_t), processed by a decode worker */
+	struct ring_t iso_queue;
+	struct decode_worker_t *worker;
+
+	/* Raw dump chunks (raw_chunk_t), written by the dump thread */
+	struct ring_t raw_queue;
+	pthread_t raw_dump_thread;
+
+	/* Chunk being filled by the USB callback, and the dump file offset of its end */
+	struct raw_chunk_t *raw_chunk;
+	uint64_t raw_offset;
+	uint32_t raw_sequence;
+
+	/* Statistics */
+	atomic_int frames_written;
+	atomic_int frame_write_errors;
+	int frames_dropped_oldest;
+	int frames_dropped_newest;
+	int transfers_dropped;
+	int transfer_errors;
+	int packet_errors;
+	int short_packets;
+	int autotune_changes;
+	int raw_transfers_dropped;
+	atomic_int raw_write_errors;
+	int resubmit_errors;
+	int stream_restarts;
+	int stream_recoveries;
+	uint64_t recovery_time_last;
+	uint64_t recovery_time_total;
+
+	struct somagic_device *next;
+};
 
-	/* Allocate memory for tfr and isobuf */
-	tfr = malloc(num_iso_transfers * sizeof *tfr);
-	if (tfr == NULL) {
-		perror("Failed to allocate memory for tfr");
-		return 1;
+static const struct transport_t usb_transport;
+
+/* All devices, in device number order */
+static struct somagic_device *device_list = NULL;
+static int device_count = 0;
+
+/* Allocate a device with the default options */
+static struct somagic_device *somagic_device_alloc()
+{
+	struct somagic_device *dev;
+
+	dev = calloc(1, sizeof *dev);
+	if (dev == NULL) {
+		return NULL;
 	}
-	isobuf = malloc(num_iso_transfers * sizeof *isobuf);
-	if (isobuf == NULL) {
-		perror("Failed to allocate memory for isobuf");
-		return 1;
+	dev->transport = &usb_transport;
+	dev->frame_count = -1;
+	dev->tv_standard = PAL;
+	dev->input_type = CVBS;
+	dev->cvbs_input = VIDEO3;
+	dev->hue = 0;
+	dev->saturation = 64;
+	dev->contrast = 71;
+	dev->brightness = 128;
+	dev->luminance_aperture = 1;
+	dev->sync_algorithm = 2;
+	dev->video_fd = 1;
+	dev->num_iso_transfers = 4;
+	dev->iso_packets = ISO_PACKETS;
+	dev->i2c_burst_max = I2C_BURST_MAX;
+	dev->decode_buffers = 16;
+	dev->raw_dump_fd = -1;
+	dev->raw_index_fd = -1;
+	dev->queue_length = 4;
+	dev->queue_policy = QUEUE_BLOCK;
+	dev->alg1_vs.state = HSYNC;
+	dev->alg2_vs.state = HSYNC;
+	atomic_init(&dev->fields_decoded, 0);
+	atomic_init(&dev->stop_sending_requests, 0);
+	atomic_init(&dev->frames_written, 0);
+	atomic_init(&dev->frame_write_errors, 0);
+	atomic_init(&dev->raw_write_errors, 0);
+	atomic_init(&dev->first_frame, 0);
+	atomic_init(&dev->reconfigure, 0);
+	return dev;
+}
+
+/* Allocate a device with the default options, and add it to the end of device_list */
+static struct somagic_device *somagic_device_new()
+{
+	struct somagic_device **item;
+	struct somagic_device *dev;
+
+	dev = somagic_device_alloc();
+	if (dev == NULL) {
+		return NULL;
 	}
+	for (item = &device_list; *item != NULL; item = &(*item)->next);
+	*item = dev;
+	dev->index = device_count++;
+	sprintf(dev->name, "%d", dev->index);
+	return dev;
+}
 
-	if (!test_only) {
-		for (i = 0; i < num_iso_transfers; i++)	{
-			tfr[i] = libusb_alloc_transfer(64);
-			if (tfr[i] == NULL) {
-				fprintf(stderr, "%s: Failed to allocate USB transfer #%d: %s\n", program_path, i, strerror(errno));
-				return 1;
-			}
-			libusb_fill_iso_transfer(tfr[i], devh, 0x00000082, isobuf[i], 64 * 3072, 64, gotdata, NULL, 2000);
-			libusb_set_iso_packet_lengths(tfr[i], 3072);
-		}
+/* Give a device the options of another */
+static void somagic_device_copy_options(struct somagic_device *dev, const struct somagic_device *src)
+{
+	dev->transport = src->transport;
+	dev->frame_count = src->frame_count;
+	dev->tv_standard = src->tv_standard;
+	dev->input_type = src->input_type;
+	dev->cvbs_input = src->cvbs_input;
+	dev->luminance_mode = src->luminance_mode;
+	dev->luminance_prefilter = src->luminance_prefilter;
+	dev->hue = src->hue;
+	dev->saturation = src->saturation;
+	dev->contrast = src->contrast;
+	dev->brightness = src->brightness;
+	dev->luminance_aperture = src->luminance_aperture;
+	dev->sync_algorithm = src->sync_algorithm;
+	dev->num_iso_transfers = src->num_iso_transfers;
+	dev->iso_packets = src->iso_packets;
+	dev->autotune = src->autotune;
+	dev->iso_memory = src->iso_memory;
+	dev->i2c_burst_max = src->i2c_burst_max;
+	dev->decode_buffers = src->decode_buffers;
+	dev->queue_length = src->queue_length;
+	dev->queue_policy = src->queue_policy;
+}
 
-		pending_requests = num_iso_transfers;
-		for (i = 0; i < num_iso_transfers; i++) {
-			ret = libusb_submit_transfer(tfr[i]);
-			if (ret) {
-				fprintf(stderr, "%s: Failed to submit request #%d for transfer: %s\n", program_path, i, strerror(errno));
-				return 1;
-			}
-		}
+/* Allocate a device with the options of another, and add it to the end of device_list */
+static struct somagic_device *somagic_device_clone(const struct somagic_device *src)
+{
+	struct somagic_device *dev;
 
-		somagic_write_reg(0x1800, 0x0d);
+	dev = somagic_device_new();
+	if (dev == NULL) {
+		return NULL;
+	}
+	somagic_device_copy_options(dev, src);
+	return dev;
+}
 
-		while (pending_requests > 0) {
-			libusb_handle_events(NULL);
-		}
+static void somagic_device_free(struct somagic_device *dev)
+{
+	struct somagic_device **item;
 
-		for (i = 0; i < num_iso_transfers; i++) {
-			libusb_free_transfer(tfr[i]);
+	for (item = &device_list; *item != NULL; item = &(*item)->next) {
+		if (*item == dev) {
+			*item = dev->next;
+			break;
 		}
 	}
+	if (dev->usb_dev != NULL) {
+		libusb_unref_device(dev->usb_dev);
+	}
+	free(dev->alg1_vs.frame);
+	free(dev->alg2_vs.frame);
+	free(dev);
+}
 
-	ret = libusb_release_interface(devh, 0);
-	if (ret) {
-		perror("Failed to release interface");
-		return 1;
+/* Prefix for the messages about a device: its name when there are several devices */
+static const char *device_prefix(struct somagic_device *dev)
+{
+	if (device_count < 2) {
+		return "";
 	}
-	libusb_close(devh);
-	libusb_exit(NULL);
+	snprintf(dev->prefix, sizeof dev->prefix, "%s: ", dev->name);
+	return dev->prefix;
+}
 
-	/* Close video output file */
-	if (video_fd != 1) {
-		ret = close(video_fd);
-		if (ret) {
-			perror("Failed to close video output file");
+/* libusb context shared by all devices, created by usb_init() */
+static libusb_context *usb_context = NULL;
+
+static int usb_init()
+{
+	if (usb_context == NULL) {
+		if (libusb_init(&usb_context)) {
+			fprintf(stderr, "Failed to initialize libusb\n");
 			return 1;
 		}
+		libusb_set_debug(usb_context, 0);
 	}
-
 	return 0;
 }
 
-static int somagic_init()
+/*
+ * Devices plugged in and out (see --hotplug), queued by the transport for
+ * hotplug_poll(), as the libusb hotplug callback may not talk to devices
+ * itself. Simulated devices have no usb_dev, they are told apart by product.
+ */
+#define HOTPLUG_QUEUE_MAX 32
+
+struct hotplug_event_t {
+	struct libusb_device *usb_dev;  /* referenced while queued */
+	int product;
+	int arrived;
+};
+
+static struct {
+	struct hotplug_event_t queue[HOTPLUG_QUEUE_MAX];
+	int queue_count;
+	struct hotplug_event_t waiting[HOTPLUG_QUEUE_MAX];  /* initialized devices not captured from */
+	int waiting_count;
+	struct somagic_device *active;  /* device being captured from */
+	unsigned char *firmware;
+	int firmware_length;
+	int connections;  /* devices captured from so far, numbers the output files */
+} hotplug_state;
+
+static void hotplug_queue_add(struct libusb_device *usb_dev, int product, int arrived)
 {
-	int p;
-	int ret;
-	struct libusb_device *dev;
-	uint8_t work;
+	struct hotplug_event_t *event;
 
-	/* buffer for control messages */
-	unsigned char buf[65535];
+	if (hotplug_state.queue_count == HOTPLUG_QUEUE_MAX) {
+		fprintf(stderr, "%s: Too many USB devices plugged in or out at once, ignoring %04x:%04x\n", program_path, VENDOR, product);
+		return;
+	}
+	event = &hotplug_state.queue[hotplug_state.queue_count++];
+	event->usb_dev = (usb_dev != NULL) ? libusb_ref_device(usb_dev) : NULL;
+	event->product = product;
+	event->arrived = arrived;
+}
 
-	libusb_init(NULL);
-	libusb_set_debug(NULL, 0);
+/* Order USB devices by bus and port path, so device numbers do not change between runs */
+static int usb_device_compare(const void *a, const void *b)
+{
+	struct libusb_device *dev_a = *(struct libusb_device * const *)a;
+	struct libusb_device *dev_b = *(struct libusb_device * const *)b;
+	uint8_t ports_a[8];
+	uint8_t ports_b[8];
+	int count_a;
+	int count_b;
+	int i;
 
-	for (p = 0; p < PRODUCT_COUNT; p++) {
-		dev = find_device(VENDOR, PRODUCT[p]);
-		if (dev) {
-			break;
-		}
+	if (libusb_get_bus_number(dev_a) != libusb_get_bus_number(dev_b)) {
+		return libusb_get_bus_number(dev_a) - libusb_get_bus_number(dev_b);
 	}
-	if (p >= PRODUCT_COUNT) {
-		for (p = 0; p < PRODUCT_COUNT; p++) {
-			fprintf(stderr, "USB device %04x:%04x was not found.\n", VENDOR, PRODUCT[p]);
+	count_a = libusb_get_port_numbers(dev_a, ports_a, sizeof ports_a);
+	count_b = libusb_get_port_numbers(dev_b, ports_b, sizeof ports_b);
+	for (i = 0; i < count_a && i < count_b; i++) {
+		if (ports_a[i] != ports_b[i]) {
+			return ports_a[i] - ports_b[i];
 		}
-		fprintf(stderr, "Has device initialization been performed?\n");
-		return 1;
 	}
+	return count_a - count_b;
+}
 
-	ret = libusb_open(dev, &devh);
-	if (!devh) {
-		perror("Failed to open USB device");
-		return 1;
-	}
-	libusb_unref_device(dev);
+/* Name a USB device by its position, as BUS-PORT[.PORT]... */
+static void usb_device_name(struct libusb_device *usb_dev, char *name, size_t size)
+{
+	uint8_t ports[8];
+	size_t length;
+	int count;
+	int i;
 
-	signal(SIGTERM, release_usb_device);
-	ret = libusb_claim_interface(devh, 0);
-	if (ret) {
-		perror("Failed to claim device interface");
-		if (ret == LIBUSB_ERROR_BUSY) {
-			fprintf(stderr, "Is "PROGRAM_NAME" already running?\n");
-		}
-		return 1;
+	length = snprintf(name, size, "%d", libusb_get_bus_number(usb_dev));
+	count = libusb_get_port_numbers(usb_dev, ports, sizeof ports);
+	for (i = 0; i < count && length < size; i++) {
+		length += snprintf(name + length, size - length, "%c%d", i == 0 ? '-' : '.', ports[i]);
 	}
+}
 
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
-	if (ret) {
-		perror("Failed to set active alternate setting for interface");
-		return 1;
-	}
+/* Check a USB device against a --device argument, BUS-PORT[.PORT]... or BUS:ADDRESS */
+static int usb_device_matches(struct libusb_device *usb_dev, const char *selection)
+{
+	char name[32];
+	int bus;
+	int address;
+	char end;
 
-	ret = libusb_get_descriptor(devh, 0x0000001, 0x0000000, buf, 18);
-	if (ret != 18) {
-		fprintf(stderr, "1 get descriptor returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
-		fprintf(stderr, "\n");
+	if (sscanf(selection, "%d:%d%c", &bus, &address, &end) == 2) {
+		return bus == libusb_get_bus_number(usb_dev) && address == libusb_get_device_address(usb_dev);
 	}
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 9);
-	if (ret != 9) {
-		fprintf(stderr, "2 get descriptor returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
+	usb_device_name(usb_dev, name, sizeof name);
+	return strcmp(name, selection) == 0;
+}
+
+/*
+ * Find the devices to capture from: those given with --device, in that order,
+ * all of them with --all-devices, or else the first one. The first device
+ * found is assigned to dev, the others get a copy of its options.
+ */
+static int find_devices(struct somagic_device *dev)
+{
+	struct libusb_device **list;
+	struct libusb_device **found;
+	struct libusb_device **chosen;
+	struct libusb_device_descriptor descriptor;
+	struct somagic_device *item;
+	ssize_t count;
+	int found_count = 0;
+	int selected = 0;
+	int ret = 0;
+	int i;
+	int p;
+	int q;
+
+	if (dev->transport != &usb_transport) {
+		for (i = 0; i < simulated_devices; i++) {
+			item = (i == 0) ? dev : somagic_device_clone(dev);
+			if (item == NULL) {
+				perror("Failed to allocate memory for the device");
+				return 1;
+			}
+			sprintf(item->name, "sim%d", i);
+		}
+		return 0;
+	}
+
+	if (usb_init()) {
+		return 1;
+	}
+	count = libusb_get_device_list(usb_context, &list);
+	if (count < 0) {
+		fprintf(stderr, "Failed to list USB devices: %s\n", libusb_error_name((int)count));
+		return 1;
+	}
+	found = malloc((count + 1) * sizeof *found);
+	chosen = malloc((count + 1) * sizeof *chosen);
+	if (found == NULL || chosen == NULL) {
+		perror("Failed to allocate memory for the device list");
+		free(found);
+		free(chosen);
+		libusb_free_device_list(list, 1);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		libusb_get_device_descriptor(list[i], &descriptor);
+		for (p = 0; p < PRODUCT_COUNT; p++) {
+			if (descriptor.idVendor == VENDOR && descriptor.idProduct == PRODUCT[p]) {
+				found[found_count++] = list[i];
+				break;
+			}
+		}
+	}
+	qsort(found, found_count, sizeof *found, usb_device_compare);
+
+	if (found_count == 0) {
+		for (p = 0; p < PRODUCT_COUNT; p++) {
+			fprintf(stderr, "USB device %04x:%04x was not found.\n", VENDOR, PRODUCT[p]);
+		}
+		fprintf(stderr, "Has device initialization been performed?\n");
+		ret = 1;
+	} else if (device_selection_count > 0) {
+		for (i = 0; i < device_selection_count && !ret; i++) {
+			for (p = 0; p < found_count && !usb_device_matches(found[p], device_selection[i]); p++);
+			if (p == found_count) {
+				fprintf(stderr, "%s: USB device %s was not found\n", program_path, device_selection[i]);
+				ret = 1;
+				continue;
+			}
+			/* The same device may be given by position and by address */
+			for (q = 0; q < selected && chosen[q] != found[p]; q++);
+			if (q < selected) {
+				fprintf(stderr, "%s: USB device %s was selected more than once\n", program_path, device_selection[i]);
+				ret = 1;
+			} else {
+				chosen[selected++] = found[p];
+			}
+		}
+	} else {
+		selected = all_devices ? found_count : 1;
+		memcpy(chosen, found, selected * sizeof *chosen);
+	}
+
+	for (i = 0; i < selected && !ret; i++) {
+		item = (i == 0) ? dev : somagic_device_clone(dev);
+		if (item == NULL) {
+			perror("Failed to allocate memory for the device");
+			ret = 1;
+			break;
+		}
+		item->usb_dev = libusb_ref_device(chosen[i]);
+		usb_device_name(chosen[i], item->name, sizeof item->name);
+	}
+	free(found);
+	free(chosen);
+	libusb_free_device_list(list, 1);
+	return ret;
+}
+
+static void print_bytes(unsigned char *bytes, int len)
+{
+	int i;
+	if (len > 0) {
+		for (i = 0; i < len; i++) {
+			fprintf(stderr, "%02x ", (int)bytes[i]);
+		}
+		fprintf(stderr, "\"");
+		for (i = 0; i < len; i++) {
+			fprintf(stderr, "%c", isprint(bytes[i]) ? bytes[i] : '.');
+		}
+		fprintf(stderr, "\"");
+	}
+}
+
+static uint64_t timestamp_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int usb_open(struct somagic_device *dev)
+{
+	libusb_open(dev->usb_dev, &dev->devh);
+	if (!dev->devh) {
+		fprintf(stderr, "%s: Failed to open USB device %s\n", program_path, dev->name);
+		return 1;
+	}
+	return 0;
+}
+
+static void usb_close(struct somagic_device *dev)
+{
+	libusb_close(dev->devh);
+	dev->devh = NULL;
+}
+
+static int usb_claim_interface(struct somagic_device *dev, int interface_number)
+{
+	return libusb_claim_interface(dev->devh, interface_number);
+}
+
+static int usb_release_interface(struct somagic_device *dev, int interface_number)
+{
+	return libusb_release_interface(dev->devh, interface_number);
+}
+
+static int usb_set_configuration(struct somagic_device *dev, int configuration)
+{
+	return libusb_set_configuration(dev->devh, configuration);
+}
+
+static int usb_set_interface_alt_setting(struct somagic_device *dev, int interface_number, int alternate_setting)
+{
+	return libusb_set_interface_alt_setting(dev->devh, interface_number, alternate_setting);
+}
+
+static int usb_get_descriptor(struct somagic_device *dev, uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length)
+{
+	return libusb_get_descriptor(dev->devh, desc_type, desc_index, data, length);
+}
+
+static int usb_control_transfer(struct somagic_device *dev, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	return libusb_control_transfer(dev->devh, request_type, request, value, index, data, length, timeout);
+}
+
+static int usb_submit_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	(void)dev;
+	return libusb_submit_transfer(tfr);
+}
+
+static int usb_cancel_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	(void)dev;
+	return libusb_cancel_transfer(tfr);
+}
+
+/* Returns at least every 100 ms, so the capture loop can check for stalls (see capture_watchdog()) */
+static int usb_handle_events()
+{
+	struct timeval tv = { 0, 100000 };
+
+	return libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+}
+
+static int LIBUSB_CALL usb_hotplug_callback(libusb_context *ctx, libusb_device *usb_dev, libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor descriptor;
+	int p;
+
+	(void)ctx;
+	(void)user_data;
+	libusb_get_device_descriptor(usb_dev, &descriptor);
+	for (p = 0; p < PRODUCT_COUNT && descriptor.idProduct != PRODUCT[p]; p++);
+	if (p < PRODUCT_COUNT || descriptor.idProduct == ORIGINAL_PRODUCT) {
+		hotplug_queue_add(usb_dev, descriptor.idProduct, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	}
+	return 0;
+}
+
+/* Devices already plugged in are reported as arrived at once */
+static int usb_hotplug_register()
+{
+	int ret;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "%s: This libusb does not support hotplug\n", program_path);
+		return 1;
+	}
+	ret = libusb_hotplug_register_callback(usb_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE, VENDOR, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_callback, NULL, NULL);
+	if (ret) {
+		fprintf(stderr, "%s: Failed to register hotplug callback: %s\n", program_path, libusb_error_name(ret));
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned char *usb_dev_mem_alloc(struct somagic_device *dev, size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	return libusb_dev_mem_alloc(dev->devh, length);
+#else
+	(void)dev;
+	(void)length;
+	return NULL;
+#endif
+}
+
+static void usb_dev_mem_free(struct somagic_device *dev, unsigned char *buffer, size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_dev_mem_free(dev->devh, buffer, length);
+#else
+	(void)dev;
+	(void)buffer;
+	(void)length;
+#endif
+}
+
+static const struct transport_t usb_transport = {
+	usb_open,
+	usb_close,
+	usb_claim_interface,
+	usb_release_interface,
+	usb_set_configuration,
+	usb_set_interface_alt_setting,
+	usb_get_descriptor,
+	usb_control_transfer,
+	usb_submit_transfer,
+	usb_cancel_transfer,
+	usb_handle_events,
+	usb_hotplug_register,
+	usb_dev_mem_alloc,
+	usb_dev_mem_free
+};
+
+/*
+ * Simulated device: a model of the SMI2021 bridge registers and of the
+ * SAA7113 register file behind its I2C bus. Once streaming is started
+ * (alternate setting 2, register 0x1800 = 0x0d), every iso packet is filled
+ * with three 0x400 byte blocks of a BT.656 colour bar pattern, the number of
+ * lines following the SAA7113 vertical offset register (0x5a). While bridge
+ * register 0x1740 is non-zero, every fourth block is an audio block instead.
+ * Transfers complete as fast as they are handled, so the run measures the
+ * host side only.
+ *
+ * With --hotplug, the device is plugged in uninitialized: it takes the
+ * firmware upload, then reconnects as a capture device, which is unplugged
+ * and plugged in uninitialized again after SIM_UNPLUG_FRAMES frames.
+ *
+ * With --watchdog, the stream stalls once after SIM_STALL_FRAMES frames: the
+ * transfers complete empty until the alternate setting is changed.
+ */
+#define SIM_BLOCK_DATA (0x400 - 4)
+#define SIM_UNPLUG_FRAMES 100
+#define SIM_STALL_FRAMES 50
+
+struct sim_device_t {
+	uint8_t bridge[0x10000];
+	uint8_t saa7113[0x100];
+	uint8_t i2c_subaddress;
+	unsigned char response[13];  /* data for the next vendor IN transfer */
+	int alternate_setting;
+	int loader;     /* waiting for the firmware */
+	int unplugged;
+	int stalled;    /* sends no video until the alternate setting is changed */
+	int stall_count;
+
+	/* BT.656 generator */
+	unsigned char line[4 + 4 + 1440];
+	int line_length;
+	int line_pos;
+	int line_number;
+	int field;
+	int frame;
+	int block_number;
+	uint16_t sample;
+
+	/* Statistics */
+	int control_out;
+	int control_in;
+	uint64_t open_time;
+	uint64_t first_data_time;
+	uint64_t iso_bytes;
+	int firmware_bytes;
+};
+
+/* Transfers submitted to any simulated device, completed in order by sim_handle_events() */
+static struct {
+	struct libusb_transfer **pending;
+	int pending_count;
+	int pending_size;
+} sim_bus;
+
+static void sim_trc(unsigned char *p, int field, int blank, int eav)
+{
+	p[0] = 0xff;
+	p[1] = 0x00;
+	p[2] = 0x00;
+	p[3] = 0x80 | (field << 6) | (blank << 5) | (eav << 4);
+}
+
+/* Generate the next line as the bridge sends it, without horizontal blanking: EAV, SAV, 1440 bytes of video */
+static void sim_next_line(struct sim_device_t *sim)
+{
+	/* 75% colour bars, U Y V Y */
+	static const unsigned char bars[8][4] = {
+		{128, 180, 128, 180}, {44, 168, 136, 168}, {156, 145, 44, 145}, {72, 134, 52, 134},
+		{184, 63, 204, 63}, {100, 51, 212, 51}, {212, 28, 120, 28}, {128, 16, 128, 16}
+	};
+	unsigned char *video;
+	int lines_total;
+	int lines_active;
+	int blank;
+	int offset;
+	int y;
+	int i;
+
+	if (sim->saa7113[0x5a] == 0x07) {
+		lines_total = 312;
+		lines_active = 288;
+	} else {
+		lines_total = 262;
+		lines_active = 240;
+	}
+
+	if (++sim->line_number >= lines_total) {
+		sim->line_number = 0;
+		sim->field ^= 1;
+		if (sim->field == 0) {
+			sim->frame++;
+		}
+	}
+	blank = sim->line_number < lines_total - lines_active;
+
+	sim_trc(sim->line, sim->field, blank, 1);
+	sim_trc(sim->line + 4, sim->field, blank, 0);
+	video = sim->line + 8;
+	for (i = 0; i < 360; i++) {
+		if (blank) {
+			memcpy(video + i * 4, "\x80\x10\x80\x10", 4);
+		} else {
+			memcpy(video + i * 4, bars[((i + sim->frame) / 45) % 8], 4);
+			/* Luminance brightness */
+			offset = sim->saa7113[0x0a] - 128;
+			y = MIN(MAX(video[i * 4 + 1] + offset, 1), 254);
+			video[i * 4 + 1] = y;
+			video[i * 4 + 3] = y;
+		}
+	}
+	sim->line_length = sizeof sim->line;
+	sim->line_pos = 0;
+}
+
+static void sim_fill_block(struct sim_device_t *sim, unsigned char *block)
+{
+	int count;
+	int pos;
+
+	if (sim->bridge[0x1740] != 0 && sim->block_number++ % 4 == 3) {
+		/* 16 bit stereo sawtooth */
+		memcpy(block, "\xaa\xaa\x00\x01", 4);
+		for (pos = 4; pos < 0x400; pos += 4) {
+			block[pos] = sim->sample & 0xff;
+			block[pos + 1] = sim->sample >> 8;
+			block[pos + 2] = sim->sample & 0xff;
+			block[pos + 3] = sim->sample >> 8;
+			sim->sample += 64;
+		}
+		return;
+	}
+
+	memcpy(block, "\xaa\xaa\x00\x00", 4);
+	for (pos = 4; pos < 0x400; pos += count) {
+		if (sim->line_pos == sim->line_length) {
+			sim_next_line(sim);
+		}
+		count = MIN(0x400 - pos, sim->line_length - sim->line_pos);
+		memcpy(block + pos, sim->line + sim->line_pos, count);
+		sim->line_pos += count;
+	}
+}
+
+static int sim_open(struct somagic_device *dev)
+{
+	dev->sim = calloc(1, sizeof *dev->sim);
+	if (dev->sim == NULL) {
+		perror("Failed to allocate memory for the simulated device");
+		return 1;
+	}
+	dev->sim->open_time = timestamp_us();
+	dev->sim->loader = dev->product == ORIGINAL_PRODUCT;
+	return 0;
+}
+
+static void sim_close(struct somagic_device *dev)
+{
+	struct sim_device_t *sim = dev->sim;
+	double elapsed = 0;
+
+	if (sim->loader) {
+		fprintf(stderr, "%sSimulated firmware upload: %d bytes in %.3f s\n", device_prefix(dev), sim->firmware_bytes, (timestamp_us() - sim->open_time) / 1000000.0);
+	}
+	fprintf(stderr, "%sSimulated control transfers: %d out, %d in\n", device_prefix(dev), sim->control_out, sim->control_in);
+	if (sim->first_data_time) {
+		elapsed = (timestamp_us() - sim->first_data_time) / 1000000.0;
+		fprintf(stderr, "%sSimulated startup time: %.3f s\n", device_prefix(dev), (sim->first_data_time - sim->open_time) / 1000000.0);
+	}
+	if (elapsed > 0) {
+		fprintf(stderr, "%sSimulated iso data: %.1f MB in %.3f s, %.1f MB/s\n", device_prefix(dev), sim->iso_bytes / 1000000.0, elapsed, sim->iso_bytes / 1000000.0 / elapsed);
+	}
+	if (sim_bus.pending_count == 0) {
+		free(sim_bus.pending);
+		sim_bus.pending = NULL;
+		sim_bus.pending_size = 0;
+	}
+	free(sim);
+	dev->sim = NULL;
+}
+
+static int sim_claim_interface(struct somagic_device *dev, int interface_number)
+{
+	(void)dev;
+	return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_release_interface(struct somagic_device *dev, int interface_number)
+{
+	(void)dev;
+	return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_set_configuration(struct somagic_device *dev, int configuration)
+{
+	(void)dev;
+	return configuration == 1 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_set_interface_alt_setting(struct somagic_device *dev, int interface_number, int alternate_setting)
+{
+	struct sim_device_t *sim = dev->sim;
+
+	if (interface_number != 0 || alternate_setting < 0 || alternate_setting > 3) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	sim->alternate_setting = alternate_setting;
+	sim->stalled = 0;
+	return 0;
+}
+
+static int sim_get_descriptor(struct somagic_device *dev, uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length)
+{
+	(void)dev;
+	(void)desc_index;
+	memset(data, 0, length);
+	if (length > 0) {
+		data[0] = MIN(length, 255);
+	}
+	if (length > 1) {
+		data[1] = desc_type;
+	}
+	if (desc_type == LIBUSB_DT_DEVICE && length >= 12) {
+		data[8] = VENDOR & 0xff;
+		data[9] = VENDOR >> 8;
+		data[10] = PRODUCT[0] & 0xff;
+		data[11] = PRODUCT[0] >> 8;
+	}
+	return length;
+}
+
+static int sim_control_transfer(struct somagic_device *dev, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	struct sim_device_t *sim = dev->sim;
+	uint16_t reg;
+	int count;
+	int i;
+
+	(void)index;
+	(void)timeout;
+	if (sim->unplugged) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (request != 0x01) {
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (sim->loader) {
+		/* Firmware loader: [05 ff] and 62 bytes of firmware each, then reconnect with it */
+		if (request_type & LIBUSB_ENDPOINT_IN) {
+			sim->control_in++;
+			memset(data, 0, length);
+			return length;
+		}
+		sim->control_out++;
+		if (value == 0x05 && length == 64 && data[0] == 0x05 && data[1] == 0xff) {
+			sim->firmware_bytes += 62;
+		} else if (value == 0x07) {
+			sim->unplugged = 1;
+			hotplug_queue_add(NULL, ORIGINAL_PRODUCT, 0);
+			hotplug_queue_add(NULL, PRODUCT[0], 1);
+		}
+		return length;
+	}
+
+	if (request_type & LIBUSB_ENDPOINT_IN) {
+		sim->control_in++;
+		if (value == 0x0b) {
+			memcpy(data, sim->response, MIN(length, sizeof sim->response));
+		} else {
+			memset(data, 0, length);
+		}
+		return length;
+	}
+
+	sim->control_out++;
+	if (value != 0x0b || length < 7 || data[0] != 0x0b) {
+		return length;
+	}
+	if (data[1] == 0x00) {
+		/* Bridge register: 0b 00 00 82 01 hi lo val (write), 0b 00 20 82 01 hi lo xx (read) */
+		reg = (data[5] << 8) | data[6];
+		if (data[2] == 0x00 && length >= 8) {
+			sim->bridge[reg] = data[7];
+		} else if (data[2] == 0x20) {
+			sim->response[7] = sim->bridge[reg];
+		}
+	} else {
+		/* I2C: 0b addr c0 xx count reg val... (write), 0b addr 84 .. reg (subaddress), 0b addr a0 (read) */
+		switch (data[2]) {
+		case 0xc0:
+			count = MIN(data[4], length - 6);
+			for (i = 0; i < count; i++) {
+				sim->saa7113[(data[5] + i) & 0xff] = data[6 + i];
+			}
+			break;
+		case 0x84:
+			sim->i2c_subaddress = data[5];
+			break;
+		case 0xa0:
+			sim->response[5] = sim->saa7113[sim->i2c_subaddress];
+			if (sim->i2c_subaddress == 0x1f) {
+				/* Status byte: field frequency follows the selected line count */
+				sim->response[5] = sim->saa7113[0x5a] == 0x07 ? 0x00 : 0x20;
+			}
+			break;
+		}
+	}
+	return length;
+}
+
+static int sim_submit_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	struct libusb_transfer **pending;
+
+	if (dev->sim->unplugged) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (sim_bus.pending_count == sim_bus.pending_size) {
+		pending = realloc(sim_bus.pending, (sim_bus.pending_size + 16) * sizeof *pending);
+		if (pending == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		sim_bus.pending = pending;
+		sim_bus.pending_size += 16;
+	}
+	sim_bus.pending[sim_bus.pending_count++] = tfr;
+	return 0;
+}
+
+/* Transfers complete in the order submitted anyway, so cancelling them is not needed */
+static int sim_cancel_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	(void)dev;
+	(void)tfr;
+	return 0;
+}
+
+/* Complete the oldest transfer submitted to any simulated device */
+static int sim_handle_events()
+{
+	struct somagic_device *dev;
+	struct sim_device_t *sim;
+	struct libusb_transfer *tfr;
+	struct libusb_control_setup *setup;
+	int streaming;
+	int ret;
+	int i;
+	int j;
+
+	if (sim_bus.pending_count == 0) {
+		return 0;
+	}
+	tfr = sim_bus.pending[0];
+	sim_bus.pending_count--;
+	memmove(sim_bus.pending, sim_bus.pending + 1, sim_bus.pending_count * sizeof *sim_bus.pending);
+	dev = tfr->user_data;
+	sim = dev->sim;
+
+	if (tfr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		setup = libusb_control_transfer_get_setup(tfr);
+		ret = sim_control_transfer(dev, setup->bmRequestType, setup->bRequest, libusb_le16_to_cpu(setup->wValue), libusb_le16_to_cpu(setup->wIndex), libusb_control_transfer_get_data(tfr), libusb_le16_to_cpu(setup->wLength), tfr->timeout);
+		tfr->status = (ret == LIBUSB_ERROR_NO_DEVICE) ? LIBUSB_TRANSFER_NO_DEVICE : (ret < 0) ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+		tfr->actual_length = MAX(ret, 0);
+		tfr->callback(tfr);
+		return 0;
+	}
+
+	if (watchdog_timeout && sim->frame == SIM_STALL_FRAMES && !sim->stall_count) {
+		sim->stalled = 1;
+		sim->stall_count++;
+	}
+	streaming = sim->alternate_setting == 2 && sim->bridge[0x1800] == 0x0d && !sim->stalled;
+	if (streaming && !sim->first_data_time) {
+		sim->first_data_time = timestamp_us();
+	}
+	if (hotplug && streaming && sim->frame == SIM_UNPLUG_FRAMES && !sim->unplugged) {
+		sim->unplugged = 1;
+		hotplug_queue_add(NULL, PRODUCT[0], 0);
+		hotplug_queue_add(NULL, ORIGINAL_PRODUCT, 1);
+	}
+	if (sim->unplugged) {
+		tfr->status = LIBUSB_TRANSFER_NO_DEVICE;
+		for (i = 0; i < tfr->num_iso_packets; i++) {
+			tfr->iso_packet_desc[i].status = LIBUSB_TRANSFER_NO_DEVICE;
+			tfr->iso_packet_desc[i].actual_length = 0;
+		}
+		tfr->callback(tfr);
+		return 0;
+	}
+	for (i = 0; i < tfr->num_iso_packets; i++) {
+		tfr->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+		tfr->iso_packet_desc[i].actual_length = 0;
+		if (streaming) {
+			for (j = 0; j + 0x400 <= (int)tfr->iso_packet_desc[i].length; j += 0x400) {
+				sim_fill_block(sim, libusb_get_iso_packet_buffer_simple(tfr, i) + j);
+			}
+			tfr->iso_packet_desc[i].actual_length = j;
+			sim->iso_bytes += j;
+		}
+	}
+	tfr->status = LIBUSB_TRANSFER_COMPLETED;
+	tfr->callback(tfr);
+	return 0;
+}
+
+/* The simulated bus has no device memory: the buffers are filled in place anyway */
+static unsigned char *sim_dev_mem_alloc(struct somagic_device *dev, size_t length)
+{
+	(void)dev;
+	(void)length;
+	return NULL;
+}
+
+static void sim_dev_mem_free(struct somagic_device *dev, unsigned char *buffer, size_t length)
+{
+	(void)dev;
+	(void)buffer;
+	(void)length;
+}
+
+/* One simulated device, plugged in uninitialized */
+static int sim_hotplug_register()
+{
+	hotplug_queue_add(NULL, ORIGINAL_PRODUCT, 1);
+	return 0;
+}
+
+static const struct transport_t sim_transport = {
+	sim_open,
+	sim_close,
+	sim_claim_interface,
+	sim_release_interface,
+	sim_set_configuration,
+	sim_set_interface_alt_setting,
+	sim_get_descriptor,
+	sim_control_transfer,
+	sim_submit_transfer,
+	sim_cancel_transfer,
+	sim_handle_events,
+	sim_hotplug_register,
+	sim_dev_mem_alloc,
+	sim_dev_mem_free
+};
+
+static void release_usb_device(int ret)
+{
+	struct somagic_device *dev;
+
+	fprintf(stderr, "Emergency exit\n");
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (dev->devh == NULL && dev->sim == NULL) {
+			continue;
+		}
+		ret = dev->transport->release_interface(dev, 0);
+		if (!ret) {
+			perror("Failed to release interface");
+		}
+		dev->transport->close(dev);
+	}
+	if (usb_context != NULL) {
+		libusb_exit(usb_context);
+	}
+	exit(1);
+}
+
+#ifdef DEBUG
+static void print_bytes_only(char *bytes, int len)
+{
+	int i;
+	if (len > 0) {
+		for (i = 0; i < len; i++) {
+			if (i % 32 == 0) {
+				fprintf(stderr, "\n%04x\t ", i);
+			}
+			fprintf(stderr, "%02x ", (int)((unsigned char)bytes[i]));
+		}
+	}
+}
+#endif
+
+#ifdef DEBUG
+static void trace()
+{
+	void *array[10];
+	size_t size;
+
+	/* get void*'s for all entries on the stack */
+	size = backtrace(array, 10);
+
+	/* print out all the frames */
+	backtrace_symbols_fd(array, size, 1);
+	exit(1);
+}
+#endif
+
+static int ring_init(struct ring_t *ring, int slots, size_t slot_size)
+{
+	int i;
+
+	ring->buffer = malloc((slots + 1) * slot_size);
+	ring->slot = malloc(slots * sizeof *ring->slot);
+	ring->length = malloc(slots * sizeof *ring->length);
+	ring->seq = malloc(slots * sizeof *ring->seq);
+	if (ring->buffer == NULL || ring->slot == NULL || ring->length == NULL || ring->seq == NULL) {
+		return 1;
+	}
+	for (i = 0; i < slots; i++) {
+		ring->slot[i] = ring->buffer + i * slot_size;
+		atomic_init(&ring->seq[i], 2 * i);
+	}
+	ring->spare = ring->buffer + slots * slot_size;
+	ring->slot_size = slot_size;
+	ring->slots = slots;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->closed, 0);
+	atomic_init(&ring->waiting, 0);
+	sem_init(&ring->filled, 0, 0);
+	sem_init(&ring->freed, 0, 0);
+	ring->notify = &ring->filled;
+	return 0;
+}
+
+static void ring_free(struct ring_t *ring)
+{
+	sem_destroy(&ring->filled);
+	sem_destroy(&ring->freed);
+	free(ring->buffer);
+	free(ring->slot);
+	free(ring->length);
+	free(ring->seq);
+}
+
+/* Producer: return the buffer of the next free slot, or NULL if the ring is full */
+static unsigned char *ring_push_slot(struct ring_t *ring)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	if (atomic_load_explicit(&ring->seq[pos % ring->slots], memory_order_acquire) != 2 * pos) {
+		return NULL;
+	}
+	return ring->slot[pos % ring->slots];
+}
+
+/* Producer: publish the slot returned by ring_push_slot() */
+static void ring_push(struct ring_t *ring, size_t length)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	ring->length[pos % ring->slots] = length;
+	atomic_store_explicit(&ring->seq[pos % ring->slots], 2 * pos + 1, memory_order_release);
+	atomic_store_explicit(&ring->head, pos + 1, memory_order_release);
+	sem_post(ring->notify);
+}
+
+static void ring_release(struct ring_t *ring, size_t pos)
+{
+	atomic_store_explicit(&ring->seq[pos % ring->slots], 2 * (pos + ring->slots), memory_order_release);
+	/*
+	 * The load of waiting must not pass the store above, or it can miss a
+	 * producer that has just found the slot still full and goes to sleep
+	 * (see ring_push_slot_wait())
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&ring->waiting)) {
+		sem_post(&ring->freed);
+	}
+}
+
+/* Producer: wait until a slot is free, then return its buffer */
+static unsigned char *ring_push_slot_wait(struct ring_t *ring)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_fetch_add(&ring->waiting, 1);
+	/* seq_cst, so that either this sees the slot freed or ring_release() sees waiting */
+	while (atomic_load(&ring->seq[pos % ring->slots]) != 2 * pos) {
+		sem_wait(&ring->freed);
+	}
+	atomic_fetch_sub(&ring->waiting, 1);
+	return ring->slot[pos % ring->slots];
+}
+
+/*
+ * Producer: discard the oldest entry of a full ring. Returns 0 if the consumer
+ * popped that entry first, in which case its slot is about to be free anyway.
+ */
+static int ring_drop_oldest(struct ring_t *ring)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed) - ring->slots;
+
+	if (!atomic_compare_exchange_strong(&ring->tail, &pos, pos + 1)) {
+		while (ring_push_slot(ring) == NULL) {
+			sched_yield();
+		}
+		return 0;
+	}
+	ring_release(ring, pos);
+	return 1;
+}
+
+/*
+ * Consumer: pop the oldest entry, or return NULL if the ring is empty.
+ * The returned buffer belongs to the consumer until the next pop.
+ */
+static unsigned char *ring_pop(struct ring_t *ring, size_t *length)
+{
+	unsigned char *buffer;
+	size_t tail;
+	size_t seq;
+	int index;
+
+	tail = atomic_load(&ring->tail);
+	while (1) {
+		index = tail % ring->slots;
+		seq = atomic_load_explicit(&ring->seq[index], memory_order_acquire);
+		if (seq != 2 * tail + 1) {
+			if ((ptrdiff_t)(seq - (2 * tail + 1)) < 0) {
+				return NULL;
+			}
+			/* The producer dropped this entry, try again */
+			tail = atomic_load(&ring->tail);
+		} else if (atomic_compare_exchange_weak(&ring->tail, &tail, tail + 1)) {
+			break;
+		}
+	}
+
+	buffer = ring->slot[index];
+	ring->slot[index] = ring->spare;
+	ring->spare = buffer;
+	*length = ring->length[index];
+	ring_release(ring, tail);
+	return buffer;
+}
+
+/* Consumer: wait for the oldest entry; returns NULL once the ring is closed and empty */
+static unsigned char *ring_pop_wait(struct ring_t *ring, size_t *length)
+{
+	unsigned char *buffer;
+
+	while ((buffer = ring_pop(ring, length)) == NULL) {
+		if (atomic_load(&ring->closed)) {
+			return ring_pop(ring, length);
+		}
+		sem_wait(&ring->filled);
+	}
+	return buffer;
+}
+
+/* Producer: no more entries will be pushed */
+static void ring_close(struct ring_t *ring)
+{
+	atomic_store(&ring->closed, 1);
+	sem_post(ring->notify);
+}
+
+static int write_all(int fd, unsigned char *data, size_t length)
+{
+	ssize_t ret;
+
+	while (length > 0) {
+		ret = write(fd, data, length);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		data += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+/* Write all of an iovec array, resuming after partial writes */
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = writev(fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pixel format conversion (see --pixel-format). The decoders build UYVY
+ * frames; output_frame() converts them a line at a time with the row kernels
+ * below as it copies them into the frame queue, so a frame is read once.
+ * The 4:2:0 formats average the chroma of two lines of the same field (lines
+ * 0 and 2, 1 and 3 of every four), as the frames are interlaced.
+ */
+struct convert_kernels_t {
+	const char *name;
+	/* UYVY to YUYV */
+	void (*swap)(uint8_t *dst, const uint8_t *src, int pixels);
+	/* The Y samples of a UYVY line */
+	void (*luma)(uint8_t *y, const uint8_t *src, int pixels);
+	/* The Cb and Cr samples of two UYVY lines, averaged, into separate planes */
+	void (*chroma)(uint8_t *cb, uint8_t *cr, const uint8_t *src0, const uint8_t *src1, int pixels);
+	/* The Cb and Cr samples of two UYVY lines, averaged, interleaved */
+	void (*chroma_nv12)(uint8_t *cbcr, const uint8_t *src0, const uint8_t *src1, int pixels);
+	/* UYVY to RGB24 and BGRA (see convert_rgb_pair()) */
+	void (*rgb24)(uint8_t *dst, const uint8_t *src, int pixels);
+	void (*bgra)(uint8_t *dst, const uint8_t *src, int pixels);
+};
+
+/*
+ * BT.601 limited range YCbCr to RGB, in 16 bit fixed point so that the SIMD
+ * kernels work on 8 or 16 pixels at once: the coefficients are scaled by
+ * 2^14, the samples by 2^8, and the high 16 bits of their product
+ * (_mm_mulhi_epi16()) are RGB scaled by 2^6. The Cb coefficient of B is over
+ * 2 and does not fit, so 2 * Cb is added with a shift. The only sums that can
+ * overflow 16 bits are far above 255, so saturating adds clip them correctly.
+ * The kernels all compute exactly what convert_rgb_pair() does.
+ */
+#define RGB_Y 19077        /* 255 / 219 */
+#define RGB_CR_R 26149     /* 1.402 * 255 / 224 */
+#define RGB_CB_G 6419      /* 0.344136 * 255 / 224 */
+#define RGB_CR_G 13320     /* 0.714136 * 255 / 224 */
+#define RGB_CB_B 282       /* 1.772 * 255 / 224, less 2 */
+#define RGB_Y_OFFSET (16 * RGB_Y / 256 - 32)  /* Black level, less 0.5 to round */
+
+static void convert_swap_scalar(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	int i;
+
+	for (i = 0; i < pixels * 2; i += 2) {
+		dst[i] = src[i + 1];
+		dst[i + 1] = src[i];
+	}
+}
+
+static void convert_luma_scalar(uint8_t *y, const uint8_t *src, int pixels)
+{
+	int i;
+
+	for (i = 0; i < pixels; i++) {
+		y[i] = src[i * 2 + 1];
+	}
+}
+
+static void convert_chroma_scalar(uint8_t *cb, uint8_t *cr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	int i;
+
+	for (i = 0; i < pixels / 2; i++) {
+		cb[i] = (src0[i * 4] + src1[i * 4] + 1) >> 1;
+		cr[i] = (src0[i * 4 + 2] + src1[i * 4 + 2] + 1) >> 1;
+	}
+}
+
+static void convert_chroma_nv12_scalar(uint8_t *cbcr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	int i;
+
+	for (i = 0; i < pixels; i++) {
+		cbcr[i] = (src0[i * 2] + src1[i * 2] + 1) >> 1;
+	}
+}
+
+static inline uint8_t convert_clamp(int value)
+{
+	value >>= 6;
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/* R, G and B of the two pixels of a UYVY pair */
+static inline void convert_rgb_pair(uint8_t *rgb, const uint8_t *src)
+{
+	int cb = (src[0] - 128) * 256;
+	int cr = (src[2] - 128) * 256;
+	int r = cr * RGB_CR_R >> 16;
+	int g = (cb * RGB_CB_G >> 16) + (cr * RGB_CR_G >> 16);
+	int b = cb / 2 + (cb * RGB_CB_B >> 16);
+	int y;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		y = ((src[i * 2 + 1] << 8) * RGB_Y >> 16) - RGB_Y_OFFSET;
+		rgb[i * 3] = convert_clamp(y + r);
+		rgb[i * 3 + 1] = convert_clamp(y - g);
+		rgb[i * 3 + 2] = convert_clamp(y + b);
+	}
+}
+
+static void convert_rgb24_scalar(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	int i;
+
+	for (i = 0; i < pixels; i += 2) {
+		convert_rgb_pair(dst + i * 3, src + i * 2);
+	}
+}
+
+static void convert_bgra_scalar(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	uint8_t rgb[6];
+	int i;
+	int j;
+
+	for (i = 0; i < pixels; i += 2) {
+		convert_rgb_pair(rgb, src + i * 2);
+		for (j = 0; j < 2; j++) {
+			dst[(i + j) * 4] = rgb[j * 3 + 2];
+			dst[(i + j) * 4 + 1] = rgb[j * 3 + 1];
+			dst[(i + j) * 4 + 2] = rgb[j * 3];
+			dst[(i + j) * 4 + 3] = 0xff;
+		}
+	}
+}
+
+static const struct convert_kernels_t convert_kernels_scalar = {
+	"scalar", convert_swap_scalar, convert_luma_scalar, convert_chroma_scalar, convert_chroma_nv12_scalar,
+	convert_rgb24_scalar, convert_bgra_scalar
+};
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void convert_swap_sse2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	__m128i x;
+	int i;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+	}
+	convert_swap_scalar(dst + i * 2, src + i * 2, pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_luma_sse2(uint8_t *y, const uint8_t *src, int pixels)
+{
+	__m128i a;
+	__m128i b;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+		_mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+	convert_luma_scalar(y + i, src + i * 2, pixels - i);
+}
+
+/* The Cb Cr pairs of 16 pixels of two lines, averaged */
+__attribute__((target("sse2")))
+static inline __m128i convert_cbcr_sse2(const uint8_t *src0, const uint8_t *src1)
+{
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i c0;
+	__m128i c1;
+
+	c0 = _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)src0), mask), _mm_and_si128(_mm_loadu_si128((const __m128i *)(src0 + 16)), mask));
+	c1 = _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)src1), mask), _mm_and_si128(_mm_loadu_si128((const __m128i *)(src1 + 16)), mask));
+	return _mm_avg_epu8(c0, c1);
+}
+
+__attribute__((target("sse2")))
+static void convert_chroma_sse2(uint8_t *cb, uint8_t *cr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	const __m128i mask = _mm_set1_epi16(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		c = convert_cbcr_sse2(src0 + i * 2, src1 + i * 2);
+		_mm_storel_epi64((__m128i *)(cb + i / 2), _mm_packus_epi16(_mm_and_si128(c, mask), zero));
+		_mm_storel_epi64((__m128i *)(cr + i / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+	}
+	convert_chroma_scalar(cb + i / 2, cr + i / 2, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_chroma_nv12_sse2(uint8_t *cbcr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		_mm_storeu_si128((__m128i *)(cbcr + i), convert_cbcr_sse2(src0 + i * 2, src1 + i * 2));
+	}
+	convert_chroma_nv12_scalar(cbcr + i, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+/* R, G and B of 8 UYVY pixels, scaled by 2^6 */
+__attribute__((target("sse2")))
+static inline void convert_rgb_sse2(const uint8_t *src, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i x;
+	__m128i c;
+	__m128i y;
+	__m128i cb;
+	__m128i cr;
+
+	x = _mm_loadu_si128((const __m128i *)src);
+	c = _mm_sub_epi16(_mm_and_si128(x, mask), _mm_set1_epi16(128));
+	cb = _mm_slli_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0)), 8);
+	cr = _mm_slli_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1)), 8);
+	y = _mm_sub_epi16(_mm_mulhi_epu16(_mm_andnot_si128(mask, x), _mm_set1_epi16(RGB_Y)), _mm_set1_epi16(RGB_Y_OFFSET));
+	*r = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mulhi_epi16(cr, _mm_set1_epi16(RGB_CR_R))), 6);
+	*g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(y, _mm_mulhi_epi16(cb, _mm_set1_epi16(RGB_CB_G))), _mm_mulhi_epi16(cr, _mm_set1_epi16(RGB_CR_G))), 6);
+	*b = _mm_srai_epi16(_mm_adds_epi16(y, _mm_adds_epi16(_mm_srai_epi16(cb, 1), _mm_mulhi_epi16(cb, _mm_set1_epi16(RGB_CB_B)))), 6);
+}
+
+/* SSE2 has no byte shuffle, so the 3 byte pixels are put together one by one */
+__attribute__((target("sse2")))
+static void convert_rgb24_sse2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	uint8_t rgb[3][8];
+	__m128i r;
+	__m128i g;
+	__m128i b;
+	int i;
+	int j;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		convert_rgb_sse2(src + i * 2, &r, &g, &b);
+		_mm_storel_epi64((__m128i *)rgb[0], _mm_packus_epi16(r, r));
+		_mm_storel_epi64((__m128i *)rgb[1], _mm_packus_epi16(g, g));
+		_mm_storel_epi64((__m128i *)rgb[2], _mm_packus_epi16(b, b));
+		for (j = 0; j < 8; j++) {
+			dst[(i + j) * 3] = rgb[0][j];
+			dst[(i + j) * 3 + 1] = rgb[1][j];
+			dst[(i + j) * 3 + 2] = rgb[2][j];
+		}
+	}
+	convert_rgb24_scalar(dst + i * 3, src + i * 2, pixels - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_bgra_sse2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	__m128i r;
+	__m128i g;
+	__m128i b;
+	__m128i bg;
+	__m128i ra;
+	int i;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		convert_rgb_sse2(src + i * 2, &r, &g, &b);
+		bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+		ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_set1_epi8((char)0xff));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(dst + i * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+	convert_bgra_scalar(dst + i * 4, src + i * 2, pixels - i);
+}
+
+static const struct convert_kernels_t convert_kernels_sse2 = {
+	"sse2", convert_swap_sse2, convert_luma_sse2, convert_chroma_sse2, convert_chroma_nv12_sse2,
+	convert_rgb24_sse2, convert_bgra_sse2
+};
+
+/*
+ * The AVX2 kernels do 16 or 32 pixels at a time and leave the rest of a line
+ * to the SSE2 ones, clearing the upper halves of the registers first: SSE2
+ * code after AVX2 code that did not pays for a state transition each line.
+ */
+__attribute__((target("avx2")))
+static void convert_swap_avx2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	__m256i x;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		x = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+		_mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8)));
+	}
+	_mm256_zeroupper();
+	convert_swap_sse2(dst + i * 2, src + i * 2, pixels - i);
+}
+
+/* _mm256_packus_epi16() packs each 128 bit lane on its own; the permutes put the 64 bit quarters back in order */
+__attribute__((target("avx2")))
+static void convert_luma_avx2(uint8_t *y, const uint8_t *src, int pixels)
+{
+	__m256i a;
+	__m256i b;
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+		b = _mm256_loadu_si256((const __m256i *)(src + i * 2 + 32));
+		_mm256_storeu_si256((__m256i *)(y + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8));
+	}
+	_mm256_zeroupper();
+	convert_luma_sse2(y + i, src + i * 2, pixels - i);
+}
+
+/* The Cb Cr pairs of 32 pixels of two lines, averaged */
+__attribute__((target("avx2")))
+static inline __m256i convert_cbcr_avx2(const uint8_t *src0, const uint8_t *src1)
+{
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	__m256i c0;
+	__m256i c1;
+
+	c0 = _mm256_packus_epi16(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)src0), mask), _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src0 + 32)), mask));
+	c1 = _mm256_packus_epi16(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)src1), mask), _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src1 + 32)), mask));
+	return _mm256_permute4x64_epi64(_mm256_avg_epu8(c0, c1), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static void convert_chroma_avx2(uint8_t *cb, uint8_t *cr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	__m256i c;
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		c = convert_cbcr_avx2(src0 + i * 2, src1 + i * 2);
+		_mm_storeu_si128((__m128i *)(cb + i / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(c, mask), _mm256_setzero_si256()), 0xd8)));
+		_mm_storeu_si128((__m128i *)(cr + i / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(c, 8), _mm256_setzero_si256()), 0xd8)));
+	}
+	_mm256_zeroupper();
+	convert_chroma_sse2(cb + i / 2, cr + i / 2, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_chroma_nv12_avx2(uint8_t *cbcr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		_mm256_storeu_si256((__m256i *)(cbcr + i), convert_cbcr_avx2(src0 + i * 2, src1 + i * 2));
+	}
+	_mm256_zeroupper();
+	convert_chroma_nv12_sse2(cbcr + i, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+/* R, G and B of 16 UYVY pixels, scaled by 2^6, with pixels 0-7 in the low lane and 8-15 in the high one */
+__attribute__((target("avx2")))
+static inline void convert_rgb_avx2(const uint8_t *src, __m256i *r, __m256i *g, __m256i *b)
+{
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	__m256i x;
+	__m256i c;
+	__m256i y;
+	__m256i cb;
+	__m256i cr;
+
+	x = _mm256_loadu_si256((const __m256i *)src);
+	c = _mm256_sub_epi16(_mm256_and_si256(x, mask), _mm256_set1_epi16(128));
+	cb = _mm256_slli_epi16(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0)), 8);
+	cr = _mm256_slli_epi16(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1)), 8);
+	y = _mm256_sub_epi16(_mm256_mulhi_epu16(_mm256_andnot_si256(mask, x), _mm256_set1_epi16(RGB_Y)), _mm256_set1_epi16(RGB_Y_OFFSET));
+	*r = _mm256_srai_epi16(_mm256_adds_epi16(y, _mm256_mulhi_epi16(cr, _mm256_set1_epi16(RGB_CR_R))), 6);
+	*g = _mm256_srai_epi16(_mm256_subs_epi16(_mm256_subs_epi16(y, _mm256_mulhi_epi16(cb, _mm256_set1_epi16(RGB_CB_G))), _mm256_mulhi_epi16(cr, _mm256_set1_epi16(RGB_CR_G))), 6);
+	*b = _mm256_srai_epi16(_mm256_adds_epi16(y, _mm256_adds_epi16(_mm256_srai_epi16(cb, 1), _mm256_mulhi_epi16(cb, _mm256_set1_epi16(RGB_CB_B)))), 6);
+}
+
+/* Store the 12 bytes of 4 RGB24 pixels, without writing past them */
+__attribute__((target("avx2")))
+static inline void convert_store_rgb24(uint8_t *dst, __m128i x)
+{
+	int last;
+
+	_mm_storel_epi64((__m128i *)dst, x);
+	last = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+	memcpy(dst + 8, &last, 4);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb24_avx2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	/* RGBx pixels to RGB, 4 per lane */
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i r;
+	__m256i g;
+	__m256i b;
+	__m256i rg;
+	__m256i bx;
+	__m256i lo;
+	__m256i hi;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		convert_rgb_avx2(src + i * 2, &r, &g, &b);
+		rg = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), _mm256_packus_epi16(g, g));
+		bx = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_setzero_si256());
+		/* Pixels 0-3 and 8-11, 4-7 and 12-15 */
+		lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg, bx), pack);
+		hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg, bx), pack);
+		convert_store_rgb24(dst + i * 3, _mm256_castsi256_si128(lo));
+		convert_store_rgb24(dst + i * 3 + 12, _mm256_castsi256_si128(hi));
+		convert_store_rgb24(dst + i * 3 + 24, _mm256_extracti128_si256(lo, 1));
+		convert_store_rgb24(dst + i * 3 + 36, _mm256_extracti128_si256(hi, 1));
+	}
+	_mm256_zeroupper();
+	convert_rgb24_sse2(dst + i * 3, src + i * 2, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_bgra_avx2(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	__m256i r;
+	__m256i g;
+	__m256i b;
+	__m256i bg;
+	__m256i ra;
+	__m256i lo;
+	__m256i hi;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		convert_rgb_avx2(src + i * 2, &r, &g, &b);
+		bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+		ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), _mm256_set1_epi8((char)0xff));
+		/* Pixels 0-3 and 8-11, 4-7 and 12-15 */
+		lo = _mm256_unpacklo_epi16(bg, ra);
+		hi = _mm256_unpackhi_epi16(bg, ra);
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + i * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	_mm256_zeroupper();
+	convert_bgra_sse2(dst + i * 4, src + i * 2, pixels - i);
+}
+
+static const struct convert_kernels_t convert_kernels_avx2 = {
+	"avx2", convert_swap_avx2, convert_luma_avx2, convert_chroma_avx2, convert_chroma_nv12_avx2,
+	convert_rgb24_avx2, convert_bgra_avx2
+};
+#endif
+
+#ifdef HAVE_NEON
+/* vld4q_u8() splits 32 UYVY pixels into their Cb, Y0, Cr and Y1 samples */
+static void convert_swap_neon(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	int i;
+
+	for (i = 0; i + 8 <= pixels; i += 8) {
+		vst1q_u8(dst + i * 2, vrev16q_u8(vld1q_u8(src + i * 2)));
+	}
+	convert_swap_scalar(dst + i * 2, src + i * 2, pixels - i);
+}
+
+static void convert_luma_neon(uint8_t *y, const uint8_t *src, int pixels)
+{
+	uint8x16x4_t s;
+	uint8x16x2_t l;
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		s = vld4q_u8(src + i * 2);
+		l.val[0] = s.val[1];
+		l.val[1] = s.val[3];
+		vst2q_u8(y + i, l);
+	}
+	convert_luma_scalar(y + i, src + i * 2, pixels - i);
+}
+
+static void convert_chroma_neon(uint8_t *cb, uint8_t *cr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	uint8x16x4_t s0;
+	uint8x16x4_t s1;
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		s0 = vld4q_u8(src0 + i * 2);
+		s1 = vld4q_u8(src1 + i * 2);
+		vst1q_u8(cb + i / 2, vrhaddq_u8(s0.val[0], s1.val[0]));
+		vst1q_u8(cr + i / 2, vrhaddq_u8(s0.val[2], s1.val[2]));
+	}
+	convert_chroma_scalar(cb + i / 2, cr + i / 2, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+static void convert_chroma_nv12_neon(uint8_t *cbcr, const uint8_t *src0, const uint8_t *src1, int pixels)
+{
+	uint8x16x4_t s0;
+	uint8x16x4_t s1;
+	uint8x16x2_t c;
+	int i;
+
+	for (i = 0; i + 32 <= pixels; i += 32) {
+		s0 = vld4q_u8(src0 + i * 2);
+		s1 = vld4q_u8(src1 + i * 2);
+		c.val[0] = vrhaddq_u8(s0.val[0], s1.val[0]);
+		c.val[1] = vrhaddq_u8(s0.val[2], s1.val[2]);
+		vst2q_u8(cbcr + i, c);
+	}
+	convert_chroma_nv12_scalar(cbcr + i, src0 + i * 2, src1 + i * 2, pixels - i);
+}
+
+/*
+ * R, G and B of 16 UYVY pixels. vqdmulhq_s16() doubles the product, so the
+ * samples are scaled by 2^7 to get what _mm_mulhi_epi16() gets from 2^8.
+ */
+static inline void convert_rgb_neon(const uint8_t *src, uint8x16_t *r, uint8x16_t *g, uint8x16_t *b)
+{
+	uint8x8x4_t s = vld4_u8(src);
+	int16x8_t cb = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(s.val[0])), vdupq_n_s16(128)), 7);
+	int16x8_t cr = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(s.val[2])), vdupq_n_s16(128)), 7);
+	int16x8_t rc = vqdmulhq_s16(cr, vdupq_n_s16(RGB_CR_R));
+	int16x8_t gc = vaddq_s16(vqdmulhq_s16(cb, vdupq_n_s16(RGB_CB_G)), vqdmulhq_s16(cr, vdupq_n_s16(RGB_CR_G)));
+	int16x8_t bc = vaddq_s16(cb, vqdmulhq_s16(cb, vdupq_n_s16(RGB_CB_B)));
+	int16x8_t y[2];
+	uint8x8x2_t rz;
+	uint8x8x2_t gz;
+	uint8x8x2_t bz;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		y[i] = vsubq_s16(vqdmulhq_s16(vreinterpretq_s16_u16(vshll_n_u8(s.val[i * 2 + 1], 7)), vdupq_n_s16(RGB_Y)), vdupq_n_s16(RGB_Y_OFFSET));
+	}
+	rz = vzip_u8(vqshrun_n_s16(vqaddq_s16(y[0], rc), 6), vqshrun_n_s16(vqaddq_s16(y[1], rc), 6));
+	gz = vzip_u8(vqshrun_n_s16(vqsubq_s16(y[0], gc), 6), vqshrun_n_s16(vqsubq_s16(y[1], gc), 6));
+	bz = vzip_u8(vqshrun_n_s16(vqaddq_s16(y[0], bc), 6), vqshrun_n_s16(vqaddq_s16(y[1], bc), 6));
+	*r = vcombine_u8(rz.val[0], rz.val[1]);
+	*g = vcombine_u8(gz.val[0], gz.val[1]);
+	*b = vcombine_u8(bz.val[0], bz.val[1]);
+}
+
+static void convert_rgb24_neon(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	uint8x16x3_t rgb;
+	int i;
+
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		convert_rgb_neon(src + i * 2, &rgb.val[0], &rgb.val[1], &rgb.val[2]);
+		vst3q_u8(dst + i * 3, rgb);
+	}
+	convert_rgb24_scalar(dst + i * 3, src + i * 2, pixels - i);
+}
+
+static void convert_bgra_neon(uint8_t *dst, const uint8_t *src, int pixels)
+{
+	uint8x16x4_t bgra;
+	int i;
+
+	bgra.val[3] = vdupq_n_u8(0xff);
+	for (i = 0; i + 16 <= pixels; i += 16) {
+		convert_rgb_neon(src + i * 2, &bgra.val[2], &bgra.val[1], &bgra.val[0]);
+		vst4q_u8(dst + i * 4, bgra);
+	}
+	convert_bgra_scalar(dst + i * 4, src + i * 2, pixels - i);
+}
+
+static const struct convert_kernels_t convert_kernels_neon = {
+	"neon", convert_swap_neon, convert_luma_neon, convert_chroma_neon, convert_chroma_nv12_neon,
+	convert_rgb24_neon, convert_bgra_neon
+};
+#endif
+
+#define CONVERT_KERNELS_MAX 3
+
+/* The conversion kernels this CPU supports, slowest (scalar) first; returns their number */
+static int convert_kernels_supported(const struct convert_kernels_t **list)
+{
+	int count = 0;
+
+	list[count++] = &convert_kernels_scalar;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		list[count++] = &convert_kernels_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		list[count++] = &convert_kernels_avx2;
+	}
+#endif
+#ifdef HAVE_NEON
+	/* __ARM_NEON is only defined when the compiler may use NEON everywhere */
+	list[count++] = &convert_kernels_neon;
+#endif
+	return count;
+}
+
+static const struct convert_kernels_t *convert_kernels = &convert_kernels_scalar;
+
+/* Select the fastest conversion kernels supported by this CPU */
+static void convert_select()
+{
+	const struct convert_kernels_t *list[CONVERT_KERNELS_MAX];
+
+	convert_kernels = list[convert_kernels_supported(list) - 1];
+}
+
+/* Size of a 720 pixel wide frame of height lines in the given pixel format */
+static size_t pixel_format_size(int format, int height)
+{
+	switch (format) {
+	case PIXEL_I420:
+	case PIXEL_NV12:
+		return 720 * height * 3 / 2;
+	case PIXEL_RGB24:
+		return 720 * height * 3;
+	case PIXEL_BGRA:
+		return 720 * height * 4;
+	}
+	return 720 * height * 2;
+}
+
+/*
+ * Convert lines first to last - 1 of a UYVY picture of height lines to the
+ * given pixel format. The picture is an interlaced frame or, with field set,
+ * one of its fields, whose lines are every other line of the frame. height,
+ * first and last are multiples of 4, so that each band of lines has whole
+ * 4:2:0 chroma rows.
+ */
+static void convert_lines(const struct convert_kernels_t *kernels, int format, uint8_t *dst, const uint8_t *src, int height, int field, int first, int last)
+{
+	const int stride = field ? 720 * 2 * 2 : 720 * 2;
+	uint8_t *cb = dst + 720 * height;
+	uint8_t *cr;
+	const uint8_t *line;
+	const uint8_t *pair;
+	int row;
+	int i;
+
+	for (i = first; i < last; i++) {
+		line = src + i * stride;
+		switch (format) {
+		case PIXEL_UYVY:
+			memcpy(dst + i * 720 * 2, line, 720 * 2);
+			break;
+		case PIXEL_YUYV:
+			kernels->swap(dst + i * 720 * 2, line, 720);
+			break;
+		case PIXEL_YUV422P:
+			cr = cb + 360 * height;
+			kernels->luma(dst + i * 720, line, 720);
+			kernels->chroma(cb + i * 360, cr + i * 360, line, line, 720);
+			break;
+		case PIXEL_I420:
+		case PIXEL_NV12:
+			kernels->luma(dst + i * 720, line, 720);
+			/*
+			 * Lines 2n and 2n + 1 of a field make chroma row n; lines
+			 * 4n and 4n + 2 of a frame make row 2n, 4n + 1 and 4n + 3
+			 * row 2n + 1
+			 */
+			if (field ? i % 2 != 0 : i % 4 >= 2) {
+				break;
+			}
+			row = field ? i / 2 : i / 4 * 2 + i % 4;
+			pair = line + (field ? stride : 2 * stride);
+			if (format == PIXEL_I420) {
+				cr = cb + 360 * height / 2;
+				kernels->chroma(cb + row * 360, cr + row * 360, line, pair, 720);
+			} else {
+				kernels->chroma_nv12(cb + row * 720, line, pair, 720);
+			}
+			break;
+		case PIXEL_RGB24:
+			kernels->rgb24(dst + i * 720 * 3, line, 720);
+			break;
+		case PIXEL_BGRA:
+			kernels->bgra(dst + i * 720 * 4, line, 720);
+			break;
+		}
+	}
+}
+
+/* Convert a UYVY frame of height lines (a multiple of 4) to the given pixel format, returning its size */
+static size_t convert_frame(const struct convert_kernels_t *kernels, int format, uint8_t *dst, const uint8_t *src, int height)
+{
+	convert_lines(kernels, format, dst, src, height, 0, 0, height);
+	return pixel_format_size(format, height);
+}
+
+/*
+ * Conversion bands (see --convert-threads): convert_frame_banded() converts
+ * the first band of lines of a frame itself and hands the others to the band
+ * workers. The workers serve one frame at a time; a frame that comes while
+ * they are busy with another device's is converted by its caller alone.
+ */
+static struct convert_band_t *convert_bands = NULL;
+static int convert_band_count = 0;
+static pthread_mutex_t convert_bands_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *convert_band_worker(void *arg)
+{
+	struct convert_band_t *band = arg;
+
+	for (;;) {
+		sem_wait(&band->work);
+		if (atomic_load(&band->closed)) {
+			return NULL;
+		}
+		convert_lines(convert_kernels, band->format, band->dst, band->src, band->height, band->field, band->first, band->last);
+		sem_post(&band->done);
+	}
+}
+
+/* Convert a frame, or one of its fields (see convert_lines()), returning its size */
+static size_t convert_frame_banded(int format, uint8_t *dst, const uint8_t *src, int height, int field)
+{
+	struct convert_band_t *band;
+	int lines;
+	int i;
+
+	if (convert_band_count == 0 || pthread_mutex_trylock(&convert_bands_lock) != 0) {
+		convert_lines(convert_kernels, format, dst, src, height, field, 0, height);
+		return pixel_format_size(format, height);
+	}
+	lines = height / 4 / (convert_band_count + 1) * 4;
+	for (i = 0; i < convert_band_count; i++) {
+		band = &convert_bands[i];
+		band->format = format;
+		band->dst = dst;
+		band->src = src;
+		band->height = height;
+		band->field = field;
+		band->first = lines * (i + 1);
+		band->last = (i == convert_band_count - 1) ? height : lines * (i + 2);
+		sem_post(&band->work);
+	}
+	convert_lines(convert_kernels, format, dst, src, height, field, 0, lines);
+	for (i = 0; i < convert_band_count; i++) {
+		sem_wait(&convert_bands[i].done);
+	}
+	pthread_mutex_unlock(&convert_bands_lock);
+	return pixel_format_size(format, height);
+}
+
+/* Start the band workers, one less than --convert-threads */
+static int convert_bands_start()
+{
+	int ret;
+	int i;
+
+	if (convert_threads <= 1) {
+		return 0;
+	}
+	convert_bands = calloc(convert_threads - 1, sizeof *convert_bands);
+	if (convert_bands == NULL) {
+		perror("Failed to allocate memory for the conversion threads");
+		return 1;
+	}
+	for (i = 0; i < convert_threads - 1; i++) {
+		sem_init(&convert_bands[i].work, 0, 0);
+		sem_init(&convert_bands[i].done, 0, 0);
+		atomic_init(&convert_bands[i].closed, 0);
+		ret = pthread_create(&convert_bands[i].thread, NULL, convert_band_worker, &convert_bands[i]);
+		if (ret) {
+			fprintf(stderr, "%s: Failed to start conversion thread: %s\n", program_path, strerror(ret));
+			return 1;
+		}
+		convert_band_count++;
+	}
+	return 0;
+}
+
+static void convert_bands_finish()
+{
+	int i;
+
+	for (i = 0; i < convert_band_count; i++) {
+		atomic_store(&convert_bands[i].closed, 1);
+		sem_post(&convert_bands[i].work);
+	}
+	for (i = 0; i < convert_band_count; i++) {
+		pthread_join(convert_bands[i].thread, NULL);
+		sem_destroy(&convert_bands[i].work);
+		sem_destroy(&convert_bands[i].done);
+	}
+	free(convert_bands);
+	convert_bands = NULL;
+	convert_band_count = 0;
+}
+
+/*
+ * Write the YUV4MPEG2 stream header: the frame size follows lines_per_field,
+ * the frame rate and the BT.601 pixel aspect ratio the television standard.
+ * The decoders put the first field of a frame on the even lines, so frames
+ * are top field first. With --field-rate, each field is a progressive frame
+ * of half the height, at twice the rate, with pixels twice as tall.
+ * YUV4MPEG2 has no packed formats, so the frames are converted to planar
+ * 4:2:2 or 4:2:0 (see --pixel-format).
+ */
+static int y4m_write_header(struct somagic_device *dev)
+{
+	char header[80];
+	int rate_50;
+	int length;
+
+	rate_50 = dev->tv_standard == PAL || dev->tv_standard == NTSC_50 || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM;
+	if (field_rate) {
+		length = snprintf(header, sizeof header, "YUV4MPEG2 W720 H%d F%s Ip A%s %s\n", dev->lines_per_field, rate_50 ? "50:1" : "60000:1001", dev->lines_per_field == 288 ? "59:108" : "5:11", pixel_format == PIXEL_I420 ? "C420mpeg2" : "C422");
+	} else {
+		length = snprintf(header, sizeof header, "YUV4MPEG2 W720 H%d F%s It A%s %s\n", dev->lines_per_field * 2, rate_50 ? "25:1" : "30000:1001", dev->lines_per_field == 288 ? "59:54" : "10:11", pixel_format == PIXEL_I420 ? "C420mpeg2" : "C422");
+	}
+	return write_all(dev->video_fd, (unsigned char *)header, length);
+}
+
+/* Write a frame with its FRAME marker in one vectored write */
+static int y4m_write_frame(struct somagic_device *dev, unsigned char *frame, size_t length)
+{
+	static char marker[] = "FRAME\n";
+	struct iovec iov[2];
+
+	iov[0].iov_base = marker;
+	iov[0].iov_len = sizeof marker - 1;
+	iov[1].iov_base = frame;
+	iov[1].iov_len = length;
+	return writev_all(dev->video_fd, iov, 2);
+}
+
+static void *video_writer(void *arg)
+{
+	struct somagic_device *dev = arg;
+	unsigned char *frame;
+	size_t length;
+	int ret;
+
+	if (y4m_output && (dev->video_fd != 1 || !y4m_stdout_started)) {
+		if (y4m_write_header(dev)) {
+			dev->frame_write_errors++;
+		}
+		y4m_stdout_started |= dev->video_fd == 1;
+	}
+	while ((frame = ring_pop_wait(&dev->video_queue, &length)) != NULL) {
+		if (y4m_output) {
+			ret = y4m_write_frame(dev, frame, length);
+		} else {
+			ret = write_all(dev->video_fd, frame, length);
+		}
+		if (ret) {
+			dev->frame_write_errors++;
+		} else {
+			dev->frames_written++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Queue a decoded frame of 2 * lines_per_field lines for output, converted
+ * to the --pixel-format: the whole frame (field -1), or with --field-rate one
+ * of its fields (0 = top, 1 = bottom) as a frame of half the height. A bottom
+ * field is only queued after its top field, so that the fields written
+ * alternate, beginning with a top field. Returns 1 if the frame was queued,
+ * 0 if it was dropped.
+ */
+static int output_frame(struct somagic_device *dev, unsigned char *frame, int lines_per_field, int field)
+{
+	unsigned char *slot;
+	size_t length;
+
+	if (field == 1 && !dev->top_field_queued) {
+		return 0;
+	}
+	dev->top_field_queued = 0;
+	if (atomic_load_explicit(&dev->first_frame, memory_order_relaxed) == 0) {
+		atomic_store_explicit(&dev->first_frame, timestamp_us(), memory_order_relaxed);
+	}
+	slot = ring_push_slot(&dev->video_queue);
+	if (slot == NULL) {
+		switch (dev->queue_policy) {
+		case QUEUE_BLOCK:
+			slot = ring_push_slot_wait(&dev->video_queue);
+			break;
+		case QUEUE_DROP_OLDEST:
+			dev->frames_dropped_oldest += ring_drop_oldest(&dev->video_queue);
+			slot = ring_push_slot(&dev->video_queue);
+			break;
+		}
+		if (slot == NULL) {
+			dev->frames_dropped_newest++;
+			return 0;
+		}
+	}
+	if (field == -1) {
+		length = convert_frame_banded(pixel_format, slot, frame, lines_per_field * 2, 0);
+	} else {
+		length = convert_frame_banded(pixel_format, slot, frame + field * 720 * 2, lines_per_field, 1);
+		dev->top_field_queued = field == 0;
+	}
+	ring_push(&dev->video_queue, length);
+	return 1;
+}
+
+/* Output a completed frame or field (see output_frame()), until --frame-count of them have been */
+static void output_completed(struct somagic_device *dev, unsigned char *frame, int lines_per_field, int field)
+{
+	if (dev->frames_generated < dev->frame_count || dev->frame_count == -1) {
+		dev->frames_generated += output_frame(dev, frame, lines_per_field, field);
+	}
+	if (dev->frames_generated >= dev->frame_count && dev->frame_count != -1) {
+		dev->stop_sending_requests = 1;
+	}
+}
+
+static void print_stats(struct somagic_device *dev)
+{
+	const char *prefix = device_prefix(dev);
+
+	fprintf(stderr, "%sFrames generated: %d\n", prefix, dev->frames_generated);
+	fprintf(stderr, "%sFrames written: %d\n", prefix, (int)dev->frames_written);
+	fprintf(stderr, "%sFrames dropped (oldest): %d\n", prefix, dev->frames_dropped_oldest);
+	fprintf(stderr, "%sFrames dropped (newest): %d\n", prefix, dev->frames_dropped_newest);
+	fprintf(stderr, "%sFrame write errors: %d\n", prefix, (int)dev->frame_write_errors);
+	fprintf(stderr, "%sTransfers dropped (decoder busy): %d\n", prefix, dev->transfers_dropped);
+	fprintf(stderr, "%sTransfer errors: %d\n", prefix, dev->transfer_errors);
+	fprintf(stderr, "%sIso packet errors: %d\n", prefix, dev->packet_errors);
+	if (dev->isobuf_size && dev->decode_buffers > 0) {
+		/* The copy the kernel was spared is made into the decode queue instead */
+		fprintf(stderr, "%sIso buffers: %s, copied to the decode queue\n", prefix, iso_memory_names[dev->isobuf_type]);
+	} else if (dev->isobuf_size) {
+		fprintf(stderr, "%sIso buffers: %s\n", prefix, iso_memory_names[dev->isobuf_type]);
+	}
+	if (dev->autotune != AUTOTUNE_OFF) {
+		fprintf(stderr, "%sShort iso packets: %d\n", prefix, dev->short_packets);
+		fprintf(stderr, "%sAutotune changes: %d, now %d transfers of %d packets\n", prefix, dev->autotune_changes, dev->iso_depth, dev->iso_packets);
+	}
+	if (watchdog_timeout) {
+		fprintf(stderr, "%sTransfer resubmit errors: %d\n", prefix, dev->resubmit_errors);
+		fprintf(stderr, "%sStream restarts: %d\n", prefix, dev->stream_restarts);
+		fprintf(stderr, "%sStream recoveries: %d\n", prefix, dev->stream_recoveries);
+		if (dev->stream_recoveries) {
+			fprintf(stderr, "%sRecovery time: %.3f s last, %.3f s average\n", prefix, dev->recovery_time_last / 1000000.0, dev->recovery_time_total / 1000000.0 / dev->stream_recoveries);
+		}
+	}
+	if (dev->raw_dump_fd != -1) {
+		fprintf(stderr, "%sRaw dump transfers dropped: %d\n", prefix, dev->raw_transfers_dropped);
+		fprintf(stderr, "%sRaw dump write errors: %d\n", prefix, (int)dev->raw_write_errors);
+	}
+	if (dev->init_done) {
+		fprintf(stderr, "%sInitialization time: %.3f s (%s)\n", prefix, (dev->init_done - dev->init_start) / 1000000.0, serial_init ? "serial" : "pipelined");
+	}
+	if (dev->init_start && atomic_load(&dev->first_frame)) {
+		fprintf(stderr, "%sTime to first frame: %.3f s\n", prefix, (atomic_load(&dev->first_frame) - dev->init_start) / 1000000.0);
+	}
+}
+
+/* Process CPU time in microseconds, user and system, so the kernel copying iso packets is included */
+static uint64_t cpu_time_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * CPU time per frame generated by all devices since capture started, to
+ * compare --iso-memory types. Only with --decode-buffers=0 does it show the
+ * copy device memory saves; otherwise gotdata() copies every packet into the
+ * decode queue, and the copy has only moved from the kernel to this program.
+ */
+static void print_cpu_stats()
+{
+	struct somagic_device *dev;
+	int frames = 0;
+
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		frames += dev->frames_generated;
+	}
+	if (frames > 0 && capture_cpu_start) {
+		fprintf(stderr, "CPU time per frame: %.3f ms\n", (cpu_time_us() - capture_cpu_start) / 1000.0 / frames);
+	}
+}
+
+static void print_all_stats()
+{
+	struct somagic_device *dev;
+
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		print_stats(dev);
+	}
+	print_cpu_stats();
+}
+
+static void request_stats(int sig)
+{
+	(void)sig;
+	statistics_requested = 1;
+}
+
+/*
+ * Write a number of bytes from the iso transfer buffer to the appropriate line and field of the frame buffer.
+ * Returns the number of bytes actually used from the buffer
+ */
+static int write_buffer(unsigned char *data, unsigned char *end, int count, unsigned char *frame, int line, int field, int lines_per_field)
+{
+	int dowrite;
+	int line_pos;
+	dowrite = MIN(end - data, count);
+
+	line_pos = line * (720 * 2) * 2 + (field * 720 * 2) + ((720 * 2) - count);
+
+	if (line < lines_per_field) {
+		memcpy(line_pos + frame, data, dowrite);
+	}
+	return dowrite;
+}
+
+static void alg1_process(struct somagic_device *dev, unsigned char *buffer, int length)
+{
+	struct alg1_video_state_t *vs = &dev->alg1_vs;
+	unsigned char *next = buffer;
+	unsigned char *end = buffer + length;
+	int bs = 0; /* bad (lost) sync: 0=no, 1=yes */
+	int hs = 0;
+	int lines_per_field = (dev->tv_standard == PAL ? 288 : 240);
+	unsigned char nc;
+	int skip;
+	int wrote;
+	do {
+		nc = *next;
+		/*
+		 * Timing reference code (TRC):
+		 *     [ff 00 00 SAV] [ff 00 00 EAV]
+		 * Where SAV is 80 or c7, and EAV is 9d or da.
+		 * A line of video will look like (1448 bytes total):
+		 *     [ff 00 00 EAV] [ff 00 00 SAV] [1440 bytes of UYVY video] (repeat on next line)
+		 */
+		switch (vs->state) {
+			case HSYNC:
+				hs++;
+				if (nc == (unsigned char)0xff) {
+					vs->state = SYNCZ1;
+					if (bs == 1) {
+						fprintf(stderr, "resync after %d @%td(%04tx)\n", hs, next - buffer, next - buffer);
+					}
+					bs = 0;
+				} else if (bs != 1) {
+					/*
+					 * The 1st byte in the TRC must be 0xff. It
+					 * wasn't, so sync was either lost or has not
+					 * yet been regained. Sync is regained by
+					 * ignoring bytes until the next 0xff.
+					 */
+					fprintf(stderr, "bad sync on line %d @%td (%04tx)\n", vs->active_line_count, next - buffer, next - buffer);
+					/*
+					 *				print_bytes_only(pbuffer, buffer_pos + 64);
+					 *				print_bytes(pbuffer + buffer_pos, 8);
+					 */
+					bs = 1;
+				}
+				next++;
+				break;
+			case SYNCZ1:
+				if (nc == (unsigned char)0x00) {
+					vs->state = SYNCZ2;
+				} else {
+					/*
+					 * The 2nd byte in the TRC must be 0x00. It
+					 * wasn't, so sync was lost.
+					 */
+					vs->state = HSYNC;
+				}
+				next++;
+				break;
+			case SYNCZ2:
+				if (nc == (unsigned char)0x00) {
+					vs->state = SYNCAV;
+				} else {
+					/*
+					 * The 3rd byte in the TRC must be 0x00. It
+					 * wasn't, so sync was lost.
+					 */
+					vs->state = HSYNC;
+				}
+				next++;
+				break;
+			case SYNCAV:
+				/*
+				 * Found 0xff 0x00 0x00, now expecting SAV or EAV. Might
+				 * also be the SDID (sliced data ID), 0x00.
+				 */
+				if (nc == (unsigned char)0x00) {
+					/*
+					 * SDID detected, so we still haven't found the
+					 * active YUV data.
+					 */
+					vs->state = HSYNC;
+					next++;
+					break;
+				}
+
+				/*
+				 * H = Bit 4 (mask 0x10).
+				 * 0: in SAV, 1: in EAV.
+				 */
+				if (nc & (unsigned char)0x10) {
+					/* EAV (end of active data) */
+					vs->state = HSYNC;
+				} else {
+					/* SAV (start of active data) */
+					/*
+						* F (field bit) = Bit 6 (mask 0x40).
+						* 0: first field, 1: 2nd field.
+						*/
+					vs->field = (nc & (unsigned char)0x40) ? 1 : 0;
+					/*
+						* V (vertical blanking bit) = Bit 5 (mask 0x20).
+						* 1: in VBI, 0: in active video.
+						*/
+					if (nc & (unsigned char)0x20) {
+						/* VBI (vertical blank) */
+						vs->state = VBLANK;
+						vs->vblank_found++;
+						if (vs->active_line_count > (lines_per_field - 8)) {
+							dev->fields_decoded++;
+							/* F changes during vertical blanking, so it still gives the field that has just ended */
+							if (field_rate) {
+								output_completed(dev, vs->frame, lines_per_field, vs->field);
+							} else if (vs->field == 0) {
+								output_completed(dev, vs->frame, lines_per_field, -1);
+							}
+							vs->vblank_found = 0;
+						}
+						vs->active_line_count = 0;
+					} else {
+						/* Line is active video */
+						vs->state = VACTIVE;
+					}
+					vs->line_remaining = 720 * 2;
+				}
+				next++;
+				break;
+			case VBLANK:
+			case VACTIVE:
+			case REMAINDER:
+				if (vs->state == VBLANK || vs->vblank_found < 20) {
+					skip = MIN(vs->line_remaining, (end - next));
+					vs->line_remaining -= skip;
+					next += skip ;
+				} else {
+					wrote = write_buffer(next, end, vs->line_remaining, vs->frame, vs->active_line_count, vs->field, lines_per_field);
+					vs->line_remaining -= wrote;
+					next += wrote;
+					if (vs->line_remaining <= 0) {
+						vs->active_line_count++;
+					}
+				}
+				if (vs->line_remaining <= 0) {
+					vs->state = HSYNC;
+				} else {
+					vs->state = REMAINDER;
+					/* no more data in this buffer. exit loop */
+					next = end;
+				}
+				break;
+		} /* end switch */
+	} while (next < end);
+}
+
+static void alg2_put_data(struct alg2_video_state_t *vs, uint8_t c)
+{
+	int line_pos;
+
+	line_pos = (2 * vs->line + vs->field) * (720 * 2) + vs->col;
+	vs->col++;
+
+	/* sanity check */
+	if (vs->col > 720 * 2)
+		vs->col = 720 * 2;
+
+	vs->frame[line_pos] = c;
+}
+
+/*
+ * Store a run of video data with a single copy. The result is the same as
+ * calling alg2_put_data() for each byte: once the column reaches the sanity
+ * limit, every remaining byte lands on the clamped column, so only the last
+ * one is kept.
+ */
+static void alg2_put_span(struct alg2_video_state_t *vs, uint8_t *data, int length)
+{
+	int line_pos;
+	int count;
+
+	if (length <= 0) {
+		return;
+	}
+
+	line_pos = (2 * vs->line + vs->field) * (720 * 2) + vs->col;
+	count = MIN(length, 720 * 2 + 1 - vs->col);
+	memcpy(vs->frame + line_pos, data, count);
+	if (count < length) {
+		vs->frame[line_pos + count - 1] = data[length - 1];
+	}
+
+	vs->col = MIN(vs->col + length, 720 * 2);
+}
+
+static void alg2_process(struct somagic_device *dev, uint8_t c)
+{
+	struct alg2_video_state_t *vs = &dev->alg2_vs;
+
+	/*
+	 * Timing reference code (TRC):
+	 *     [ff 00 00 SAV] [ff 00 00 EAV]
+	 * A line of video will look like (1448 bytes total):
+	 *     [ff 00 00 EAV] [ff 00 00 SAV] [1440 bytes of UYVY video] (repeat on next line)
+	 */
+	if (vs->state == HSYNC) {
+		if (c == 0xff) {
+			/* The 1st byte in the TRC must be 0xff. */
+			vs->state++;
+		} else {
+			alg2_put_data(vs, c);
+		}
+	} else if (vs->state == SYNCZ1) {
+		if (c == 0x00) {
+			vs->state++;
+		} else {
+			/*
+			 * The 2nd byte in the TRC must be 0x00. It
+			 * wasn't, so sync was lost.
+			 */
+			vs->state = HSYNC;
+
+			alg2_put_data(vs, 0xff);
+			alg2_put_data(vs, c);
+		}
+	} else if (vs->state == SYNCZ2) {
+		if (c == 0x00) {
+			vs->state++;
+		} else {
+			/*
+			 * The 3rd byte in the TRC must be 0x00. It
+			 * wasn't, so sync was lost.
+			 */
+			vs->state = HSYNC;
+
+			alg2_put_data(vs, 0xff);
+			alg2_put_data(vs, 0x00);
+			alg2_put_data(vs, c);
+		}
+	} else if (vs->state == SYNCAV) {
+		/*
+		 * Found 0xff 0x00 0x00, now expecting SAV or EAV. Might
+		 * also be the SDID (sliced data ID), 0x00.
+		 */
+		vs->state = HSYNC;
+		if (c == 0x00) {
+			/*
+			 * SDID (sliced data ID) detected, so active YUV data
+			 * still hasn't been found.
+			 */
+			return;
+		}
+
+		/*
+		 * H = Bit 4 (mask 0x10).
+		 * 0: in SAV, 1: in EAV.
+		 */
+		if (c & 0x10) {
+			/* EAV (end of active data) */
+			if (!vs->blank) {
+				vs->line++;
+				vs->col = 0;
+				if (vs->line > 625) vs->line = 625; /* sanity check */
+			}
+		} else {
+			int field_edge;
+			int blank_edge;
+			int ended_field;
+
+			/* SAV (start of active data) */
+			/*
+			 * F (field bit) = Bit 6 (mask 0x40).
+			 * 0: first field, 1: 2nd field.
+			 *
+			 * V (vertical blanking bit) = Bit 5 (mask 0x20).
+			 * 0: in VBI, 1: in active video.
+			 */
+			field_edge = vs->field;
+			blank_edge = vs->blank;
+			ended_field = vs->field;
+
+			vs->field = (c & 0x40) ? 1 : 0;
+			vs->blank = (c & 0x20) ? 1 : 0;
+
+			field_edge = vs->field ^ field_edge;
+			blank_edge = vs->blank ^ blank_edge;
+
+			if (field_edge) {
+				dev->fields_decoded++;
+			}
+			if (field_rate) {
+				/*
+				 * Vertical blanking begins: the last active line of the field has been
+				 * stored. As with alg1, a field missing more than a few lines (the one
+				 * capture starts in) is not output.
+				 */
+				if (vs->blank == 1 && blank_edge && vs->line > dev->lines_per_field - 8) {
+					output_completed(dev, vs->frame, dev->lines_per_field, ended_field);
+				}
+			} else if (vs->field == 0 && field_edge) {
+				output_completed(dev, vs->frame, dev->lines_per_field, -1);
+			}
+
+			if (vs->blank == 0 && blank_edge) {
+				vs->line = 0;
+				vs->col = 0;
+			}
+		}
+	}
+}
+
+/*
+ * TRC scanners: return a pointer to the first 0xff byte in [data, end), or
+ * end if there is none. In BT.656 data 0xff only appears as the first byte
+ * of a timing reference code, so everything before it is video data.
+ */
+static uint8_t *trc_scan_scalar(uint8_t *data, uint8_t *end)
+{
+	uint8_t *next;
+
+	next = memchr(data, 0xff, end - data);
+	return next ? next : end;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static uint8_t *trc_scan_sse2(uint8_t *data, uint8_t *end)
+{
+	const __m128i sync = _mm_set1_epi8((char)0xff);
+	int mask;
+
+	while (end - data >= 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), sync));
+		if (mask) {
+			return data + __builtin_ctz(mask);
+		}
+		data += 16;
+	}
+	return trc_scan_scalar(data, end);
+}
+
+__attribute__((target("avx2")))
+static uint8_t *trc_scan_avx2(uint8_t *data, uint8_t *end)
+{
+	const __m256i sync = _mm256_set1_epi8((char)0xff);
+	unsigned int mask;
+
+	while (end - data >= 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data), sync));
+		if (mask) {
+			return data + __builtin_ctz(mask);
+		}
+		data += 32;
+	}
+	return trc_scan_sse2(data, end);
+}
+#endif
+
+static uint8_t *(*trc_scan)(uint8_t *data, uint8_t *end) = trc_scan_scalar;
+
+/* Select the fastest TRC scanner supported by this CPU */
+static void trc_scan_select()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		trc_scan = trc_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		trc_scan = trc_scan_sse2;
+	}
+#endif
+}
+
+/* Benchmark only: feed every byte through alg2_process(), as before alg2_process_block() (see somagic_benchmark()) */
+static int alg2_per_byte = 0;
+
+/*
+ * Process a block of video data with alg2.
+ * Only the bytes of a (possible) TRC are fed through the alg2_process() state
+ * machine; the video data between TRCs is located with trc_scan() and copied
+ * with alg2_put_span(). The state machine keeps its state between calls, so a TRC that
+ * crosses a block or packet boundary is still found.
+ */
+static void alg2_process_block(struct somagic_device *dev, uint8_t *data, int length)
+{
+	struct alg2_video_state_t *vs = &dev->alg2_vs;
+	uint8_t *end = data + length;
+	uint8_t *next;
+
+	if (alg2_per_byte) {
+		while (data < end) {
+			alg2_process(dev, *data++);
+		}
+		return;
+	}
+	while (data < end) {
+		if (vs->state != HSYNC) {
+			alg2_process(dev, *data++);
+			continue;
+		}
+		next = trc_scan(data, end);
+		alg2_put_span(vs, data, next - data);
+		data = next;
+		if (data < end) {
+			/* 0xff, the 1st byte of a TRC */
+			alg2_process(dev, *data++);
+		}
+	}
+}
+
+/* Copy of a completed iso transfer, handed from the USB callback to the decode thread */
+struct iso_chunk_t {
+	int num_packets;
+	int length[ISO_PACKETS];
+	unsigned char data[ISO_PACKETS * ISO_PACKET_SIZE];
+};
+
+static void process_packet(struct somagic_device *dev, unsigned char *data, int length)
+{
+	int pos = 0;
+
+	while (pos < length) {
+		/*
+		 * Within each packet of the transfer, the video data is divided
+		 * into blocks of 0x400 bytes beginning with [0xaa 0xaa 0x00 0x00].
+		 * Check for this signature and process each block of data individually.
+		 */
+		if (data[pos] == 0xaa && data[pos + 1] == 0xaa && data[pos + 2] == 0x00 && data[pos + 3] == 0x00) {
+			/* Process received video data, excluding the 4 marker bytes */
+			switch (dev->sync_algorithm) {
+			case 1:
+				alg1_process(dev, data + 4 + pos, 0x400 - 4);
+				break;
+			case 2:
+				alg2_process_block(dev, data + 4 + pos, 0x400 - 4);
+				break;
+			}
+		} else {
+			fprintf(stderr, "Unexpected block, expected [aa aa 00 00] found [%02x %02x %02x %02x]\n", data[pos], data[pos + 1], data[pos + 2], data[pos + 3]);
+		}
+		pos += 0x400;
+	}
+}
+
+/* Decode pool, used when there are decode buffers (see --decode-threads) */
+static struct decode_worker_t *decode_workers = NULL;
+static int decode_worker_count = 0;
+
+/*
+ * A worker owns alg1_vs and alg2_vs of its devices while capture is running.
+ * It sleeps until one of them queues a transfer, then decodes everything
+ * they have queued.
+ */
+static void *decode_worker(void *arg)
+{
+	struct decode_worker_t *worker = arg;
+	struct somagic_device *dev;
+	struct iso_chunk_t *chunk;
+	size_t length;
+	int closed;
+	int i;
+
+	do {
+		sem_wait(&worker->work);
+		closed = atomic_load(&worker->closed);
+		for (dev = device_list; dev != NULL; dev = dev->next) {
+			if (dev->worker != worker) {
+				continue;
+			}
+			while ((chunk = (struct iso_chunk_t *)ring_pop(&dev->iso_queue, &length)) != NULL) {
+				for (i = 0; i < chunk->num_packets; i++) {
+					process_packet(dev, chunk->data + i * ISO_PACKET_SIZE, chunk->length[i]);
+				}
+			}
+		}
+	} while (!closed);
+	return NULL;
+}
+
+/* Assign the devices with decode buffers to decode workers, and start them */
+static int decode_pool_start()
+{
+	struct somagic_device *dev;
+	long cpus;
+	int count = 0;
+	int ret;
+	int i;
+
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (dev->decode_buffers > 0) {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if (decode_threads > 0) {
+		count = decode_threads;
+	} else {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus > 0 && cpus < count) {
+			count = cpus;
+		}
+	}
+
+	decode_workers = calloc(count, sizeof *decode_workers);
+	if (decode_workers == NULL) {
+		perror("Failed to allocate memory for the decode threads");
+		return 1;
+	}
+	i = 0;
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (dev->decode_buffers > 0) {
+			dev->worker = &decode_workers[i++ % count];
+			dev->iso_queue.notify = &dev->worker->work;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		sem_init(&decode_workers[i].work, 0, 0);
+		atomic_init(&decode_workers[i].closed, 0);
+		ret = pthread_create(&decode_workers[i].thread, NULL, decode_worker, &decode_workers[i]);
+		if (ret) {
+			fprintf(stderr, "%s: Failed to start decode thread: %s\n", program_path, strerror(ret));
+			return 1;
+		}
+		decode_worker_count++;
+	}
+	return 0;
+}
+
+/* Let the decode workers finish the queued transfers; no more may be queued */
+static void decode_pool_finish()
+{
+	int i;
+
+	for (i = 0; i < decode_worker_count; i++) {
+		atomic_store(&decode_workers[i].closed, 1);
+		sem_post(&decode_workers[i].work);
+	}
+	for (i = 0; i < decode_worker_count; i++) {
+		pthread_join(decode_workers[i].thread, NULL);
+		sem_destroy(&decode_workers[i].work);
+	}
+	free(decode_workers);
+	decode_workers = NULL;
+	decode_worker_count = 0;
+}
+
+/*
+ * Raw dump file (--raw-dump), in host byte order: a raw_file_header, then for
+ * each completed transfer a raw_transfer_header, one raw_packet_header per iso
+ * packet, and the payload of all packets back to back (actual_length bytes
+ * each, 0x400 byte blocks with their [aa aa 00 0x] markers left in place).
+ * The index file (FILENAME.idx) has a raw_file_header followed by one
+ * raw_index_entry per transfer in the dump file. Sequence numbers count every
+ * completed transfer, so transfers dropped from the dump show up as gaps.
+ */
+#define RAW_DUMP_MAGIC "SMRAWDMP"
+#define RAW_INDEX_MAGIC "SMRAWIDX"
+#define RAW_DUMP_VERSION 1
+
+struct raw_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t packet_size;       /* ISO_PACKET_SIZE */
+};
+
+struct raw_transfer_header {
+	uint64_t timestamp;         /* microseconds, monotonic clock */
+	uint32_t sequence;
+	int32_t status;             /* enum libusb_transfer_status */
+	uint32_t num_packets;
+	uint32_t length;            /* payload bytes following the packet headers */
+};
+
+struct raw_packet_header {
+	int32_t status;             /* enum libusb_transfer_status */
+	uint32_t actual_length;
+};
+
+struct raw_index_entry {
+	uint64_t offset;            /* of the raw_transfer_header in the dump file */
+	uint32_t sequence;
+	uint32_t blocks;            /* 0x400 byte blocks in the payload */
+};
+
+/* Transfers are appended to large chunks, which the dump thread writes out in one go */
+#define RAW_CHUNKS 8
+#define RAW_CHUNK_SIZE (4 * 1024 * 1024)
+#define RAW_CHUNK_ENTRIES 1024
+
+struct raw_chunk_t {
+	size_t length;
+	int entries;
+	struct raw_index_entry entry[RAW_CHUNK_ENTRIES];
+	unsigned char data[RAW_CHUNK_SIZE];
+};
+
+static int raw_dump_open(struct somagic_device *dev, const char *filename)
+{
+	char *index_filename;
+
+	index_filename = malloc(strlen(filename) + 5);
+	if (index_filename == NULL) {
+		perror("Failed to allocate memory for the index filename");
+		return 1;
+	}
+	sprintf(index_filename, "%s.idx", filename);
+
+	dev->raw_dump_fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (dev->raw_dump_fd == -1) {
+		fprintf(stderr, "%s: Failed to open raw dump file '%s': %s\n", program_path, filename, strerror(errno));
+		free(index_filename);
+		return 1;
+	}
+	dev->raw_index_fd = open(index_filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (dev->raw_index_fd == -1) {
+		fprintf(stderr, "%s: Failed to open raw dump index file '%s': %s\n", program_path, index_filename, strerror(errno));
+		free(index_filename);
+		return 1;
+	}
+	free(index_filename);
+	return 0;
+}
+
+static void *raw_dump_writer(void *arg)
+{
+	struct somagic_device *dev = arg;
+	struct raw_chunk_t *chunk;
+	size_t length;
+
+	while ((chunk = (struct raw_chunk_t *)ring_pop_wait(&dev->raw_queue, &length)) != NULL) {
+		if (write_all(dev->raw_dump_fd, chunk->data, chunk->length)) {
+			dev->raw_write_errors++;
+		}
+		if (write_all(dev->raw_index_fd, (unsigned char *)chunk->entry, chunk->entries * sizeof *chunk->entry)) {
+			dev->raw_write_errors++;
+		}
+	}
+	return NULL;
+}
+
+static int raw_dump_start(struct somagic_device *dev)
+{
+	struct raw_file_header header;
+	int ret;
+
+	memset(&header, 0, sizeof header);
+	header.version = RAW_DUMP_VERSION;
+	header.packet_size = ISO_PACKET_SIZE;
+	memcpy(header.magic, RAW_DUMP_MAGIC, 8);
+	if (write_all(dev->raw_dump_fd, (unsigned char *)&header, sizeof header)) {
+		perror("Failed to write raw dump file header");
+		return 1;
+	}
+	memcpy(header.magic, RAW_INDEX_MAGIC, 8);
+	if (write_all(dev->raw_index_fd, (unsigned char *)&header, sizeof header)) {
+		perror("Failed to write raw dump index file header");
+		return 1;
+	}
+	dev->raw_chunk = NULL;
+	dev->raw_offset = sizeof header;
+	dev->raw_sequence = 0;
+
+	if (ring_init(&dev->raw_queue, RAW_CHUNKS, sizeof(struct raw_chunk_t))) {
+		perror("Failed to allocate memory for the raw dump buffers");
+		return 1;
+	}
+	ret = pthread_create(&dev->raw_dump_thread, NULL, raw_dump_writer, dev);
+	if (ret) {
+		fprintf(stderr, "%s: Failed to start raw dump thread: %s\n", program_path, strerror(ret));
+		return 1;
+	}
+	return 0;
+}
+
+/* Append a completed transfer to the dump. Never waits: if all chunks are queued, the transfer is dropped. */
+static void raw_dump_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	struct raw_chunk_t *raw_chunk = dev->raw_chunk;
+	struct raw_transfer_header header;
+	struct raw_packet_header packet;
+	struct raw_index_entry *entry;
+	unsigned char *out;
+	size_t size;
+	int i;
+
+	header.timestamp = timestamp_us();
+	header.sequence = dev->raw_sequence++;
+	header.status = tfr->status;
+	header.num_packets = tfr->num_iso_packets;
+	header.length = 0;
+	for (i = 0; i < tfr->num_iso_packets; i++) {
+		header.length += tfr->iso_packet_desc[i].actual_length;
+	}
+	size = sizeof header + header.num_packets * sizeof packet + header.length;
+
+	if (raw_chunk != NULL && (raw_chunk->length + size > RAW_CHUNK_SIZE || raw_chunk->entries == RAW_CHUNK_ENTRIES)) {
+		ring_push(&dev->raw_queue, sizeof *raw_chunk);
+		raw_chunk = NULL;
+	}
+	if (raw_chunk == NULL) {
+		raw_chunk = (struct raw_chunk_t *)ring_push_slot(&dev->raw_queue);
+		dev->raw_chunk = raw_chunk;
+		if (raw_chunk == NULL) {
+			dev->raw_transfers_dropped++;
+			return;
+		}
+		raw_chunk->length = 0;
+		raw_chunk->entries = 0;
+	}
+
+	entry = &raw_chunk->entry[raw_chunk->entries++];
+	entry->offset = dev->raw_offset;
+	entry->sequence = header.sequence;
+	entry->blocks = (header.length + 0x400 - 1) / 0x400;
+
+	out = raw_chunk->data + raw_chunk->length;
+	memcpy(out, &header, sizeof header);
+	out += sizeof header;
+	for (i = 0; i < tfr->num_iso_packets; i++) {
+		packet.status = tfr->iso_packet_desc[i].status;
+		packet.actual_length = tfr->iso_packet_desc[i].actual_length;
+		memcpy(out, &packet, sizeof packet);
+		out += sizeof packet;
+	}
+	for (i = 0; i < tfr->num_iso_packets; i++) {
+		memcpy(out, libusb_get_iso_packet_buffer_simple(tfr, i), tfr->iso_packet_desc[i].actual_length);
+		out += tfr->iso_packet_desc[i].actual_length;
+	}
+	raw_chunk->length += size;
+	dev->raw_offset += size;
+}
+
+/* Write out the partly filled chunk and wait for the dump thread */
+static void raw_dump_finish(struct somagic_device *dev)
+{
+	if (dev->raw_chunk != NULL) {
+		ring_push(&dev->raw_queue, sizeof *dev->raw_chunk);
+		dev->raw_chunk = NULL;
+	}
+	ring_close(&dev->raw_queue);
+	pthread_join(dev->raw_dump_thread, NULL);
+	ring_free(&dev->raw_queue);
+}
+
+/* Submit an iso transfer with the current number of packets (see autotune()) */
+static int capture_submit_transfer(struct somagic_device *dev, struct libusb_transfer *tfr)
+{
+	int ret;
+
+	if (tfr->num_iso_packets != dev->iso_packets) {
+		tfr->num_iso_packets = dev->iso_packets;
+		tfr->length = dev->iso_packets * ISO_PACKET_SIZE;
+		libusb_set_iso_packet_lengths(tfr, ISO_PACKET_SIZE);
+	}
+	ret = dev->transport->submit_transfer(dev, tfr);
+	if (ret == 0) {
+		dev->pending_requests++;
+	}
+	return ret;
+}
+
+/* Measure the gaps between callbacks and the packets lost, for autotune() */
+static void autotune_measure(struct somagic_device *dev, int packets, int errors)
+{
+	uint64_t now = timestamp_us();
+
+	if (dev->last_callback && now - dev->last_callback > dev->max_callback_gap) {
+		dev->max_callback_gap = now - dev->last_callback;
+	}
+	dev->last_callback = now;
+	dev->callbacks++;
+	dev->packets_seen += packets;
+	dev->packets_lost += errors;
+}
+
+static void gotdata(struct libusb_transfer *tfr)
+{
+	struct somagic_device *dev = tfr->user_data;
+	int ret;
+	int num = tfr->num_iso_packets;
+	int errors = 0;
+	int i;
+	struct iso_chunk_t *chunk;
+
+	dev->pending_requests--;
+
+	if (tfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		dev->transfer_errors++;
+		dev->transfer_error_run++;
+	} else {
+		dev->transfer_error_run = 0;
+	}
+	for (i = 0; i < num; i++) {
+		if (tfr->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) {
+			errors++;
+		} else if (tfr->iso_packet_desc[i].actual_length < tfr->iso_packet_desc[i].length) {
+			dev->short_packets++;
+		}
+	}
+	dev->packet_errors += errors;
+	if (dev->autotune != AUTOTUNE_OFF) {
+		autotune_measure(dev, num, errors);
+	}
+
+	if (dev->raw_dump_fd != -1) {
+		raw_dump_transfer(dev, tfr);
+	}
+
+	if (dev->decode_buffers > 0) {
+		/* Hand the data to the decode thread, so the transfer can be resubmitted at once */
+		if (replay_filename != NULL) {
+			/* No deadline to meet when replaying, so wait rather than drop data */
+			chunk = (struct iso_chunk_t *)ring_push_slot_wait(&dev->iso_queue);
+		} else {
+			chunk = (struct iso_chunk_t *)ring_push_slot(&dev->iso_queue);
+		}
+		if (chunk == NULL) {
+			dev->transfers_dropped++;
+		} else {
+			chunk->num_packets = num;
+			for (i = 0; i < num; i++) {
+				chunk->length[i] = tfr->iso_packet_desc[i].actual_length;
+				memcpy(chunk->data + i * ISO_PACKET_SIZE, libusb_get_iso_packet_buffer_simple(tfr, i), chunk->length[i]);
+			}
+			ring_push(&dev->iso_queue, sizeof *chunk);
+		}
+	} else {
+		for (i = 0; i < num; i++) {
+			process_packet(dev, libusb_get_iso_packet_buffer_simple(tfr, i), tfr->iso_packet_desc[i].actual_length);
+		}
+	}
+
+	if (dev->stop_sending_requests || dev->restarting || replay_filename != NULL) {
+		return;
+	}
+	if (dev->pending_requests >= dev->iso_depth) {
+		/* autotune() lowered the depth */
+		dev->idle[dev->idle_count++] = tfr;
+		return;
+	}
+	ret = capture_submit_transfer(dev, tfr);
+	if (ret == 0) {
+		return;
+	}
+	if (watchdog_timeout && !hotplug) {
+		/* capture_watchdog() restarts the stream with all transfers */
+		dev->resubmit_errors++;
+	} else if (hotplug) {
+		/* Let the other transfers drain, then hotplug_poll() looks for the device again */
+		if (!atomic_exchange(&dev->stop_sending_requests, 1) && ret != LIBUSB_ERROR_NO_DEVICE) {
+			fprintf(stderr, "%s: Failed to resubmit transfer to %s: %s\n", program_path, dev->name, libusb_error_name(ret));
+		}
+	} else {
+		fprintf(stderr, "libusb_submit_transfer failed with error %d\n", ret);
+		exit(1);
+	}
+}
+
+static int shadow_i2c_valid(struct somagic_device *dev, uint8_t reg)
+{
+	return (dev->shadow.saa7113_valid[reg / 8] >> (reg % 8)) & 1;
+}
+
+static void shadow_set_i2c(struct somagic_device *dev, uint8_t reg, uint8_t val)
+{
+	dev->shadow.saa7113[reg] = val;
+	dev->shadow.saa7113_valid[reg / 8] |= 1 << (reg % 8);
+}
+
+static void shadow_set_reg(struct somagic_device *dev, uint16_t reg, uint8_t val, int valid)
+{
+	struct register_shadow_t *shadow = &dev->shadow;
+	int i;
+
+	for (i = 0; i < shadow->bridge_count && shadow->bridge_reg[i] != reg; i++);
+	if (!valid) {
+		if (i < shadow->bridge_count) {
+			shadow->bridge_count--;
+			shadow->bridge_reg[i] = shadow->bridge_reg[shadow->bridge_count];
+			shadow->bridge_val[i] = shadow->bridge_val[shadow->bridge_count];
+		}
+	} else if (i < BRIDGE_SHADOW_MAX) {
+		shadow->bridge_reg[i] = reg;
+		shadow->bridge_val[i] = val;
+		shadow->bridge_count = MAX(shadow->bridge_count, i + 1);
+	}
+}
+
+/*
+ * Record the registers written by a control message (see somagic_reg_message()
+ * and somagic_i2c_message()) in the shadow if the device accepted it, or
+ * forget them if it did not
+ */
+static void shadow_update(struct somagic_device *dev, const uint8_t *msg, int accepted)
+{
+	int reg;
+	int i;
+
+	if (msg[1] == 0x00) {
+		shadow_set_reg(dev, (msg[5] << 8) | msg[6], msg[7], accepted);
+	} else if (msg[1] == 0x4a) {
+		for (i = 0; i < msg[4]; i++) {
+			reg = (msg[5] + i) & 0xff;
+			if (accepted) {
+				shadow_set_i2c(dev, reg, msg[6 + i]);
+			} else {
+				dev->shadow.saa7113_valid[reg / 8] &= ~(1 << (reg % 8));
+			}
+		}
+	}
+}
+
+/* Fill the 8 byte control message that writes a bridge register */
+static void somagic_reg_message(uint8_t *buf, uint16_t reg, uint8_t val)
+{
+	memcpy(buf, "\x0b\x00\x00\x82\x01\x00\x3a\x00", 8);
+	buf[5] = reg >> 8;
+	buf[6] = reg & 0xff;
+	buf[7] = val;
+}
+
+/*
+ * Fill the control message that writes count consecutive I2C registers,
+ * from reg on (the SAA7113 increments the subaddress after each byte).
+ * Returns the length of the message: 8 bytes for a single register.
+ */
+static int somagic_i2c_message(uint8_t *buf, uint8_t dev_addr, uint8_t reg, const uint8_t *val, int count)
+{
+	memcpy(buf, "\x0b\x4a\xc0\x01\x01\x01\x08\xf4", 8);
+
+	buf[1] = dev_addr;
+	buf[4] = count;
+	buf[5] = reg;
+	memcpy(buf + 6, val, count);
+	return MAX(6 + count, 8);
+}
+
+static int somagic_write_reg(struct somagic_device *dev, uint16_t reg, uint8_t val)
+{
+	int ret;
+	uint8_t buf[8];
+
+	somagic_reg_message(buf, reg, val);
+
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
+	shadow_update(dev, buf, ret == 8);
+	if (ret != 8) {
+		fprintf(stderr, "write reg control msg returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
+		fprintf(stderr, "\n");
+	}
+
+	return ret;
+}
+
+static int somagic_write_i2c(struct somagic_device *dev, uint8_t dev_addr, uint8_t reg, uint8_t val)
+{
+	int ret;
+	uint8_t buf[8];
+
+	somagic_i2c_message(buf, dev_addr, reg, &val, 1);
+
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 8, 1000);
+	shadow_update(dev, buf, ret == 8);
+	if (ret != 8) {
+		fprintf(stderr, "write_i2c returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
+		fprintf(stderr, "\n");
+	}
+
+	return ret;
+}
+
+/* Firmware rejected a burst write: write single registers from now on */
+static void i2c_burst_rejected(struct somagic_device *dev)
+{
+	fprintf(stderr, "%sI2C burst write rejected, falling back to single register writes\n", device_prefix(dev));
+	dev->i2c_burst_max = 1;
+}
+
+/*
+ * Write count consecutive I2C registers, from reg on, in one control transfer
+ * if the firmware accepts it, and one register at a time if not.
+ */
+static int somagic_write_i2c_burst(struct somagic_device *dev, uint8_t dev_addr, uint8_t reg, const uint8_t *val, int count)
+{
+	int ret;
+	int length;
+	int i;
+	uint8_t buf[6 + I2C_BURST_MAX];
+
+	if (count > 1 && count <= dev->i2c_burst_max) {
+		length = somagic_i2c_message(buf, dev_addr, reg, val, count);
+		ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, length, 1000);
+		shadow_update(dev, buf, ret == length);
+		if (ret == length) {
+			return ret;
+		}
+		i2c_burst_rejected(dev);
+	}
+	for (i = 0; i < count; i++) {
+		ret = somagic_write_i2c(dev, dev_addr, reg + i, val[i]);
+	}
+	return ret;
+}
+
+/*
+ * Read an I2C register: select the subaddress, start the read, then fetch
+ * the result. The firmware needs time to complete each I2C transaction.
+ * Returns 0 and stores the value in the shadow on success.
+ */
+static int somagic_read_i2c(struct somagic_device *dev, uint8_t dev_addr, uint8_t reg, uint8_t *val)
+{
+	int ret;
+	uint8_t buf[13];
+
+	memcpy(buf, "\x0b\x4a\x84\x00\x01\x10\x00\x00\x00\x00\x00\x00\x00", 13);
+	buf[1] = dev_addr;
+	buf[5] = reg;
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	if (ret != 13) {
+		return 1;
+	}
+	usleep(18 * 1000);
+
+	memcpy(buf, "\x0b\x4a\xa0\x00\x01\x00\xff\xff\xff\xff\xff\xff\xff", 13);
+	buf[1] = dev_addr;
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	if (ret != 13) {
+		return 1;
+	}
+
+	memset(buf, 0xff, 13);
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x000000b, 0x0000000, buf, 13, 1000);
+	usleep(11 * 1000);
+	if (ret != 13) {
+		return 1;
+	}
+
+	*val = buf[5];
+	if (dev_addr == 0x4a) {
+		shadow_set_i2c(dev, reg, *val);
+	}
+	return 0;
+}
+
+/*
+ * Register writes, kept as data so they can be pipelined
+ * (see somagic_write_sequence())
+ */
+#define WRITE_SEQUENCE_MAX 256
+
+enum write_types {
+	WRITE_REG,   /* bridge register */
+	WRITE_I2C,   /* I2C register */
+	WRITE_WAIT   /* wait for the writes before to complete, then sleep for delay microseconds */
+};
+
+struct somagic_write {
+	uint8_t type;
+	uint8_t dev_addr;
+	uint16_t reg;
+	uint8_t val;
+	uint32_t delay;
+};
+
+struct write_sequence {
+	struct somagic_write write[WRITE_SEQUENCE_MAX];
+	int count;
+	int overflow;
+};
+
+/*
+ * Number of I2C writes from write on that can go in one burst: writes to
+ * consecutive registers of the same I2C device, up to max. Their values are
+ * copied to val.
+ */
+static int seq_burst(struct somagic_write *write, struct somagic_write *end, int max, uint8_t *val)
+{
+	int count = 0;
+
+	while (write + count < end && count < max
+	       && write[count].type == WRITE_I2C
+	       && write[count].dev_addr == write->dev_addr
+	       && write[count].reg == write->reg + count) {
+		val[count] = write[count].val;
+		count++;
+	}
+	return count;
+}
+
+static struct somagic_write *seq_add(struct write_sequence *seq, uint8_t type)
+{
+	struct somagic_write *write;
+
+	if (seq->count == WRITE_SEQUENCE_MAX) {
+		seq->overflow = 1;
+		return NULL;
+	}
+	write = &seq->write[seq->count++];
+	memset(write, 0, sizeof *write);
+	write->type = type;
+	return write;
+}
+
+static void seq_reg(struct write_sequence *seq, uint16_t reg, uint8_t val)
+{
+	struct somagic_write *write = seq_add(seq, WRITE_REG);
+
+	if (write != NULL) {
+		write->reg = reg;
+		write->val = val;
+	}
+}
+
+static void seq_i2c(struct write_sequence *seq, uint8_t dev_addr, uint8_t reg, uint8_t val)
+{
+	struct somagic_write *write = seq_add(seq, WRITE_I2C);
+
+	if (write != NULL) {
+		write->dev_addr = dev_addr;
+		write->reg = reg;
+		write->val = val;
+	}
+}
+
+static void seq_wait(struct write_sequence *seq, uint32_t delay)
+{
+	struct somagic_write *write = seq_add(seq, WRITE_WAIT);
+
+	if (write != NULL) {
+		write->delay = delay;
+	}
+}
+
+/*
+ * Control transfers in flight for somagic_write_sequence(). Transfers on the
+ * control endpoint complete in the order they were submitted, so the slots
+ * are used round robin.
+ */
+#define CONTROL_PIPELINE_DEPTH 16
+
+struct control_pipeline_t {
+	struct libusb_transfer *tfr[CONTROL_PIPELINE_DEPTH];
+	unsigned char buf[CONTROL_PIPELINE_DEPTH][LIBUSB_CONTROL_SETUP_SIZE + 6 + I2C_BURST_MAX];
+	int submitted;
+	int in_flight;
+};
+
+static void control_done(struct libusb_transfer *tfr)
+{
+	struct somagic_device *dev = tfr->user_data;
+	unsigned char *data = libusb_control_transfer_get_data(tfr);
+	int length = libusb_le16_to_cpu(libusb_control_transfer_get_setup(tfr)->wLength);
+	int burst = data[1] != 0x00 && data[4] > 1;
+
+	dev->pipeline->in_flight--;
+	shadow_update(dev, data, tfr->status == LIBUSB_TRANSFER_COMPLETED && tfr->actual_length == length);
+	if (tfr->status == LIBUSB_TRANSFER_COMPLETED && tfr->actual_length == length) {
+		if (burst) {
+			dev->i2c_burst_ok = 1;
+		}
+	} else if (burst && !dev->i2c_burst_ok) {
+		i2c_burst_rejected(dev);
+	} else {
+		fprintf(stderr, "%swrite %s control transfer failed with status %d, %d bytes sent: ", device_prefix(dev), data[1] == 0x00 ? "reg" : "i2c", tfr->status, tfr->actual_length);
+		print_bytes(data, length);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void control_pipeline_free(struct control_pipeline_t *pipeline)
+{
+	int slot;
+
+	for (slot = 0; slot < CONTROL_PIPELINE_DEPTH; slot++) {
+		libusb_free_transfer(pipeline->tfr[slot]);
+	}
+	free(pipeline);
+}
+
+/* Wait until no more than max_in_flight control transfers are in flight */
+static void control_pipeline_wait(struct somagic_device *dev, int max_in_flight)
+{
+	while (dev->pipeline->in_flight > max_in_flight) {
+		dev->transport->handle_events();
+	}
+}
+
+/*
+ * Perform a sequence of register writes. Writes to consecutive I2C registers
+ * are combined into bursts (see --i2c-burst). Unless --serial-init is given,
+ * the control transfers are submitted without waiting for the ones before to
+ * complete, so the device is kept busy instead of waiting for a round trip
+ * through the host after each write. Only a WRITE_WAIT drains the pipeline.
+ */
+static int somagic_write_sequence(struct somagic_device *dev, struct write_sequence *seq)
+{
+	struct control_pipeline_t *pipeline;
+	struct somagic_write *write;
+	struct somagic_write *end = seq->write + seq->count;
+	uint8_t val[I2C_BURST_MAX];
+	unsigned char *buf;
+	int ret = 0;
+	int length;
+	int count;
+	int slot;
+	int i;
+
+	if (seq->overflow) {
+		fprintf(stderr, "%s: Register write sequence is longer than %d writes\n", program_path, WRITE_SEQUENCE_MAX);
+		return 1;
+	}
+
+	if (serial_init) {
+		for (i = 0; i < seq->count; i += count) {
+			write = &seq->write[i];
+			count = 1;
+			switch (write->type) {
+			case WRITE_REG:
+				somagic_write_reg(dev, write->reg, write->val);
+				break;
+			case WRITE_I2C:
+				count = seq_burst(write, end, dev->i2c_burst_max, val);
+				somagic_write_i2c_burst(dev, write->dev_addr, write->reg, val, count);
+				break;
+			case WRITE_WAIT:
+				if (write->delay) {
+					usleep(write->delay);
+				}
+				break;
+			}
+		}
+		return 0;
+	}
+
+	pipeline = calloc(1, sizeof *pipeline);
+	if (pipeline == NULL) {
+		perror("Failed to allocate memory for the control transfers");
+		return 1;
+	}
+	for (slot = 0; slot < CONTROL_PIPELINE_DEPTH; slot++) {
+		pipeline->tfr[slot] = libusb_alloc_transfer(0);
+		if (pipeline->tfr[slot] == NULL) {
+			perror("Failed to allocate memory for the control transfers");
+			control_pipeline_free(pipeline);
+			return 1;
+		}
+	}
+	dev->pipeline = pipeline;
+
+	for (i = 0; i < seq->count; i += count) {
+		write = &seq->write[i];
+		count = 1;
+		if (write->type == WRITE_WAIT) {
+			control_pipeline_wait(dev, 0);
+			if (write->delay) {
+				usleep(write->delay);
+			}
+			continue;
+		}
+
+		control_pipeline_wait(dev, CONTROL_PIPELINE_DEPTH - 1);
+		slot = pipeline->submitted % CONTROL_PIPELINE_DEPTH;
+		buf = pipeline->buf[slot];
+		if (write->type == WRITE_REG) {
+			somagic_reg_message(buf + LIBUSB_CONTROL_SETUP_SIZE, write->reg, write->val);
+			length = 8;
+		} else {
+			count = seq_burst(write, end, dev->i2c_burst_max, val);
+			length = somagic_i2c_message(buf + LIBUSB_CONTROL_SETUP_SIZE, write->dev_addr, write->reg, val, count);
+		}
+		libusb_fill_control_setup(buf, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x000000b, 0x0000000, length);
+		libusb_fill_control_transfer(pipeline->tfr[slot], dev->devh, buf, control_done, dev, 1000);
+		ret = dev->transport->submit_transfer(dev, pipeline->tfr[slot]);
+		if (ret) {
+			fprintf(stderr, "%s: Failed to submit control transfer: %s\n", program_path, libusb_error_name(ret));
+			ret = 1;
+			break;
+		}
+		pipeline->submitted++;
+		pipeline->in_flight++;
+
+		if (count > 1 && !dev->i2c_burst_ok) {
+			/*
+			 * Until the firmware has accepted a burst, wait for the
+			 * result, so a rejected burst can be written again one
+			 * register at a time before anything that follows it
+			 */
+			control_pipeline_wait(dev, 0);
+			if (!dev->i2c_burst_ok) {
+				count = 0;
+			}
+		}
+	}
+	control_pipeline_wait(dev, 0);
+
+	control_pipeline_free(pipeline);
+	dev->pipeline = NULL;
+	return ret;
+}
+
+/*
+ * Reset the state of the selected sync algorithm, allocating its frame buffer
+ * on first use, so only the algorithm in use costs memory
+ */
+static int decoder_reset(struct somagic_device *dev)
+{
+	unsigned char *frame;
+
+	dev->top_field_queued = 0;
+	switch (dev->sync_algorithm) {
+	case 1:
+		frame = dev->alg1_vs.frame;
+		if (frame == NULL) {
+			frame = malloc(ALG1_FRAME_SIZE);
+			if (frame == NULL) {
+				return 1;
+			}
+		}
+		memset(&dev->alg1_vs, 0, sizeof dev->alg1_vs);
+		memset(frame, 0, ALG1_FRAME_SIZE);
+		dev->alg1_vs.frame = frame;
+		break;
+	case 2:
+		frame = dev->alg2_vs.frame;
+		if (frame == NULL) {
+			frame = malloc(ALG2_FRAME_SIZE);
+			if (frame == NULL) {
+				return 1;
+			}
+		}
+		memset(&dev->alg2_vs, 0, sizeof dev->alg2_vs);
+		memset(frame, 0, ALG2_FRAME_SIZE);
+		dev->alg2_vs.frame = frame;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Start the writer and dump threads that process the iso stream of a device.
+ * Its decoding is started by decode_pool_start(), once all devices are ready.
+ */
+static int start_processing(struct somagic_device *dev)
+{
+	int ret;
+
+	if (decoder_reset(dev)) {
+		perror("Failed to allocate memory for the frame buffer");
+		return 1;
+	}
+	if (ring_init(&dev->video_queue, dev->queue_length, pixel_format_size(pixel_format, dev->lines_per_field * 2))) {
+		perror("Failed to allocate memory for the frame queue");
+		return 1;
+	}
+	ret = pthread_create(&dev->video_writer_thread, NULL, video_writer, dev);
+	if (ret) {
+		fprintf(stderr, "%s: Failed to start writer thread: %s\n", program_path, strerror(ret));
+		return 1;
+	}
+	if (dev->decode_buffers > 0) {
+		if (ring_init(&dev->iso_queue, dev->decode_buffers, sizeof(struct iso_chunk_t))) {
+			perror("Failed to allocate memory for the decode buffers");
+			return 1;
+		}
+	}
+	if (dev->raw_dump_fd != -1 && raw_dump_start(dev)) {
+		return 1;
+	}
+	signal(SIGUSR1, request_stats);
+	return 0;
+}
+
+/* Let the dump and writer threads finish the queued data, after decode_pool_finish() */
+static void finish_processing(struct somagic_device *dev)
+{
+	if (dev->raw_dump_fd != -1) {
+		raw_dump_finish(dev);
+	}
+	if (dev->decode_buffers > 0) {
+		ring_free(&dev->iso_queue);
+		dev->worker = NULL;
+	}
+	ring_close(&dev->video_queue);
+	pthread_join(dev->video_writer_thread, NULL);
+	ring_free(&dev->video_queue);
+	if (print_statistics) {
+		print_stats(dev);
+	}
+}
+
+static int close_output_files(struct somagic_device *dev)
+{
+	int ret;
+
+	/* Close video output file */
+	if (dev->video_fd != 1) {
+		ret = close(dev->video_fd);
+		if (ret) {
+			perror("Failed to close video output file");
+			return 1;
+		}
+	}
+
+	/* Close raw dump files */
+	if (dev->raw_dump_fd != -1) {
+		if (close(dev->raw_dump_fd) || close(dev->raw_index_fd)) {
+			perror("Failed to close raw dump file");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Expand a --vo, --raw-dump or --control filename for a device, replacing %d
+ * by the device number. Returns a string to free, or NULL if out of memory.
+ */
+static char *device_filename(struct somagic_device *dev, const char *template)
+{
+	const char *number = strstr(template, "%d");
+	char *filename;
+
+	filename = malloc(strlen(template) + 16);
+	if (filename == NULL) {
+		return NULL;
+	}
+	if (number == NULL) {
+		strcpy(filename, template);
+	} else {
+		sprintf(filename, "%.*s%d%s", (int)(number - template), template, dev->index, number + 2);
+	}
+	return filename;
+}
+
+static int open_output_files(struct somagic_device *dev)
+{
+	char *filename;
+	int ret = 0;
+
+	if (video_filename != NULL) {
+		filename = device_filename(dev, video_filename);
+		if (filename == NULL) {
+			perror("Failed to allocate memory for the video output filename");
+			return 1;
+		}
+		dev->video_fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (dev->video_fd == -1) {
+			fprintf(stderr, "%s: Failed to open video output file '%s': %s\n", program_path, filename, strerror(errno));
+			ret = 1;
+		}
+		free(filename);
+	}
+	if (raw_dump_filename != NULL && !ret) {
+		filename = device_filename(dev, raw_dump_filename);
+		if (filename == NULL) {
+			perror("Failed to allocate memory for the raw dump filename");
+			return 1;
+		}
+		ret = raw_dump_open(dev, filename);
+		free(filename);
+	}
+	return ret;
+}
+
+/* Page aligned iso buffer area of a finished capture, kept for the next one (see iso_buffers_alloc()) */
+static struct {
+	void *area;
+	size_t size;
+	int type;
+} iso_buffers_spare;
+
+/*
+ * Allocate the iso buffers of a device. Device memory is mapped from usbfs,
+ * so the host controller fills it directly instead of the kernel copying
+ * every packet into the transfer buffer; with decode buffers, gotdata() still
+ * copies the packets into the decode queue. Failing that, or if not asked for,
+ * the buffers are page aligned, on huge pages if asked for (explicit ones,
+ * else transparent ones), and reuse the area of the last capture if it has
+ * the same size and type, as when a device is captured from again with
+ * --hotplug.
+ */
+static int iso_buffers_alloc(struct somagic_device *dev)
+{
+	size_t size = dev->num_iso_transfers * sizeof *dev->isobuf;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int type = dev->iso_memory;
+	void *area = NULL;
+
+	if (type == ISO_MEMORY_DEVICE) {
+		area = dev->transport->dev_mem_alloc(dev, size);
+		if (area != NULL) {
+			dev->isobuf = area;
+			dev->isobuf_type = ISO_MEMORY_DEVICE;
+			dev->isobuf_size = size;
+			return 0;
+		}
+		type = ISO_MEMORY_PAGES;
+	}
+	if (type == ISO_MEMORY_HUGEPAGES) {
+		page = HUGE_PAGE_SIZE;
+	}
+	size = (size + page - 1) / page * page;
+
+	if (iso_buffers_spare.area != NULL && iso_buffers_spare.size == size && iso_buffers_spare.type == type) {
+		area = iso_buffers_spare.area;
+		iso_buffers_spare.area = NULL;
+	} else {
+		if (iso_buffers_spare.area != NULL) {
+			munmap(iso_buffers_spare.area, iso_buffers_spare.size);
+			iso_buffers_spare.area = NULL;
+		}
+		if (type == ISO_MEMORY_HUGEPAGES) {
+			area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (area == MAP_FAILED) {
+				area = NULL;
+			}
+		}
+		if (area == NULL) {
+			area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (area == MAP_FAILED) {
+				perror("Failed to allocate memory for isobuf");
+				return 1;
+			}
+			if (type == ISO_MEMORY_HUGEPAGES) {
+				madvise(area, size, MADV_HUGEPAGE);
+				type = ISO_MEMORY_PAGES;
+			}
+		}
+	}
+	dev->isobuf = area;
+	dev->isobuf_type = type;
+	dev->isobuf_size = size;
+	return 0;
+}
+
+/* Free the iso buffers of a device, or keep them for the next capture */
+static void iso_buffers_free(struct somagic_device *dev)
+{
+	if (dev->isobuf == NULL) {
+		return;
+	}
+	if (dev->isobuf_type == ISO_MEMORY_DEVICE) {
+		dev->transport->dev_mem_free(dev, (unsigned char *)dev->isobuf, dev->isobuf_size);
+	} else if (iso_buffers_spare.area == NULL) {
+		iso_buffers_spare.area = dev->isobuf;
+		iso_buffers_spare.size = dev->isobuf_size;
+		iso_buffers_spare.type = dev->isobuf_type;
+	} else {
+		munmap(dev->isobuf, dev->isobuf_size);
+	}
+	dev->isobuf = NULL;
+}
+
+/* Allocate the iso transfers of a device and start its processing */
+static int capture_start(struct somagic_device *dev)
+{
+	int i;
+
+	/* With autotuning, --iso-transfers is where the depth starts */
+	dev->iso_depth = dev->num_iso_transfers;
+	if (dev->autotune != AUTOTUNE_OFF) {
+		dev->num_iso_transfers = MAX(dev->num_iso_transfers, AUTOTUNE_TRANSFERS);
+		dev->cover_us = (uint64_t)dev->iso_depth * dev->iso_packets * MICROFRAME_US;
+	}
+
+	dev->tfr = calloc(dev->num_iso_transfers, sizeof *dev->tfr);
+	if (dev->tfr == NULL) {
+		perror("Failed to allocate memory for tfr");
+		return 1;
+	}
+	dev->idle = calloc(dev->num_iso_transfers, sizeof *dev->idle);
+	if (dev->idle == NULL) {
+		perror("Failed to allocate memory for the idle transfers");
+		return 1;
+	}
+	if (iso_buffers_alloc(dev)) {
+		return 1;
+	}
+	/* Keep page faults out of the event thread (not fatal: RLIMIT_MEMLOCK may be low); device memory is pinned anyway */
+	if (event_thread && dev->isobuf_type != ISO_MEMORY_DEVICE && mlock(dev->isobuf, dev->isobuf_size)) {
+		fprintf(stderr, "%sFailed to lock the iso buffers in memory: %s\n", device_prefix(dev), strerror(errno));
+	}
+
+	if (start_processing(dev)) {
+		return 1;
+	}
+
+	for (i = 0; i < dev->num_iso_transfers; i++)	{
+		dev->tfr[i] = libusb_alloc_transfer(ISO_PACKETS);
+		if (dev->tfr[i] == NULL) {
+			fprintf(stderr, "%s: Failed to allocate USB transfer #%d: %s\n", program_path, i, strerror(errno));
+			return 1;
+		}
+		libusb_fill_iso_transfer(dev->tfr[i], dev->devh, 0x00000082, dev->isobuf[i], dev->iso_packets * ISO_PACKET_SIZE, dev->iso_packets, gotdata, dev, 2000);
+		libusb_set_iso_packet_lengths(dev->tfr[i], ISO_PACKET_SIZE);
+	}
+	return 0;
+}
+
+/* Submit idle transfers until iso_depth are in flight */
+static int capture_fill(struct somagic_device *dev)
+{
+	struct libusb_transfer *tfr;
+	int ret;
+
+	while (dev->pending_requests < dev->iso_depth && dev->idle_count > 0) {
+		tfr = dev->idle[--dev->idle_count];
+		ret = capture_submit_transfer(dev, tfr);
+		if (ret) {
+			dev->idle[dev->idle_count++] = tfr;
+			fprintf(stderr, "%s: Failed to submit transfer to %s: %s\n", program_path, dev->name, libusb_error_name(ret));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Submit the transfers of a device, none of which is in flight, and start streaming */
+static int capture_submit(struct somagic_device *dev)
+{
+	int i;
+
+	dev->pending_requests = 0;
+	dev->idle_count = 0;
+	for (i = dev->num_iso_transfers - 1; i >= 0; i--) {
+		dev->idle[dev->idle_count++] = dev->tfr[i];
+	}
+	if (capture_fill(dev)) {
+		return 1;
+	}
+
+	somagic_write_reg(dev, 0x1800, 0x0d);
+	dev->watchdog_time = timestamp_us();
+	dev->autotune_start = dev->watchdog_time;
+	return 0;
+}
+
+/*
+ * Restart the stream of a device that stopped delivering video: let its
+ * transfers complete, switch the interface to alternate setting 0 and back
+ * to 2, and submit the transfers again, which also sends the start write.
+ * The decoder and the video output carry on as they were.
+ */
+static int capture_restart(struct somagic_device *dev)
+{
+	int ret;
+	int i;
+
+	dev->restarting = 1;
+	for (i = 0; i < dev->num_iso_transfers; i++) {
+		dev->transport->cancel_transfer(dev, dev->tfr[i]);
+	}
+	while (dev->pending_requests > 0) {
+		dev->transport->handle_events();
+	}
+	dev->restarting = 0;
+
+	ret = dev->transport->set_interface_alt_setting(dev, 0, 0);
+	if (ret == 0) {
+		ret = dev->transport->set_interface_alt_setting(dev, 0, 2);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Failed to set alternate setting of %s: %s\n", program_path, dev->name, libusb_error_name(ret));
+		return 1;
+	}
+	return capture_submit(dev);
+}
+
+/*
+ * Once per AUTOTUNE_INTERVAL_US, choose the transfers in flight and their
+ * packets from what the callbacks measured (see autotune_measure()). The
+ * time the transfers in flight cover is kept at AUTOTUNE_MARGIN times the
+ * worst gap between callbacks, doubled when more packets were lost than the
+ * budget allows and eased down by an eighth otherwise. For the latency goal
+ * that time is split into the smallest transfers the allocated ones can
+ * cover it with, for the CPU goal into transfers of ISO_PACKETS packets,
+ * which take the fewest callbacks.
+ */
+static void autotune(struct somagic_device *dev)
+{
+	uint64_t now = timestamp_us();
+	uint64_t elapsed = now - dev->autotune_start;
+	uint64_t cover_min;
+	uint64_t cover_max;
+	int packets;
+	int depth;
+
+	if (elapsed < AUTOTUNE_INTERVAL_US || dev->callbacks == 0) {
+		return;
+	}
+
+	cover_min = MAX(AUTOTUNE_MARGIN * dev->max_callback_gap, AUTOTUNE_MIN_COVER_US);
+	cover_max = (uint64_t)dev->num_iso_transfers * ISO_PACKETS * MICROFRAME_US;
+	if ((uint64_t)dev->packets_lost * AUTOTUNE_LOSS_BUDGET > (uint64_t)dev->packets_seen) {
+		dev->cover_us *= 2;
+	} else {
+		dev->cover_us -= dev->cover_us / 8;
+	}
+	dev->cover_us = MIN(MAX(dev->cover_us, cover_min), cover_max);
+
+	packets = ISO_PACKETS;
+	if (dev->autotune == AUTOTUNE_LATENCY) {
+		for (packets = AUTOTUNE_MIN_PACKETS; packets < ISO_PACKETS && (uint64_t)dev->num_iso_transfers * packets * MICROFRAME_US < dev->cover_us; packets *= 2);
+	}
+	depth = (dev->cover_us + packets * MICROFRAME_US - 1) / (packets * MICROFRAME_US);
+	depth = MIN(MAX(depth, 2), dev->num_iso_transfers);
+
+	if (depth != dev->iso_depth || packets != dev->iso_packets) {
+		dev->autotune_changes++;
+		if (print_statistics) {
+			fprintf(stderr, "%sAutotune: %d transfers of %d packets (worst callback gap %.1f ms, %d callbacks/s, %d of %d packets lost)\n", device_prefix(dev), depth, packets, dev->max_callback_gap / 1000.0, (int)(dev->callbacks * 1000000ULL / elapsed), dev->packets_lost, dev->packets_seen);
+		}
+		dev->iso_depth = depth;
+		dev->iso_packets = packets;
+		capture_fill(dev);
+	}
+
+	dev->autotune_start = now;
+	dev->max_callback_gap = 0;
+	dev->callbacks = 0;
+	dev->packets_seen = 0;
+	dev->packets_lost = 0;
+}
+
+/*
+ * Restart the stream (see capture_restart()) if no field has been decoded
+ * for watchdog_timeout ms, or WATCHDOG_TRANSFER_ERRORS transfers failed in a
+ * row. A restart that does not help is tried again after another
+ * watchdog_timeout ms. The time from the detection to the next field is the
+ * recovery time.
+ */
+static void capture_watchdog(struct somagic_device *dev)
+{
+	const char *prefix = device_prefix(dev);
+	int fields = atomic_load(&dev->fields_decoded);
+	uint64_t now = timestamp_us();
+	uint64_t elapsed;
+
+	if (fields != dev->watchdog_fields) {
+		dev->watchdog_fields = fields;
+		dev->watchdog_time = now;
+		if (dev->stall_time) {
+			dev->recovery_time_last = now - dev->stall_time;
+			dev->recovery_time_total += dev->recovery_time_last;
+			dev->stream_recoveries++;
+			dev->stall_time = 0;
+			fprintf(stderr, "%sStream recovered in %.3f s\n", prefix, dev->recovery_time_last / 1000000.0);
+		}
+		return;
+	}
+	if (dev->stop_sending_requests) {
+		return;
+	}
+	elapsed = now - dev->watchdog_time;
+	if (elapsed < (uint64_t)watchdog_timeout * 1000 && dev->transfer_error_run < WATCHDOG_TRANSFER_ERRORS) {
+		return;
+	}
+
+	if (dev->transfer_error_run >= WATCHDOG_TRANSFER_ERRORS) {
+		fprintf(stderr, "%s%d transfers failed in a row, restarting the stream\n", prefix, dev->transfer_error_run);
+	} else {
+		fprintf(stderr, "%sNo video for %d ms, restarting the stream\n", prefix, (int)(elapsed / 1000));
+	}
+	if (!dev->stall_time) {
+		dev->stall_time = now;
+	}
+	dev->stream_restarts++;
+	dev->transfer_error_run = 0;
+	if (capture_restart(dev)) {
+		fprintf(stderr, "%sFailed to restart the stream\n", prefix);
+	}
+	dev->watchdog_time = timestamp_us();
+}
+
+static void capture_free(struct somagic_device *dev)
+{
+	int i;
+
+	if (dev->tfr != NULL) {
+		for (i = 0; i < dev->num_iso_transfers; i++) {
+			libusb_free_transfer(dev->tfr[i]);
+		}
+	}
+	free(dev->tfr);
+	if (event_thread && dev->isobuf != NULL && dev->isobuf_type != ISO_MEMORY_DEVICE) {
+		munlock(dev->isobuf, dev->isobuf_size);
+	}
+	iso_buffers_free(dev);
+	free(dev->idle);
+	dev->tfr = NULL;
+	dev->idle = NULL;
+}
+
+static int capture_pending()
+{
+	struct somagic_device *dev;
+
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (dev->pending_requests > 0) {
+			return 1;
+		}
+		/* Transfers that failed to resubmit are submitted again by capture_watchdog() */
+		if (watchdog_timeout && !dev->stop_sending_requests) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Open a raw dump (see --raw-dump) for reading, and check its file header */
+static FILE *raw_dump_read_open(const char *filename)
+{
+	FILE *file;
+	struct raw_file_header header;
+
+	file = fopen(filename, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "%s: Failed to open raw dump file '%s': %s\n", program_path, filename, strerror(errno));
+		return NULL;
+	}
+	setvbuf(file, NULL, _IOFBF, 1024 * 1024);
+	if (fread(&header, sizeof header, 1, file) != 1 || memcmp(header.magic, RAW_DUMP_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: '%s' is not a raw dump file\n", program_path, filename);
+		fclose(file);
+		return NULL;
+	}
+	if (header.version != RAW_DUMP_VERSION || header.packet_size != ISO_PACKET_SIZE) {
+		fprintf(stderr, "%s: Unsupported raw dump version %u, packet size %u\n", program_path, header.version, header.packet_size);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+/*
+ * Read the next transfer of a raw dump into tfr, which must have room for
+ * ISO_PACKETS packets of ISO_PACKET_SIZE bytes. Returns 1 if a transfer was
+ * read, 0 at the end of the file, or -1 if the file is corrupt or unreadable.
+ */
+static int raw_dump_read_transfer(FILE *file, struct libusb_transfer *tfr)
+{
+	struct raw_transfer_header header;
+	struct raw_packet_header packet[ISO_PACKETS];
+	int i;
+
+	if (fread(&header, sizeof header, 1, file) != 1) {
+		if (ferror(file)) {
+			fprintf(stderr, "%s: Failed to read raw dump file: %s\n", program_path, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	if (header.num_packets > ISO_PACKETS || fread(packet, sizeof *packet, header.num_packets, file) != header.num_packets) {
+		fprintf(stderr, "%s: Corrupt transfer %u in raw dump file\n", program_path, header.sequence);
+		return -1;
+	}
+	for (i = 0; i < (int)header.num_packets; i++) {
+		if (packet[i].actual_length > ISO_PACKET_SIZE || fread(tfr->buffer + i * ISO_PACKET_SIZE, 1, packet[i].actual_length, file) != packet[i].actual_length) {
+			fprintf(stderr, "%s: Corrupt transfer %u in raw dump file\n", program_path, header.sequence);
+			return -1;
+		}
+		tfr->iso_packet_desc[i].length = ISO_PACKET_SIZE;
+		tfr->iso_packet_desc[i].status = packet[i].status;
+		tfr->iso_packet_desc[i].actual_length = packet[i].actual_length;
+	}
+	tfr->status = header.status;
+	tfr->num_iso_packets = header.num_packets;
+	return 1;
+}
+
+/*
+ * Feed the transfers of a raw dump (see --raw-dump) through gotdata(), as if
+ * they had just been received from the device.
+ */
+static int somagic_replay(struct somagic_device *dev)
+{
+	FILE *file;
+	struct libusb_transfer *tfr;
+	unsigned char *isobuf;
+	uint64_t start;
+	uint64_t now;
+	uint64_t target;
+	uint64_t bytes = 0;
+	double field_period;
+	double elapsed;
+	int ret = 0;
+	int i;
+
+	if (dev->tv_standard == PAL || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM) {
+		dev->lines_per_field = 288;
+		field_period = 1000000.0 / 50;
+	} else {
+		dev->lines_per_field = 240;
+		field_period = 1000000.0 * 1001 / 60000;
+	}
+
+	file = raw_dump_read_open(replay_filename);
+	if (file == NULL) {
+		return 1;
+	}
+
+	tfr = libusb_alloc_transfer(ISO_PACKETS);
+	isobuf = malloc(ISO_PACKETS * ISO_PACKET_SIZE);
+	if (tfr == NULL || isobuf == NULL) {
+		perror("Failed to allocate memory for the replay transfer");
+		return 1;
+	}
+	libusb_fill_iso_transfer(tfr, NULL, 0x00000082, isobuf, ISO_PACKETS * ISO_PACKET_SIZE, ISO_PACKETS, gotdata, dev, 0);
+
+	if (start_processing(dev) || decode_pool_start()) {
+		return 1;
+	}
+
+	start = timestamp_us();
+	while (!dev->stop_sending_requests && (ret = raw_dump_read_transfer(file, tfr)) > 0) {
+		for (i = 0; i < tfr->num_iso_packets; i++) {
+			bytes += tfr->iso_packet_desc[i].actual_length;
+		}
+
+		dev->pending_requests++;
+		gotdata(tfr);
+
+		if (replay_pace == REPLAY_REALTIME) {
+			/* Do not let decoding run ahead of the field rate */
+			target = start + (uint64_t)(dev->fields_decoded * field_period);
+			now = timestamp_us();
+			if (now < target) {
+				usleep(target - now);
+			}
+		}
+		if (statistics_requested) {
+			statistics_requested = 0;
+			print_stats(dev);
+		}
+	}
+
+	decode_pool_finish();
+	finish_processing(dev);
+	elapsed = (timestamp_us() - start) / 1000000.0;
+	if (replay_pace == REPLAY_FAST && elapsed > 0) {
+		fprintf(stderr, "Replayed %.1f MB in %.3f s: %.1f MB/s, %.1f frames/s\n", bytes / 1000000.0, elapsed, bytes / 1000000.0 / elapsed, dev->frames_generated / elapsed);
+	}
+
+	fclose(file);
+	free(isobuf);
+	libusb_free_transfer(tfr);
+	if (close_output_files(dev)) {
+		return 1;
+	}
+	return ret < 0;
+}
+
+/*
+ * Decoder benchmark (see --benchmark). The iso block demux and both sync
+ * algorithms are run over PAL and NTSC streams from the simulated device,
+ * clean and damaged, and over the raw dump given with --replay, if any.
+ * Frames are written to /dev/null through the frame queue as usual.
+ * The pixel format conversions are then timed on their own, on PAL frames,
+ * with each set of kernels the CPU supports, and checked against the scalar
+ * ones; realtime is the number of PAL streams one such conversion keeps up with.
+ */
+#define BENCH_FRAMES 25
+#define BENCH_PASSES 4
+#define BENCH_CONVERT_FRAMES 200
+
+enum bench_damage {
+	BENCH_CLEAN,
+	BENCH_SYNC_LOSS,  /* Bursts of noise in the video data, hitting timing reference codes now and then */
+	BENCH_TRUNCATED   /* Packets cut short, losing the rest of their blocks */
+};
+
+struct bench_stream_t {
+	unsigned char *data;  /* packets, ISO_PACKET_SIZE bytes apart */
+	int *length;          /* actual length of each packet */
+	int packets;
+	int size;
+};
+
+static uint32_t bench_random_state = 1;
+
+static uint32_t bench_random()
+{
+	bench_random_state = bench_random_state * 1103515245 + 12345;
+	return bench_random_state >> 8;
+}
+
+/* Append a packet to the stream, returning its buffer */
+static unsigned char *bench_add_packet(struct bench_stream_t *stream)
+{
+	unsigned char *data;
+	int *length;
+
+	if (stream->packets == stream->size) {
+		data = realloc(stream->data, (size_t)(stream->size + 1024) * ISO_PACKET_SIZE);
+		if (data == NULL) {
+			return NULL;
+		}
+		stream->data = data;
+		length = realloc(stream->length, (stream->size + 1024) * sizeof *length);
+		if (length == NULL) {
+			return NULL;
+		}
+		stream->length = length;
+		stream->size += 1024;
+	}
+	stream->length[stream->packets] = ISO_PACKET_SIZE;
+	return stream->data + (size_t)stream->packets++ * ISO_PACKET_SIZE;
+}
+
+static int bench_generate(struct bench_stream_t *stream, int lines, int damage)
+{
+	struct sim_device_t *sim;
+	unsigned char *packet;
+	int offset;
+	int count;
+	int i;
+	int j;
+
+	sim = calloc(1, sizeof *sim);
+	if (sim == NULL) {
+		return 1;
+	}
+	sim->saa7113[0x0a] = 128;
+	sim->saa7113[0x5a] = (lines == 288) ? 0x07 : 0x0a;
+
+	stream->packets = 0;
+	while (sim->frame < BENCH_FRAMES) {
+		packet = bench_add_packet(stream);
+		if (packet == NULL) {
+			free(sim);
+			return 1;
+		}
+		for (i = 0; i < ISO_PACKET_SIZE; i += 0x400) {
+			sim_fill_block(sim, packet + i);
+			if (damage == BENCH_SYNC_LOSS && bench_random() % 16 == 0) {
+				offset = 4 + bench_random() % (0x400 - 4);
+				count = MIN(16 + (int)(bench_random() % 241), 0x400 - offset);
+				for (j = 0; j < count; j++) {
+					switch (bench_random() % 4) {
+					case 0:
+						packet[i + offset + j] = 0xff;
+						break;
+					case 1:
+						packet[i + offset + j] = 0x00;
+						break;
+					default:
+						packet[i + offset + j] = bench_random();
+					}
+				}
+			}
+		}
+		if (damage == BENCH_TRUNCATED && bench_random() % 8 == 0) {
+			stream->length[stream->packets - 1] = (bench_random() % 3) * 0x400;
+		}
+	}
+	free(sim);
+	return 0;
+}
+
+static int bench_load(struct bench_stream_t *stream, const char *filename)
+{
+	FILE *file;
+	struct libusb_transfer *tfr;
+	unsigned char *isobuf;
+	unsigned char *packet;
+	int ret;
+	int i;
+
+	file = raw_dump_read_open(filename);
+	if (file == NULL) {
+		return 1;
+	}
+	tfr = libusb_alloc_transfer(ISO_PACKETS);
+	isobuf = malloc(ISO_PACKETS * ISO_PACKET_SIZE);
+	if (tfr == NULL || isobuf == NULL) {
+		perror("Failed to allocate memory for reading the raw dump");
+		return 1;
+	}
+	libusb_fill_iso_transfer(tfr, NULL, 0x00000082, isobuf, ISO_PACKETS * ISO_PACKET_SIZE, ISO_PACKETS, NULL, NULL, 0);
+
+	stream->packets = 0;
+	while ((ret = raw_dump_read_transfer(file, tfr)) > 0) {
+		for (i = 0; i < tfr->num_iso_packets; i++) {
+			packet = bench_add_packet(stream);
+			if (packet == NULL) {
+				perror("Failed to allocate memory for the raw dump");
+				ret = -1;
+				break;
+			}
+			stream->length[stream->packets - 1] = tfr->iso_packet_desc[i].actual_length;
+			memcpy(packet, isobuf + i * ISO_PACKET_SIZE, tfr->iso_packet_desc[i].actual_length);
+		}
+	}
+	fclose(file);
+	free(isobuf);
+	libusb_free_transfer(tfr);
+	return ret < 0;
+}
+
+/* Heap in use, to catch allocations in the decode path: -1 if unknown */
+static long bench_heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+
+	return info.uordblks + info.hblkhd;
+#else
+	return -1;
+#endif
+}
+
+static int bench_run(struct somagic_device *dev, const char *name, struct bench_stream_t *stream, int algorithm)
+{
+	uint64_t start;
+	uint64_t bytes = 0;
+	double elapsed;
+	long heap;
+	int pass;
+	int i;
+
+	dev->sync_algorithm = algorithm;
+	if (decoder_reset(dev)) {
+		perror("Failed to allocate memory for the frame buffer");
+		return 1;
+	}
+	dev->frames_generated = 0;
+
+	heap = bench_heap_in_use();
+	start = timestamp_us();
+	for (pass = 0; pass < BENCH_PASSES; pass++) {
+		for (i = 0; i < stream->packets; i++) {
+			process_packet(dev, stream->data + (size_t)i * ISO_PACKET_SIZE, stream->length[i]);
+			bytes += stream->length[i];
+		}
+	}
+	elapsed = (timestamp_us() - start) / 1000000.0;
+	if (heap != -1) {
+		heap = bench_heap_in_use() - heap;
+	}
+
+	printf("case=%s sync=%d bytes=%llu seconds=%.6f ns_per_byte=%.3f frames=%d frames_per_s=%.1f heap_growth=%ld\n",
+		name, algorithm, (unsigned long long)bytes, elapsed, elapsed * 1e9 / MAX(bytes, 1), dev->frames_generated, dev->frames_generated / MAX(elapsed, 1e-9), heap);
+	fflush(stdout);
+	return 0;
+}
+
+static int bench_convert()
+{
+	const struct convert_kernels_t *kernels[CONVERT_KERNELS_MAX];
+	const int height = 576;
+	unsigned char *src;
+	unsigned char *ref;
+	unsigned char *dst;
+	uint64_t start;
+	double elapsed;
+	double scalar_elapsed = 0;
+	size_t size;
+	int count;
+	int format;
+	int banded;
+	int k;
+	int i;
+
+	src = malloc(720 * 2 * height);
+	ref = malloc(720 * 4 * height);
+	dst = malloc(720 * 4 * height);
+	if (src == NULL || ref == NULL || dst == NULL) {
+		perror("Failed to allocate memory for the conversion benchmark");
+		return 1;
+	}
+	for (i = 0; i < 720 * 2 * height; i++) {
+		src[i] = bench_random();
+	}
+
+	/* Each supported set of kernels on one thread, then the selected one in bands (see --convert-threads) */
+	count = convert_kernels_supported(kernels);
+	for (format = PIXEL_YUYV; format <= PIXEL_BGRA; format++) {
+		size = convert_frame(kernels[0], format, ref, src, height);
+		for (k = 0; k < count + (convert_band_count > 0); k++) {
+			banded = k == count;
+			memset(dst, 0, size);
+			start = timestamp_us();
+			for (i = 0; i < BENCH_CONVERT_FRAMES; i++) {
+				if (banded) {
+					convert_frame_banded(format, dst, src, height, 0);
+				} else {
+					convert_frame(kernels[k], format, dst, src, height);
+				}
+			}
+			elapsed = (timestamp_us() - start) / 1000000.0;
+			if (k == 0) {
+				scalar_elapsed = elapsed;
+			}
+			printf("case=convert-%s kernels=%s threads=%d frames=%d seconds=%.6f ns_per_pixel=%.3f frames_per_s=%.1f realtime=%.1f speedup=%.2f match=%s\n",
+				pixel_format_names[format], banded ? convert_kernels->name : kernels[k]->name, banded ? convert_band_count + 1 : 1, BENCH_CONVERT_FRAMES,
+				elapsed, elapsed * 1e9 / ((double)BENCH_CONVERT_FRAMES * 720 * height), BENCH_CONVERT_FRAMES / MAX(elapsed, 1e-9),
+				BENCH_CONVERT_FRAMES / MAX(elapsed, 1e-9) / 25, scalar_elapsed / MAX(elapsed, 1e-9), memcmp(dst, ref, size) ? "no" : "yes");
+			fflush(stdout);
+		}
+	}
+
+	free(src);
+	free(ref);
+	free(dst);
+	return 0;
+}
+
+static int somagic_benchmark(struct somagic_device *dev)
+{
+	static const char *damage_name[] = { "clean", "sync-loss", "truncated" };
+	struct bench_stream_t stream = { NULL, NULL, 0, 0 };
+	char name[64];
+	int replay_lines;
+	int standard;
+	int damage;
+	int algorithm;
+
+	replay_lines = (dev->tv_standard == PAL || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM) ? 288 : 240;
+
+	if (dev->video_fd == 1) {
+		dev->video_fd = open("/dev/null", O_WRONLY);
+		if (dev->video_fd == -1) {
+			perror("Failed to open /dev/null");
+			return 1;
+		}
+	}
+	dev->decode_buffers = 0;
+	dev->frame_count = -1;
+	dev->lines_per_field = 288;
+	if (start_processing(dev)) {
+		return 1;
+	}
+
+	for (standard = 0; standard < 2; standard++) {
+		dev->tv_standard = standard ? NTSC : PAL;
+		dev->lines_per_field = standard ? 240 : 288;
+		for (damage = BENCH_CLEAN; damage <= BENCH_TRUNCATED; damage++) {
+			if (bench_generate(&stream, dev->lines_per_field, damage)) {
+				perror("Failed to allocate memory for the benchmark stream");
+				return 1;
+			}
+			sprintf(name, "%s-%s", standard ? "ntsc" : "pal", damage_name[damage]);
+			for (algorithm = 1; algorithm <= 2; algorithm++) {
+				if (bench_run(dev, name, &stream, algorithm)) {
+					return 1;
+				}
+			}
+		}
+	}
+
+	/* alg2 one byte at a time against the TRC scan and span copies, on the clean PAL stream */
+	dev->tv_standard = PAL;
+	dev->lines_per_field = 288;
+	if (bench_generate(&stream, dev->lines_per_field, BENCH_CLEAN)) {
+		perror("Failed to allocate memory for the benchmark stream");
+		return 1;
+	}
+	alg2_per_byte = 1;
+	if (bench_run(dev, "alg2-per-byte", &stream, 2)) {
+		return 1;
+	}
+	alg2_per_byte = 0;
+	if (bench_run(dev, "alg2-span", &stream, 2)) {
+		return 1;
+	}
+
+	if (replay_filename != NULL) {
+		dev->tv_standard = (replay_lines == 288) ? PAL : NTSC;
+		dev->lines_per_field = replay_lines;
+		if (bench_load(&stream, replay_filename)) {
+			return 1;
+		}
+		for (algorithm = 1; algorithm <= 2; algorithm++) {
+			if (bench_run(dev, "replay", &stream, algorithm)) {
+				return 1;
+			}
+		}
+	}
+
+	finish_processing(dev);
+	free(stream.data);
+	free(stream.length);
+	if (bench_convert()) {
+		return 1;
+	}
+	return close_output_files(dev);
+}
+
+/* Build the writes of the SAA7113 registers for the selected input, picture controls and TV standard */
+static void somagic_decoder_sequence(struct somagic_device *dev, struct write_sequence *seq)
+{
+	uint8_t work;
+	int i;
+
+	/* Subaddress 0x01, Horizontal Increment delay */
+	/* Recommended position */
+	seq_i2c(seq, 0x4a, 0x01, 0x08);
+
+	/* Subaddress 0x02, Analog input control 1 */
+	/* Analog function select FUSE = Amplifier plus anti-alias filter bypassed */
+	/* Update hysteresis for 9-bit gain = Off */
+	if (dev->input_type == CVBS) {
+		work = 0xc0 | dev->cvbs_input;
+	} else {
+		work = 0xc0 | dev->input_type;
+	}
+	seq_i2c(seq, 0x4a, 0x02, work);
+
+	/* Subaddress 0x03, Analog input control 2 */
+	if (dev->input_type != SVIDEO) {
+		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
+		/* Static gain control channel 2 (GAI28), sign bit of gain control = 1 */
+		/* Gain control fix (GAFIX) = Automatic gain controlled by MODE3 to MODE0 */
+		/* Automatic gain control integration (HOLDG) = AGC active */
+		/* White peak off (WPOFF) = White peak off */
+		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
+		/* Normal clamping if decoder is in unlocked state */
+		seq_i2c(seq, 0x4a, 0x03, 0x33);
+	} else {
+		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
+		/* Static gain control channel 2 (GAI28), sign bit of gain control = 0 */
+		/* Gain control fix (GAFIX) = Automatic gain controlled by MODE3 to MODE0 */
+		/* Automatic gain control integration (HOLDG) = AGC active */
+		/* White peak off (WPOFF) = White peak off */
+		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
+		/* Normal clamping if decoder is in unlocked state */
+		seq_i2c(seq, 0x4a, 0x03, 0x31);
+	}
+
+	/* Subaddress 0x04, Gain control analog/Analog input control 3 (AICO3); static gain control channel 1 GAI1 */
+	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI18 value) */
+	seq_i2c(seq, 0x4a, 0x04, 0x00);
+
+	/* Subaddress 0x05, Gain control analog/Analog input control 4 (AICO4); static gain control channel 2 GAI2 */
+	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI28 value) */
+	seq_i2c(seq, 0x4a, 0x05, 0x00);
+
+	/* Subaddress 0x06, Horizontal sync start/begin */
+	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
+	seq_i2c(seq, 0x4a, 0x06, 0xe9);
+
+	/* Subaddress 0x07, Horizontal sync stop */
+	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
+	seq_i2c(seq, 0x4a, 0x07, 0x0d);
+
+	/* Subaddress 0x08, Sync control */
+	/* Automatic field detection (AUFD) = Automatic field detection */
+	/* Field selection (FSEL) = 50 Hz, 625 lines (Note: Ignored due to automatic field detection) */
+	/* Forced ODD/EVEN toggle FOET = ODD/EVEN signal toggles only with interlaced source */
+	/* Horizontal time constant selection = Fast locking mode (recommended setting) */
+	/* Horizontal PLL (HPLL) = PLL closed */
+	/* Vertical noise reduction (VNOI) = Normal mode (recommended setting) */
+	seq_i2c(seq, 0x4a, 0x08, 0x98);
+
+	/* Subaddress 0x09, Luminance control */
+	/* Update time interval for analog AGC value (UPTCV) = Horizontal update (once per line) */
+	/* Vertical blanking luminance bypass (VBLB) = Active luminance processing */
+	/* Chrominance trap bypass (BYPS) = Chrominance trap active; default for CVBS mode */
+	work = ((dev->luminance_prefilter & 0x01) << 6) | ((dev->luminance_mode & 0x03) << 4) | (dev->luminance_aperture & 0x03);
+	if (dev->input_type == SVIDEO) {
+		/* Chrominance trap bypass (BYPS) = Chrominance trap bypassed; default for S-video mode */
+		work |= 0x80;
+	}
+	seq_i2c(seq, 0x4a, 0x09, work);
+
+	/* Subaddress 0x0a, Luminance brightness control */
+	/* Offset = 128 (ITU level) */
+	seq_i2c(seq, 0x4a, 0x0a, dev->brightness);
+
+	/* Subaddress 0x0b, Luminance contrast control */
+	/* Gain = 1.0 */
+	seq_i2c(seq, 0x4a, 0x0b, dev->contrast);
+
+	/* Subaddress 0x0c, Chrominance saturation control */
+	seq_i2c(seq, 0x4a, 0x0c, dev->saturation);
+
+	/* Subaddress 0x0d, Chrominance hue control */
+	seq_i2c(seq, 0x4a, 0x0d, dev->hue);
+
+	/* Subaddress 0x0e, Chrominance control */
+	/* Chrominance bandwidth (CHBW0 and CHBW1) = Nominal bandwidth (800 kHz) */
+	/* Fast color time constant (FCTC) = Nominal time constant */
+	/* Disable chrominance comb filter (DCCF) = Chrominance comb filter on (during lines determined by VREF = 1) */
+	/* Clear DTO (CDTO) = Disabled */
+	switch (dev->tv_standard) {
+	case PAL:
+	case NTSC:
+		work = 0x01;
+		break;
+	case NTSC_50:
+	case PAL_60:
+		work = 0x11;
+		break;
+	case PAL_COMBO_N:
+	case NTSC_60:
+		work = 0x21;
+		break;
+	case NTSC_N:
+	case PAL_M:
+		work = 0x31;
+		break;
+	case SECAM:
+		work = 0x50;
+		break;
+	}
+	seq_i2c(seq, 0x4a, 0x0e, work);
+
+	/* Subaddress 0x0f, Chrominance gain control */
+	/* Chrominance gain value = ??? (Note: only meaningful if ACGF is off) */
+	/* Automatic chrominance gain control ACGC = On */
+	seq_i2c(seq, 0x4a, 0x0f, 0x2a);
+
+	/* Subaddress 0x10, Format/delay control */
+	/* Output format selection (OFTS0 and OFTS1), V-flag generation in SAV/EAV-codes = V-flag in SAV/EAV is generated by VREF */
+	/* Fine position of HS (HDEL0 and HDEL1) (steps in 2/LLC) = 0 */
+	/* VREF pulse position and length (VRLN) = see Table 46 in SAA7113H documentation */
+	/* Luminance delay compensation (steps in 2/LLC) = 0 */
+	seq_i2c(seq, 0x4a, 0x10, 0x40);
+
+	/* Subaddress 0x11, Output control 1 */
+	/* General purpose switch [available on pin RTS1, if control bits RTSE13 to RTSE10 (subaddress 0x12) is set to 0010] = LOW */
+	/* CM99 compatibility to SAA7199 (CM99) = Default value */
+	/* General purpose switch [available on pin RTS0, if control bits RTSE03 to RTSE00 (subaddress 0x12) is set to 0010] = LOW */
+	/* Selection of horizontal lock indicator for RTS0 and RTS1 outputs = Standard horizontal lock indicator (low-passed) */
+	/* Output enable YUV data (OEYC) = Output VPO-bus active or controlled by RTS1 */
+	/* Output enable real-time (OERT) = RTS0, RTCO active, RTS1 active, if RTSE13 to RTSE10 = 0000 */
+	/* YUV decoder bypassed (VIPB) = Processed data to VPO output */
+	/* Color on (COLO) = Automatic color killer */
+	seq_i2c(seq, 0x4a, 0x11, 0x0c);
+
+	/* Subaddress 0x12, RTS0 output control/Output control 2 */
+	/* RTS1 output control = 3-state, pin RTS1 is used as DOT input */
+	/* RTS0 output control = VIPB (subaddress 0x11, bit 1) = 0: reserved */
+	seq_i2c(seq, 0x4a, 0x12, 0x01);
+
+	/* Subaddress 0x13, Output control 3 */
+	if (dev->input_type != SVIDEO) {
+		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD7 to AD0 (LSBs) on VPO7 to VPO0 */
+		/* Selection bit for status byte functionality (OLDSB) = Default status information */
+		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
+		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
+		seq_i2c(seq, 0x4a, 0x13, 0x80);
+	} else {
+		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD8 to AD1 (MSBs) on VPO7 to VPO0 */
+		/* Selection bit for status byte functionality (OLDSB) = Default status information */
+		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
+		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
+		seq_i2c(seq, 0x4a, 0x13, 0x00);
+	}
+
+	/* Subaddress 0x15, Start of VGATE pulse (01-transition) and polarity change of FID pulse/V_GATE1_START */
+	/* Note: Dependency on subaddress 0x17 value */
+	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
+	seq_i2c(seq, 0x4a, 0x15, 0x00);
+
+	/* Subaddress 0x16, Stop of VGATE pulse (10-transition)/V_GATE1_STOP */
+	/* Note: Dependency on subaddress 0x17 value */
+	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
+	seq_i2c(seq, 0x4a, 0x16, 0x00);
+
+	/* Subaddress 0x17, VGATE MSBs/V_GATE1_MSB */
+	/* VSTA8, MSB VGATE start = 0 */
+	/* VSTO8, MSB VGATE stop = 0 */
+	seq_i2c(seq, 0x4a, 0x17, 0x00);
+
+	/* Subaddress 0x40, AC1 */
+	if (dev->tv_standard == NTSC || dev->tv_standard == PAL_60 || dev->tv_standard == NTSC_60 || dev->tv_standard == PAL_M) {
+		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
+		/* Amplitude searching = Amplitude searching active (default) */
+		/* Framing code error = One framing code error allowed */
+		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
+		/* Field size select = 60 Hz field rate */
+		seq_i2c(seq, 0x4a, 0x40, 0x82);
+	} else {
+		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
+		/* Amplitude searching = Amplitude searching active (default) */
+		/* Framing code error = One framing code error allowed */
+		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
+		/* Field size select = 50 Hz field rate */
+		seq_i2c(seq, 0x4a, 0x40, 0x02);
+	}
+
+	if (dev->input_type == SVIDEO && dev->shadow.lcr_reset_valid) {
+		/* LCR register 2 to 24 = As after the reset, so that switching from CVBS while capturing leaves them as a fresh S-video init does */
+		for (i = 0; i < LCR_COUNT; i++) {
+			seq_i2c(seq, 0x4a, LCR_FIRST + i, dev->shadow.lcr_reset[i]);
+		}
+	} else if (dev->input_type != SVIDEO) {
+		/* LCR register 2 to 24 = Intercast, oversampled CVBS data */
+		seq_i2c(seq, 0x4a, 0x41, 0x77);
+		seq_i2c(seq, 0x4a, 0x42, 0x77);
+		seq_i2c(seq, 0x4a, 0x43, 0x77);
+		seq_i2c(seq, 0x4a, 0x44, 0x77);
+		seq_i2c(seq, 0x4a, 0x45, 0x77);
+		seq_i2c(seq, 0x4a, 0x46, 0x77);
+		seq_i2c(seq, 0x4a, 0x47, 0x77);
+		seq_i2c(seq, 0x4a, 0x48, 0x77);
+		seq_i2c(seq, 0x4a, 0x49, 0x77);
+		seq_i2c(seq, 0x4a, 0x4a, 0x77);
+		seq_i2c(seq, 0x4a, 0x4b, 0x77);
+		seq_i2c(seq, 0x4a, 0x4c, 0x77);
+		seq_i2c(seq, 0x4a, 0x4d, 0x77);
+		seq_i2c(seq, 0x4a, 0x4e, 0x77);
+		seq_i2c(seq, 0x4a, 0x4f, 0x77);
+		seq_i2c(seq, 0x4a, 0x50, 0x77);
+		seq_i2c(seq, 0x4a, 0x51, 0x77);
+		seq_i2c(seq, 0x4a, 0x52, 0x77);
+		seq_i2c(seq, 0x4a, 0x53, 0x77);
+		seq_i2c(seq, 0x4a, 0x54, 0x77);
+		/* LCR register 2 to 24 = Active video, video component signal, active video region (default) */
+		seq_i2c(seq, 0x4a, 0x55, 0xff);
+	}
+
+	/* Subaddress 0x58, Framing code for programmable data types/FC */
+	/* Slicer set, Programmable framing code = ??? */
+	seq_i2c(seq, 0x4a, 0x58, 0x00);
+
+	/* Subaddress 0x59, Horizontal offset/HOFF */
+	/* Slicer set, Horizontal offset = Recommended value */
+	seq_i2c(seq, 0x4a, 0x59, 0x54);
+
+	/* Subaddress 0x5a: Vertical offset/VOFF */
+	if (dev->tv_standard == PAL || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM) {
+		/* Slicer set, Vertical offset = Value for 625 lines input */
+		seq_i2c(seq, 0x4a, 0x5a, 0x07);
+	} else {
+		/* Slicer set, Vertical offset = Value for 525 lines input */
+		seq_i2c(seq, 0x4a, 0x5a, 0x0a);
+	}
+
+	/* Subaddress 0x5b, Field offset, MSBs for vertical and horizontal offsets/HVOFF */
+	/* Slicer set, Field offset = Invert field indicator (even/odd; default) */
+	seq_i2c(seq, 0x4a, 0x5b, 0x83);
+
+	/* Subaddress 0x5e, SDID codes */
+	/* Slicer set, SDID codes = SDID5 to SDID0 = 0x00 (default) */
+	seq_i2c(seq, 0x4a, 0x5e, 0x00);
+}
+
+/* Build the register writes of somagic_init() up to the SAA7113 reset */
+static void somagic_reset_sequence(struct write_sequence *seq)
+{
+	/*
+	 * AVR Documentation @ http://www.avr-asm-tutorial.net/avr_en/beginner/PDETAIL.html#IOPORTS
+	 *
+ 	 * Reg 0x3a should be DDRA.
+ 	 * (DDRA = PortA Data Direction Register)
+ 	 * By setting this to 0x80, we set PIN7 to output.
+ 	 *
+ 	 * I assume that this PIN is connected to the RESET pin of the
+ 	 * SAA7XXX & CS5340.
+ 	 *
+ 	 * If we leave this PIN in HIGH, or don't set it to OUTPUT
+ 	 * we can not receive Stereo Audio from the CS5340.
+ 	 *
+ 	 * Reg 0x3b should be PORTA.
+ 	 * (PortA = PortA Data Register)
+ 	 * By setting this to 0x00, we pull Pin7 LOW
+ 	 */
+	seq_reg(seq, 0x3a, 0x80);
+	seq_reg(seq, 0x3b, 0x00);
+
+	/*
+ 	 * Reg 0x34 should be DDRC
+ 	 * Reg 0x35 should be PORTC.
+ 	 *
+ 	 * This PORT seems to only be used in the Model002!
+ 	 */
+	seq_reg(seq, 0x34, 0x01);
+	seq_reg(seq, 0x35, 0x00);
+	seq_reg(seq, 0x34, 0x11);
+	seq_reg(seq, 0x35, 0x11);
+
+	/* SAAxxx: toggle RESET (PIN7), and let the reset complete before the I2C writes */
+	seq_reg(seq, 0x3b, 0x80);
+	seq_reg(seq, 0x3b, 0x00);
+	seq_wait(seq, 0);
+}
+
+/* Build the register writes of somagic_init() after the SAA7113 reset */
+static void somagic_init_sequence(struct somagic_device *dev, struct write_sequence *seq)
+{
+	somagic_decoder_sequence(dev, seq);
+
+	seq_reg(seq, 0x1740, 0x40);
+
+	seq_reg(seq, 0x1740, 0x00);
+	seq_wait(seq, 250 * 1000);
+	seq_reg(seq, 0x1740, 0x00);
+}
+
+/*
+ * Bring the SAA7113 registers in line with the current options (input,
+ * picture controls, TV standard) while the device is running, writing only
+ * the registers whose value differs from the shadow. Registers missing from
+ * the shadow, because they were never written or a write failed, are written
+ * as well: reading one back takes three control transfers and some 30 ms of
+ * sleeps, which would stall the event loop and overrun the iso transfers, so
+ * that is only done before streaming (see somagic_read_lcr()).
+ * A change of line count also needs the capture restarted.
+ * Returns the number of registers written, or -1 on error.
+ */
+static int somagic_reconfigure(struct somagic_device *dev)
+{
+	struct write_sequence *seq;
+	struct somagic_write *write;
+	int count = 0;
+	int ret;
+	int i;
+
+	seq = malloc(sizeof *seq);
+	if (seq == NULL) {
+		perror("Failed to allocate memory for the register writes");
+		return -1;
+	}
+	seq->count = 0;
+	seq->overflow = 0;
+	somagic_decoder_sequence(dev, seq);
+
+	for (i = 0; i < seq->count; i++) {
+		write = &seq->write[i];
+		if (write->type == WRITE_I2C && write->dev_addr == 0x4a && shadow_i2c_valid(dev, write->reg) && dev->shadow.saa7113[write->reg] == write->val) {
+			continue;
+		}
+		seq->write[count++] = *write;
+	}
+	seq->count = count;
+
+	ret = somagic_write_sequence(dev, seq);
+	free(seq);
+	return ret ? -1 : count;
+}
+
+/*
+ * Read back the LCR registers, which only the CVBS input writes, as the
+ * SAA7113 reset left them: a switch to S-video while capturing puts them
+ * back (see somagic_decoder_sequence()). Only done with a control socket,
+ * as each read takes some 30 ms.
+ */
+static void somagic_read_lcr(struct somagic_device *dev)
+{
+	uint8_t val;
+	int i;
+
+	for (i = 0; i < LCR_COUNT; i++) {
+		if (somagic_read_i2c(dev, 0x4a, LCR_FIRST + i, &val)) {
+			return;
+		}
+		dev->shadow.lcr_reset[i] = val;
+	}
+	dev->shadow.lcr_reset_valid = 1;
+}
+
+static int somagic_init(struct somagic_device *dev)
+{
+	int ret;
+	struct write_sequence *seq;
+
+	/* buffer for control messages */
+	unsigned char buf[65535];
+
+	dev->init_start = timestamp_us();
+	if (dev->transport->open(dev)) {
+		return 1;
+	}
+
+	signal(SIGTERM, release_usb_device);
+	ret = dev->transport->claim_interface(dev, 0);
+	if (ret) {
+		perror("Failed to claim device interface");
+		if (ret == LIBUSB_ERROR_BUSY) {
+			fprintf(stderr, "Is "PROGRAM_NAME" already running?\n");
+		}
+		return 1;
+	}
+
+	ret = dev->transport->set_interface_alt_setting(dev, 0, 0);
+	if (ret) {
+		perror("Failed to set active alternate setting for interface");
+		return 1;
+	}
+
+	ret = dev->transport->get_descriptor(dev, 0x0000001, 0x0000000, buf, 18);
+	if (ret != 18) {
+		fprintf(stderr, "1 get descriptor returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
+		fprintf(stderr, "\n");
+	}
+	ret = dev->transport->get_descriptor(dev, 0x0000002, 0x0000000, buf, 9);
+	if (ret != 9) {
+		fprintf(stderr, "2 get descriptor returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
 		fprintf(stderr, "\n");
 	}
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 66);
+	ret = dev->transport->get_descriptor(dev, 0x0000002, 0x0000000, buf, 66);
 	/*
 	fprintf(stderr, "3 get descriptor returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	fprintf(stderr, "\n");
 	*/
 
-	ret = libusb_release_interface(devh, 0);
+	ret = dev->transport->release_interface(dev, 0);
 	if (ret) {
 		perror("Failed to release interface (before set_configuration)");
 		return 1;
 	}
-	ret = libusb_set_configuration(devh, 0x0000001);
-	if (ret) {
-		perror("Failed to set active device configuration");
+	ret = dev->transport->set_configuration(dev, 0x0000001);
+	if (ret) {
+		perror("Failed to set active device configuration");
+		return 1;
+	}
+	ret = dev->transport->claim_interface(dev, 0);
+	if (ret) {
+		perror("Failed to claim device interface (after set_configuration)");
+		return 1;
+	}
+	ret = dev->transport->set_interface_alt_setting(dev, 0, 0);
+	if (ret) {
+		perror("Failed to set active alternate setting for interface (after set_configuration)");
+		return 1;
+	}
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
+	if (ret != 2) {
+		fprintf(stderr, "5 control msg returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
+		fprintf(stderr, "\n");
+	}
+
+	seq = malloc(sizeof *seq);
+	if (seq == NULL) {
+		perror("Failed to allocate memory for the init sequence");
+		return 1;
+	}
+	seq->count = 0;
+	seq->overflow = 0;
+	memset(&dev->shadow, 0, sizeof dev->shadow);
+	somagic_reset_sequence(seq);
+	ret = somagic_write_sequence(dev, seq);
+	if (!ret && control_filename != NULL) {
+		somagic_read_lcr(dev);
+	}
+	seq->count = 0;
+	seq->overflow = 0;
+	somagic_init_sequence(dev, seq);
+	ret = ret || somagic_write_sequence(dev, seq);
+	free(seq);
+	if (ret) {
+		return 1;
+	}
+	if (dev->tv_standard == PAL || dev->tv_standard == PAL_COMBO_N || dev->tv_standard == NTSC_N || dev->tv_standard == SECAM) {
+		dev->lines_per_field = 288;
+	} else {
+		dev->lines_per_field = 240;
+	}
+
+	memcpy(buf, "\x01\x05", 2);
+	ret = dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
+	if (ret != 2) {
+		fprintf(stderr, "190 control msg returned %d, bytes: ", ret);
+		print_bytes(buf, ret);
+		fprintf(stderr, "\n");
+	}
+	ret = dev->transport->get_descriptor(dev, 0x0000002, 0x0000000, buf, 265);
+	/*
+	fprintf(stderr, "191 get descriptor returned %d, bytes: ", ret);
+	print_bytes(buf, ret);
+	fprintf(stderr, "\n");
+	*/
+
+	ret = dev->transport->set_interface_alt_setting(dev, 0, 2);
+	if (ret != 0) {
+		perror("Failed to activate alternate setting for interface");
+		return 1;
+	}
+
+	/* Disable sound - If this line is removed, we start to receive data with the header [0xaa 0xaa 0x00 0x01] */
+	somagic_write_reg(dev, 0x1740, 0x00);
+	usleep(30 * 1000);
+
+	dev->init_done = timestamp_us();
+	return 0;
+}
+
+/*
+ * Create the control socket of a device (see --control). A file left
+ * behind at its path by an earlier run is replaced if it is a socket.
+ */
+static int control_open(struct somagic_device *dev)
+{
+	struct control_socket_t *control;
+	struct sockaddr_un addr;
+	struct stat st;
+
+	control = calloc(1, sizeof *control);
+	if (control == NULL) {
+		perror("Failed to allocate memory for the control socket");
+		return 1;
+	}
+	control->listen_fd = -1;
+	control->client_fd = -1;
+	pthread_mutex_init(&control->lock, NULL);
+	control->settings.input_type = dev->input_type;
+	control->settings.cvbs_input = dev->cvbs_input;
+	control->settings.luminance_mode = dev->luminance_mode;
+	control->settings.luminance_prefilter = dev->luminance_prefilter;
+	control->settings.luminance_aperture = dev->luminance_aperture;
+	control->settings.hue = dev->hue;
+	control->settings.saturation = dev->saturation;
+	control->settings.contrast = dev->contrast;
+	control->settings.brightness = dev->brightness;
+	control->path = device_filename(dev, control_filename);
+	if (control->path == NULL) {
+		perror("Failed to allocate memory for the control socket path");
+		pthread_mutex_destroy(&control->lock);
+		free(control);
 		return 1;
 	}
-	ret = libusb_claim_interface(devh, 0);
-	if (ret) {
-		perror("Failed to claim device interface (after set_configuration)");
+	dev->control = control;
+
+	if (strlen(control->path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: Control socket path '%s' is too long\n", program_path, control->path);
 		return 1;
 	}
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
-	if (ret) {
-		perror("Failed to set active alternate setting for interface (after set_configuration)");
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, control->path);
+	if (lstat(control->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(control->path);
+	}
+
+	control->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (control->listen_fd == -1) {
+		perror("Failed to create control socket");
 		return 1;
 	}
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
-	if (ret != 2) {
-		fprintf(stderr, "5 control msg returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
-		fprintf(stderr, "\n");
+	if (bind(control->listen_fd, (struct sockaddr *)&addr, sizeof addr) || listen(control->listen_fd, 4) || fcntl(control->listen_fd, F_SETFL, O_NONBLOCK)) {
+		fprintf(stderr, "%s: Failed to open control socket '%s': %s\n", program_path, control->path, strerror(errno));
+		close(control->listen_fd);
+		control->listen_fd = -1;
+		return 1;
 	}
+	return 0;
+}
 
-	/*
-	 * AVR Documentation @ http://www.avr-asm-tutorial.net/avr_en/beginner/PDETAIL.html#IOPORTS
-	 *
- 	 * Reg 0x3a should be DDRA.
- 	 * (DDRA = PortA Data Direction Register)
- 	 * By setting this to 0x80, we set PIN7 to output.
- 	 *
- 	 * I assume that this PIN is connected to the RESET pin of the
- 	 * SAA7XXX & CS5340.
- 	 *
- 	 * If we leave this PIN in HIGH, or don't set it to OUTPUT
- 	 * we can not receive Stereo Audio from the CS5340.
- 	 *
- 	 * Reg 0x3b should be PORTA.
- 	 * (PortA = PortA Data Register)
- 	 * By setting this to 0x00, we pull Pin7 LOW
- 	 */
-	somagic_write_reg(0x3a, 0x80);
-	somagic_write_reg(0x3b, 0x00);
+static void control_close(struct somagic_device *dev)
+{
+	struct control_socket_t *control = dev->control;
 
-	/*
- 	 * Reg 0x34 should be DDRC
- 	 * Reg 0x35 should be PORTC.
- 	 *
- 	 * This PORT seems to only be used in the Model002!
- 	 */
-	somagic_write_reg(0x34, 0x01);
-	somagic_write_reg(0x35, 0x00);
-	somagic_write_reg(0x34, 0x11);
-	somagic_write_reg(0x35, 0x11);
+	if (control == NULL) {
+		return;
+	}
+	if (control->client_fd != -1) {
+		close(control->client_fd);
+	}
+	if (control->listen_fd != -1) {
+		close(control->listen_fd);
+		unlink(control->path);
+	}
+	pthread_mutex_destroy(&control->lock);
+	free(control->path);
+	free(control);
+	dev->control = NULL;
+}
 
-	/* SAAxxx: toggle RESET (PIN7) */
-	somagic_write_reg(0x3b, 0x80);
-	somagic_write_reg(0x3b, 0x00);
+/* Parse a whole decimal number from min to max, returns 0 on success */
+static int control_number(const char *arg, int min, int max, int *value)
+{
+	char *end;
+	long number;
 
-	/* Subaddress 0x01, Horizontal Increment delay */
-	/* Recommended position */
-	somagic_write_i2c(0x4a, 0x01, 0x08);
+	if (arg == NULL) {
+		return 1;
+	}
+	errno = 0;
+	number = strtol(arg, &end, 10);
+	if (errno || end == arg || *end != '\0' || number < min || number > max) {
+		return 1;
+	}
+	*value = number;
+	return 0;
+}
 
-	/* Subaddress 0x02, Analog input control 1 */
-	/* Analog function select FUSE = Amplifier plus anti-alias filter bypassed */
-	/* Update hysteresis for 9-bit gain = Off */
-	if (input_type == CVBS) {
-		work = 0xc0 | cvbs_input;
-	} else {
-		work = 0xc0 | input_type;
+/*
+ * Run one control command, changing the options of the device the same way
+ * as the command line option of the same name, and fill in the reply.
+ * The registers are written by the event loop (see capture_reconfigure()).
+ */
+static void control_command(struct somagic_device *dev, char *line, char *reply, size_t size)
+{
+	static const uint8_t cvbs_inputs[] = { VIDEO1, VIDEO2, VIDEO3, VIDEO4 };
+	struct control_socket_t *control = dev->control;
+	struct control_settings_t settings = control->settings;
+	char *name;
+	char *arg;
+	int value;
+
+	name = strtok(line, " \t\r");
+	arg = strtok(NULL, " \t\r");
+	if (name == NULL) {
+		reply[0] = '\0';
+		return;
+	}
+	if (strtok(NULL, " \t\r") != NULL) {
+		snprintf(reply, size, "error: too many arguments\n");
+		return;
 	}
-	somagic_write_i2c(0x4a, 0x02, work);
 
-	/* Subaddress 0x03, Analog input control 2 */
-	if (input_type != SVIDEO) {
-		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
-		/* Static gain control channel 2 (GAI28), sign bit of gain control = 1 */
-		/* Gain control fix (GAFIX) = Automatic gain controlled by MODE3 to MODE0 */
-		/* Automatic gain control integration (HOLDG) = AGC active */
-		/* White peak off (WPOFF) = White peak off */
-		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
-		/* Normal clamping if decoder is in unlocked state */
-		somagic_write_i2c(0x4a, 0x03, 0x33);
+	if (strcmp(name, "brightness") == 0) {
+		if (control_number(arg, 0, 255, &value)) {
+			snprintf(reply, size, "error: brightness must be from 0 to 255\n");
+			return;
+		}
+		settings.brightness = value;
+	} else if (strcmp(name, "contrast") == 0 || strcmp(name, "hue") == 0 || strcmp(name, "saturation") == 0) {
+		if (control_number(arg, -128, 127, &value)) {
+			snprintf(reply, size, "error: %s must be from -128 to 127\n", name);
+			return;
+		}
+		if (name[0] == 'c') {
+			settings.contrast = (int8_t)value;
+		} else if (name[0] == 'h') {
+			settings.hue = (int8_t)value;
+		} else {
+			settings.saturation = (int8_t)value;
+		}
+	} else if (strcmp(name, "luminance") == 0) {
+		if (control_number(arg, 0, 3, &value)) {
+			snprintf(reply, size, "error: luminance mode must be from 0 to 3\n");
+			return;
+		}
+		if (settings.input_type == SVIDEO && value != 0) {
+			snprintf(reply, size, "error: luminance mode must be 0 for S-VIDEO\n");
+			return;
+		}
+		settings.luminance_mode = value;
+	} else if (strcmp(name, "lum-aperture") == 0) {
+		if (control_number(arg, 0, 3, &value)) {
+			snprintf(reply, size, "error: luminance aperture must be from 0 to 3\n");
+			return;
+		}
+		settings.luminance_aperture = value;
+	} else if (strcmp(name, "lum-prefilter") == 0) {
+		if (control_number(arg, 0, 1, &value)) {
+			snprintf(reply, size, "error: luminance prefilter must be 0 or 1\n");
+			return;
+		}
+		settings.luminance_prefilter = value;
+	} else if (strcmp(name, "input") == 0) {
+		if (arg != NULL && strcmp(arg, "s-video") == 0) {
+			if (settings.luminance_mode != 0) {
+				snprintf(reply, size, "error: luminance mode must be 0 for S-VIDEO\n");
+				return;
+			}
+			settings.input_type = SVIDEO;
+		} else if (control_number(arg, 1, 4, &value) == 0) {
+			settings.input_type = CVBS;
+			settings.cvbs_input = cvbs_inputs[value - 1];
+		} else {
+			snprintf(reply, size, "error: input must be from 1 to 4, or s-video\n");
+			return;
+		}
 	} else {
-		/* Static gain control channel 1 (GAI18), sign bit of gain control = 1 */
-		/* Static gain control channel 2 (GAI28), sign bit of gain control = 0 */
-		/* Gain control fix (GAFIX) = Automatic gain controlled by MODE3 to MODE0 */
-		/* Automatic gain control integration (HOLDG) = AGC active */
-		/* White peak off (WPOFF) = White peak off */
-		/* AGC hold during vertical blanking period (VBSL) = Long vertical blanking (AGC disabled from start of pre-equalization pulses until start of active video (line 22 for 60 Hz, line 24 for 50 Hz) */
-		/* Normal clamping if decoder is in unlocked state */
-		somagic_write_i2c(0x4a, 0x03, 0x31);
+		snprintf(reply, size, "error: unknown command '%s'\n", name);
+		return;
 	}
 
-	/* Subaddress 0x04, Gain control analog/Analog input control 3 (AICO3); static gain control channel 1 GAI1 */
-	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI18 value) */
-	somagic_write_i2c(0x4a, 0x04, 0x00);
+	pthread_mutex_lock(&control->lock);
+	control->settings = settings;
+	atomic_store(&dev->reconfigure, 1);
+	pthread_mutex_unlock(&control->lock);
+	snprintf(reply, size, "ok\n");
+}
 
-	/* Subaddress 0x05, Gain control analog/Analog input control 4 (AICO4); static gain control channel 2 GAI2 */
-	/* Gain (dB) = -3 (Note: Dependent on subaddress 0x03 GAI28 value) */
-	somagic_write_i2c(0x4a, 0x05, 0x00);
+/*
+ * Serve the control socket of a device without blocking: accept a client
+ * if there is none, then run each complete command line it has sent
+ */
+static void control_poll(struct somagic_device *dev)
+{
+	struct control_socket_t *control = dev->control;
+	char reply[80];
+	char *newline;
+	ssize_t ret;
+	int length;
 
-	/* Subaddress 0x06, Horizontal sync start/begin */
-	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
-	somagic_write_i2c(0x4a, 0x06, 0xe9);
+	if (control->client_fd == -1) {
+		control->client_fd = accept(control->listen_fd, NULL, NULL);
+		if (control->client_fd == -1) {
+			return;
+		}
+		if (fcntl(control->client_fd, F_SETFL, O_NONBLOCK)) {
+			perror("Failed to set up control connection");
+			close(control->client_fd);
+			control->client_fd = -1;
+			return;
+		}
+		control->line_length = 0;
+	}
 
-	/* Subaddress 0x07, Horizontal sync stop */
-	/* Delay time (step size = 8/LLC) = Recommended value for raw data type */
-	somagic_write_i2c(0x4a, 0x07, 0x0d);
+	ret = read(control->client_fd, control->line + control->line_length, CONTROL_LINE_MAX - 1 - control->line_length);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (ret <= 0) {
+		close(control->client_fd);
+		control->client_fd = -1;
+		return;
+	}
+	control->line_length += ret;
+	control->line[control->line_length] = '\0';
+
+	while ((newline = strchr(control->line, '\n')) != NULL) {
+		*newline = '\0';
+		length = newline + 1 - control->line;
+		control_command(dev, control->line, reply, sizeof reply);
+		if (reply[0] != '\0' && write(control->client_fd, reply, strlen(reply)) == -1 && errno != EAGAIN) {
+			perror("Failed to write control reply");
+		}
+		control->line_length -= length;
+		memmove(control->line, control->line + length, control->line_length + 1);
+	}
+	if (control->line_length == CONTROL_LINE_MAX - 1) {
+		/* Too long to be a command */
+		control->line_length = 0;
+		if (write(control->client_fd, "error: line too long\n", 21) == -1 && errno != EAGAIN) {
+			perror("Failed to write control reply");
+		}
+	}
+}
 
-	/* Subaddress 0x08, Sync control */
-	/* Automatic field detection (AUFD) = Automatic field detection */
-	/* Field selection (FSEL) = 50 Hz, 625 lines (Note: Ignored due to automatic field detection) */
-	/* Forced ODD/EVEN toggle FOET = ODD/EVEN signal toggles only with interlaced source */
-	/* Horizontal time constant selection = Fast locking mode (recommended setting) */
-	/* Horizontal PLL (HPLL) = PLL closed */
-	/* Vertical noise reduction (VNOI) = Normal mode (recommended setting) */
-	somagic_write_i2c(0x4a, 0x08, 0x98);
+/*
+ * Firmware upload to a device plugged in uninitialized (see --hotplug), as
+ * somagic-init does it: each control transfer carries [05 ff] and the next
+ * 62 bytes of the firmware, and FIRMWARE_UPLOAD_DEPTH of them are kept in
+ * flight. They complete in the order they were submitted, so the loader
+ * takes the firmware in sequence. If the device NAKs a transfer until it
+ * times out, the transfers queued behind it are cancelled before they reach
+ * the loader, which would take them out of order, and the upload resumes at
+ * the failed transfer with half as many in flight, after a pause that
+ * doubles with each retry of the same transfer.
+ */
+#define FIRMWARE_CHUNK 62
+#define FIRMWARE_UPLOAD_DEPTH 8
+#define FIRMWARE_RETRIES 6
+
+struct firmware_upload_t {
+	struct libusb_transfer *tfr[FIRMWARE_UPLOAD_DEPTH];
+	unsigned char buf[FIRMWARE_UPLOAD_DEPTH][LIBUSB_CONTROL_SETUP_SIZE + 2 + FIRMWARE_CHUNK];
+	int chunk[FIRMWARE_UPLOAD_DEPTH];
+	int next;        /* next chunk to submit */
+	int accepted;    /* transfers the device has taken, in order */
+	int failed;      /* first transfer that failed: -1 = none */
+	int misordered;  /* a transfer after the failed one was taken */
+	int in_flight;
+};
 
-	/* Subaddress 0x09, Luminance control */
-	/* Update time interval for analog AGC value (UPTCV) = Horizontal update (once per line) */
-	/* Vertical blanking luminance bypass (VBLB) = Active luminance processing */
-	/* Chrominance trap bypass (BYPS) = Chrominance trap active; default for CVBS mode */
-	work = ((luminance_prefilter & 0x01) << 6) | ((luminance_mode & 0x03) << 4) | (luminance_aperture & 0x03);
-	if (input_type == SVIDEO) {
-		/* Chrominance trap bypass (BYPS) = Chrominance trap bypassed; default for S-video mode */
-		work |= 0x80;
+static void firmware_done(struct libusb_transfer *tfr)
+{
+	struct somagic_device *dev = tfr->user_data;
+	struct firmware_upload_t *upload = dev->upload;
+	int slot;
+	int i;
+
+	for (slot = 0; upload->tfr[slot] != tfr; slot++);
+	upload->in_flight--;
+	if (tfr->status == LIBUSB_TRANSFER_COMPLETED && tfr->actual_length == 2 + FIRMWARE_CHUNK) {
+		if (upload->failed == -1) {
+			upload->accepted = upload->chunk[slot] + 1;
+		} else {
+			/* Completed before it could be cancelled */
+			upload->misordered = 1;
+		}
+	} else if (upload->failed == -1) {
+		upload->failed = upload->chunk[slot];
+		for (i = upload->failed + 1; i < upload->next; i++) {
+			dev->transport->cancel_transfer(dev, upload->tfr[i % FIRMWARE_UPLOAD_DEPTH]);
+		}
 	}
-	somagic_write_i2c(0x4a, 0x09, work);
+}
 
-	/* Subaddress 0x0a, Luminance brightness control */
-	/* Offset = 128 (ITU level) */
-	somagic_write_i2c(0x4a, 0x0a, brightness);
+static int firmware_upload(struct somagic_device *dev, const unsigned char *firmware, int firmware_length)
+{
+	struct firmware_upload_t *upload;
+	int chunks = (firmware_length + FIRMWARE_CHUNK - 1) / FIRMWARE_CHUNK;
+	int depth = FIRMWARE_UPLOAD_DEPTH;
+	int delay = 1000;
+	int last_failed = -1;
+	int tries = 0;
+	int ret = 0;
+	int slot;
+
+	upload = calloc(1, sizeof *upload);
+	if (upload == NULL) {
+		perror("Failed to allocate memory for the firmware transfers");
+		return 1;
+	}
+	for (slot = 0; slot < FIRMWARE_UPLOAD_DEPTH && !ret; slot++) {
+		upload->tfr[slot] = libusb_alloc_transfer(0);
+		if (upload->tfr[slot] == NULL) {
+			perror("Failed to allocate memory for the firmware transfers");
+			ret = 1;
+		}
+	}
+	dev->upload = upload;
+
+	while (upload->accepted < chunks && !ret) {
+		upload->failed = -1;
+		upload->next = upload->accepted;
+		while ((upload->next < chunks && upload->failed == -1 && !ret) || upload->in_flight) {
+			while (upload->next < chunks && upload->in_flight < depth && upload->failed == -1 && !ret) {
+				slot = upload->next % FIRMWARE_UPLOAD_DEPTH;
+				libusb_fill_control_setup(upload->buf[slot], LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000005, 0x0000000, 2 + FIRMWARE_CHUNK);
+				memcpy(upload->buf[slot] + LIBUSB_CONTROL_SETUP_SIZE, "\x05\xff", 2);
+				memset(upload->buf[slot] + LIBUSB_CONTROL_SETUP_SIZE + 2, 0, FIRMWARE_CHUNK);
+				memcpy(upload->buf[slot] + LIBUSB_CONTROL_SETUP_SIZE + 2, firmware + upload->next * FIRMWARE_CHUNK, MIN(FIRMWARE_CHUNK, firmware_length - upload->next * FIRMWARE_CHUNK));
+				libusb_fill_control_transfer(upload->tfr[slot], dev->devh, upload->buf[slot], firmware_done, dev, 1000);
+				upload->chunk[slot] = upload->next;
+				if (dev->transport->submit_transfer(dev, upload->tfr[slot])) {
+					ret = 1;
+					break;
+				}
+				upload->in_flight++;
+				upload->next++;
+			}
+			if (upload->in_flight) {
+				dev->transport->handle_events();
+			}
+		}
+		if (ret || upload->failed == -1) {
+			continue;
+		}
 
-	/* Subaddress 0x0b, Luminance contrast control */
-	/* Gain = 1.0 */
-	somagic_write_i2c(0x4a, 0x0b, contrast);
+		if (upload->failed != last_failed) {
+			last_failed = upload->failed;
+			tries = 0;
+			delay = 1000;
+		}
+		if (upload->misordered || ++tries > FIRMWARE_RETRIES) {
+			ret = 1;
+		} else {
+			depth = MAX(depth / 2, 1);
+			usleep(delay);
+			delay *= 2;
+		}
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Failed to upload the firmware to %s, at byte %d\n", program_path, dev->name, upload->accepted * FIRMWARE_CHUNK);
+	}
 
-	/* Subaddress 0x0c, Chrominance saturation control */
-	somagic_write_i2c(0x4a, 0x0c, saturation);
+	for (slot = 0; slot < FIRMWARE_UPLOAD_DEPTH; slot++) {
+		libusb_free_transfer(upload->tfr[slot]);
+	}
+	free(upload);
+	dev->upload = NULL;
+	return ret;
+}
 
-	/* Subaddress 0x0d, Chrominance hue control */
-	somagic_write_i2c(0x4a, 0x0d, hue);
+/* Read and check the firmware file (see --firmware) */
+static int firmware_read()
+{
+	FILE *infile;
+	unsigned char digest[4];
+	long length;
+	int p;
 
-	/* Subaddress 0x0e, Chrominance control */
-	/* Chrominance bandwidth (CHBW0 and CHBW1) = Nominal bandwidth (800 kHz) */
-	/* Fast color time constant (FCTC) = Nominal time constant */
-	/* Disable chrominance comb filter (DCCF) = Chrominance comb filter on (during lines determined by VREF = 1) */
-	/* Clear DTO (CDTO) = Disabled */
-	switch (tv_standard) {
-	case PAL:
-	case NTSC:
-		work = 0x01;
-		break;
-	case NTSC_50:
-	case PAL_60:
-		work = 0x11;
-		break;
-	case PAL_COMBO_N:
-	case NTSC_60:
-		work = 0x21;
-		break;
-	case NTSC_N:
-	case PAL_M:
-		work = 0x31;
-		break;
-	case SECAM:
-		work = 0x50;
-		break;
+	infile = fopen(firmware_filename, "rb");
+	if (infile == NULL) {
+		fprintf(stderr, "%s: Failed to open firmware file '%s': %s\n", program_path, firmware_filename, strerror(errno));
+		return 1;
 	}
-	somagic_write_i2c(0x4a, 0x0e, work);
-
-	/* Subaddress 0x0f, Chrominance gain control */
-	/* Chrominance gain value = ??? (Note: only meaningful if ACGF is off) */
-	/* Automatic chrominance gain control ACGC = On */
-	somagic_write_i2c(0x4a, 0x0f, 0x2a);
+	if (fseek(infile, 0, SEEK_END) == -1 || (length = ftell(infile)) == -1 || fseek(infile, 0, SEEK_SET) == -1) {
+		fprintf(stderr, "%s: Failed to determine firmware file '%s' size: %s\n", program_path, firmware_filename, strerror(errno));
+		fclose(infile);
+		return 1;
+	}
+	hotplug_state.firmware = malloc(length);
+	if (hotplug_state.firmware == NULL) {
+		perror("Failed to allocate memory for the firmware");
+		fclose(infile);
+		return 1;
+	}
+	hotplug_state.firmware_length = length;
+	if (fread(hotplug_state.firmware, 1, length, infile) < (size_t)length) {
+		fprintf(stderr, "%s: Failed to read firmware file '%s': %s\n", program_path, firmware_filename, strerror(errno));
+		fclose(infile);
+		return 1;
+	}
+	fclose(infile);
 
-	/* Subaddress 0x10, Format/delay control */
-	/* Output format selection (OFTS0 and OFTS1), V-flag generation in SAV/EAV-codes = V-flag in SAV/EAV is generated by VREF */
-	/* Fine position of HS (HDEL0 and HDEL1) (steps in 2/LLC) = 0 */
-	/* VREF pulse position and length (VRLN) = see Table 46 in SAA7113H documentation */
-	/* Luminance delay compensation (steps in 2/LLC) = 0 */
-	somagic_write_i2c(0x4a, 0x10, 0x40);
+	gcry_md_hash_buffer(GCRY_MD_CRC32, digest, hotplug_state.firmware, length);
+	for (p = 0; p < FIRMWARE_COUNT && memcmp(digest, SOMAGIC_FIRMWARE_CRC32[p], 4); p++);
+	if (p == FIRMWARE_COUNT) {
+		fprintf(stderr, "%s: Firmware file '%s' was not recognized\n", program_path, firmware_filename);
+		return 1;
+	}
+	return 0;
+}
 
-	/* Subaddress 0x11, Output control 1 */
-	/* General purpose switch [available on pin RTS1, if control bits RTSE13 to RTSE10 (subaddress 0x12) is set to 0010] = LOW */
-	/* CM99 compatibility to SAA7199 (CM99) = Default value */
-	/* General purpose switch [available on pin RTS0, if control bits RTSE03 to RTSE00 (subaddress 0x12) is set to 0010] = LOW */
-	/* Selection of horizontal lock indicator for RTS0 and RTS1 outputs = Standard horizontal lock indicator (low-passed) */
-	/* Output enable YUV data (OEYC) = Output VPO-bus active or controlled by RTS1 */
-	/* Output enable real-time (OERT) = RTS0, RTCO active, RTS1 active, if RTSE13 to RTSE10 = 0000 */
-	/* YUV decoder bypassed (VIPB) = Processed data to VPO output */
-	/* Color on (COLO) = Automatic color killer */
-	somagic_write_i2c(0x4a, 0x11, 0x0c);
+/* Upload the firmware to a device plugged in uninitialized, after which it reconnects as a capture device */
+static int somagic_load_firmware(struct somagic_device *dev)
+{
+	unsigned char buf[34];
+	int ret;
 
-	/* Subaddress 0x12, RTS0 output control/Output control 2 */
-	/* RTS1 output control = 3-state, pin RTS1 is used as DOT input */
-	/* RTS0 output control = VIPB (subaddress 0x11, bit 1) = 0: reserved */
-	somagic_write_i2c(0x4a, 0x12, 0x01);
+	if (dev->transport->open(dev)) {
+		return 1;
+	}
+	ret = dev->transport->claim_interface(dev, 0);
+	if (!ret) {
+		ret = dev->transport->set_interface_alt_setting(dev, 0, 0);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Failed to claim interface of %s: %s\n", program_path, dev->name, libusb_error_name(ret));
+		dev->transport->close(dev);
+		return 1;
+	}
+	dev->transport->get_descriptor(dev, 0x0000001, 0x0000000, buf, 18);
+	dev->transport->get_descriptor(dev, 0x0000002, 0x0000000, buf, 9);
+	dev->transport->get_descriptor(dev, 0x0000002, 0x0000000, buf, 34);
+	ret = dev->transport->release_interface(dev, 0);
+	if (!ret) {
+		ret = dev->transport->set_configuration(dev, 0x0000001);
+	}
+	if (!ret) {
+		ret = dev->transport->claim_interface(dev, 0);
+	}
+	if (!ret) {
+		ret = dev->transport->set_interface_alt_setting(dev, 0, 0);
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Failed to configure %s: %s\n", program_path, dev->name, libusb_error_name(ret));
+		dev->transport->close(dev);
+		return 1;
+	}
+	dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
 
-	/* Subaddress 0x13, Output control 3 */
-	if (input_type != SVIDEO) {
-		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD7 to AD0 (LSBs) on VPO7 to VPO0 */
-		/* Selection bit for status byte functionality (OLDSB) = Default status information */
-		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
-		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
-		somagic_write_i2c(0x4a, 0x13, 0x80);
-	} else {
-		/* Analog-to-digital converter output bits on VPO7 to VPO0 in bypass mode (VIPB = 1, used for test purposes) (ADLSB) = AD8 to AD1 (MSBs) on VPO7 to VPO0 */
-		/* Selection bit for status byte functionality (OLDSB) = Default status information */
-		/* Field ID polarity if selected on RTS1 or RTS0 outputs if RTSE1 and RTSE0 (subaddress 0x12) are set to 1111 = Default */
-		/* Analog test select (AOSL) = AOUT connected to internal test point 1 */
-		somagic_write_i2c(0x4a, 0x13, 0x00);
+	ret = firmware_upload(dev, hotplug_state.firmware, hotplug_state.firmware_length);
+	if (!ret) {
+		/* Reconnect with the new firmware */
+		memcpy(buf, "\x07\x00", 2);
+		dev->transport->control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000007, 0x0000000, buf, 2, 1000);
 	}
+	dev->transport->close(dev);
+	return ret;
+}
 
-	/* Subaddress 0x15, Start of VGATE pulse (01-transition) and polarity change of FID pulse/V_GATE1_START */
-	/* Note: Dependency on subaddress 0x17 value */
-	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
-	somagic_write_i2c(0x4a, 0x15, 0x00);
+/* Simulated devices have no usb_dev, and there is only one of each product */
+static int hotplug_same_device(const struct hotplug_event_t *event, struct libusb_device *usb_dev, int product)
+{
+	return event->usb_dev != NULL ? event->usb_dev == usb_dev : usb_dev == NULL && event->product == product;
+}
 
-	/* Subaddress 0x16, Stop of VGATE pulse (10-transition)/V_GATE1_STOP */
-	/* Note: Dependency on subaddress 0x17 value */
-	/* Frame line counting = If 50Hz: 1st = 2, 2nd = 315. If 60Hz: 1st = 5, 2nd = 268. */
-	somagic_write_i2c(0x4a, 0x16, 0x00);
+/*
+ * Act on the devices plugged in and out since the last call: upload the
+ * firmware to uninitialized devices, keep track of the initialized ones
+ * waiting to be captured from, and stop capturing from a device that is
+ * gone. Runs on the event thread, so the firmware upload keeps the
+ * transfers of the device being captured from going.
+ */
+static void hotplug_poll()
+{
+	struct hotplug_event_t event;
+	struct somagic_device *dev;
+	int i;
 
-	/* Subaddress 0x17, VGATE MSBs/V_GATE1_MSB */
-	/* VSTA8, MSB VGATE start = 0 */
-	/* VSTO8, MSB VGATE stop = 0 */
-	somagic_write_i2c(0x4a, 0x17, 0x00);
+	while (hotplug_state.queue_count > 0) {
+		event = hotplug_state.queue[0];
+		hotplug_state.queue_count--;
+		memmove(hotplug_state.queue, hotplug_state.queue + 1, hotplug_state.queue_count * sizeof *hotplug_state.queue);
 
-	/* Subaddress 0x40, AC1 */
-	if (tv_standard == NTSC || tv_standard == PAL_60 || tv_standard == NTSC_60 || tv_standard == PAL_M) {
-		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
-		/* Amplitude searching = Amplitude searching active (default) */
-		/* Framing code error = One framing code error allowed */
-		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
-		/* Field size select = 60 Hz field rate */
-		somagic_write_i2c(0x4a, 0x40, 0x82);
-	} else {
-		/* Data slicer clock selection, Amplitude searching = 13.5 MHz (default) */
-		/* Amplitude searching = Amplitude searching active (default) */
-		/* Framing code error = One framing code error allowed */
-		/* Hamming check = Hamming check for 2 bytes after framing code, dependent on data type (default) */
-		/* Field size select = 50 Hz field rate */
-		somagic_write_i2c(0x4a, 0x40, 0x02);
+		if (event.arrived && event.product == ORIGINAL_PRODUCT) {
+			dev = somagic_device_alloc();
+			if (dev == NULL) {
+				perror("Failed to allocate memory for the device");
+			} else {
+				dev->transport = (event.usb_dev != NULL) ? &usb_transport : &sim_transport;
+				dev->product = event.product;
+				if (event.usb_dev != NULL) {
+					dev->usb_dev = libusb_ref_device(event.usb_dev);
+					usb_device_name(event.usb_dev, dev->name, sizeof dev->name);
+				} else {
+					strcpy(dev->name, "sim0");
+				}
+				fprintf(stderr, "%s: Uploading firmware to %s\n", program_path, dev->name);
+				somagic_load_firmware(dev);
+				somagic_device_free(dev);
+			}
+		} else if (event.arrived) {
+			if (event.usb_dev != NULL && device_selection_count > 0) {
+				for (i = 0; i < device_selection_count && !usb_device_matches(event.usb_dev, device_selection[i]); i++);
+				if (i == device_selection_count) {
+					libusb_unref_device(event.usb_dev);
+					continue;
+				}
+			}
+			if (hotplug_state.waiting_count == HOTPLUG_QUEUE_MAX) {
+				fprintf(stderr, "%s: Too many USB devices waiting to be captured from\n", program_path);
+			} else {
+				/* The waiting list takes over the reference */
+				hotplug_state.waiting[hotplug_state.waiting_count++] = event;
+				continue;
+			}
+		} else {
+			for (i = 0; i < hotplug_state.waiting_count && !hotplug_same_device(&hotplug_state.waiting[i], event.usb_dev, event.product); i++);
+			if (i < hotplug_state.waiting_count) {
+				if (hotplug_state.waiting[i].usb_dev != NULL) {
+					libusb_unref_device(hotplug_state.waiting[i].usb_dev);
+				}
+				hotplug_state.waiting_count--;
+				memmove(hotplug_state.waiting + i, hotplug_state.waiting + i + 1, (hotplug_state.waiting_count - i) * sizeof *hotplug_state.waiting);
+			}
+			dev = hotplug_state.active;
+			if (dev != NULL && (dev->usb_dev != NULL ? dev->usb_dev == event.usb_dev : event.usb_dev == NULL && dev->product == event.product)) {
+				dev->unplugged = 1;
+				atomic_store(&dev->stop_sending_requests, 1);
+			}
+		}
+		if (event.usb_dev != NULL) {
+			libusb_unref_device(event.usb_dev);
+		}
 	}
+}
 
-	if (input_type != SVIDEO) {
-		/* LCR register 2 to 24 = Intercast, oversampled CVBS data */
-		somagic_write_i2c(0x4a, 0x41, 0x77);
-		somagic_write_i2c(0x4a, 0x42, 0x77);
-		somagic_write_i2c(0x4a, 0x43, 0x77);
-		somagic_write_i2c(0x4a, 0x44, 0x77);
-		somagic_write_i2c(0x4a, 0x45, 0x77);
-		somagic_write_i2c(0x4a, 0x46, 0x77);
-		somagic_write_i2c(0x4a, 0x47, 0x77);
-		somagic_write_i2c(0x4a, 0x48, 0x77);
-		somagic_write_i2c(0x4a, 0x49, 0x77);
-		somagic_write_i2c(0x4a, 0x4a, 0x77);
-		somagic_write_i2c(0x4a, 0x4b, 0x77);
-		somagic_write_i2c(0x4a, 0x4c, 0x77);
-		somagic_write_i2c(0x4a, 0x4d, 0x77);
-		somagic_write_i2c(0x4a, 0x4e, 0x77);
-		somagic_write_i2c(0x4a, 0x4f, 0x77);
-		somagic_write_i2c(0x4a, 0x50, 0x77);
-		somagic_write_i2c(0x4a, 0x51, 0x77);
-		somagic_write_i2c(0x4a, 0x52, 0x77);
-		somagic_write_i2c(0x4a, 0x53, 0x77);
-		somagic_write_i2c(0x4a, 0x54, 0x77);
-		/* LCR register 2 to 24 = Active video, video component signal, active video region (default) */
-		somagic_write_i2c(0x4a, 0x55, 0xff);
+/* Serve the control sockets of all devices, and print statistics when asked */
+static void capture_control()
+{
+	struct somagic_device *dev;
+
+	if (statistics_requested) {
+		statistics_requested = 0;
+		print_all_stats();
 	}
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (dev->control != NULL) {
+			control_poll(dev);
+		}
+	}
+}
 
-	/* Subaddress 0x58, Framing code for programmable data types/FC */
-	/* Slicer set, Programmable framing code = ??? */
-	somagic_write_i2c(0x4a, 0x58, 0x00);
+/*
+ * Apply the settings changed through the control socket. The request is
+ * latched when first seen, and the registers are written once the decoder
+ * has reported the end of a field, so that the change starts with a field
+ * instead of tearing the current one. Without a signal no field ends, so
+ * they are written anyway after RECONFIGURE_WAIT_US.
+ */
+static void capture_reconfigure(struct somagic_device *dev)
+{
+	struct control_socket_t *control = dev->control;
+	uint64_t now = timestamp_us();
+	int count;
+
+	if (dev->reconfigure_time == 0) {
+		dev->reconfigure_fields = atomic_load(&dev->fields_decoded);
+		dev->reconfigure_time = now;
+		return;
+	}
+	if (atomic_load(&dev->fields_decoded) == dev->reconfigure_fields && now - dev->reconfigure_time < RECONFIGURE_WAIT_US) {
+		return;
+	}
+	dev->reconfigure_time = 0;
+
+	pthread_mutex_lock(&control->lock);
+	atomic_store(&dev->reconfigure, 0);
+	dev->input_type = control->settings.input_type;
+	dev->cvbs_input = control->settings.cvbs_input;
+	dev->luminance_mode = control->settings.luminance_mode;
+	dev->luminance_prefilter = control->settings.luminance_prefilter;
+	dev->luminance_aperture = control->settings.luminance_aperture;
+	dev->hue = control->settings.hue;
+	dev->saturation = control->settings.saturation;
+	dev->contrast = control->settings.contrast;
+	dev->brightness = control->settings.brightness;
+	pthread_mutex_unlock(&control->lock);
+
+	count = somagic_reconfigure(dev);
+	if (count < 0) {
+		fprintf(stderr, "%sFailed to reconfigure the device\n", device_prefix(dev));
+	} else if (print_statistics) {
+		fprintf(stderr, "%sReconfigured: %d register writes\n", device_prefix(dev), count);
+	}
+}
 
-	/* Subaddress 0x59, Horizontal offset/HOFF */
-	/* Slicer set, Horizontal offset = Recommended value */
-	somagic_write_i2c(0x4a, 0x59, 0x54);
+/*
+ * Complete and resubmit the transfers of all devices until none is pending,
+ * and make the changes that touch the transfers or the device: hotplug,
+ * stream restarts, autotuning and reconfiguration. With control, also do
+ * what capture_control() does.
+ */
+static void capture_events(int control)
+{
+	struct somagic_device *dev;
 
-	/* Subaddress 0x5a: Vertical offset/VOFF */
-	if (tv_standard == PAL || tv_standard == PAL_COMBO_N || tv_standard == NTSC_N || tv_standard == SECAM) {
-		/* Slicer set, Vertical offset = Value for 625 lines input */
-		somagic_write_i2c(0x4a, 0x5a, 0x07);
-		lines_per_field = 288;
-	} else {
-		/* Slicer set, Vertical offset = Value for 525 lines input */
-		somagic_write_i2c(0x4a, 0x5a, 0x0a);
-		lines_per_field = 240;
+	while (capture_pending()) {
+		device_list->transport->handle_events();
+		if (hotplug) {
+			hotplug_poll();
+		}
+		if (control) {
+			capture_control();
+		}
+		for (dev = device_list; dev != NULL; dev = dev->next) {
+			if (watchdog_timeout) {
+				capture_watchdog(dev);
+			}
+			if (dev->autotune != AUTOTUNE_OFF && !dev->stop_sending_requests) {
+				autotune(dev);
+			}
+			if (atomic_load(&dev->reconfigure)) {
+				capture_reconfigure(dev);
+			}
+		}
 	}
+}
 
-	/* Subaddress 0x5b, Field offset, MSBs for vertical and horizontal offsets/HVOFF */
-	/* Slicer set, Field offset = Invert field indicator (even/odd; default) */
-	somagic_write_i2c(0x4a, 0x5b, 0x83);
+static void *event_thread_main(void *arg)
+{
+	(void)arg;
+	capture_events(0);
+	atomic_store(&events_done, 1);
+	return NULL;
+}
 
-	/* Subaddress 0x5e, SDID codes */
-	/* Slicer set, SDID codes = SDID5 to SDID0 = 0x00 (default) */
-	somagic_write_i2c(0x4a, 0x5e, 0x00);
+/*
+ * Start the event thread (see --event-thread), with SCHED_FIFO priority
+ * event_priority and pinned to event_cpu if given. It is started last, so
+ * the decode pool and the writer threads keep normal priority.
+ */
+static int event_thread_start(pthread_t *thread)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int ret;
+
+	pthread_attr_init(&attr);
+	if (event_priority > 0 && device_list->transport == &sim_transport) {
+		/* Simulated transfers complete at once, so the thread never sleeps and would starve the others */
+		fprintf(stderr, "%s: Simulated devices keep the event thread busy, leaving it at normal priority\n", program_path);
+	} else if (event_priority > 0) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		param.sched_priority = event_priority;
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (event_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(event_cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus);
+	}
+	atomic_store(&events_done, 0);
+	ret = pthread_create(thread, &attr, event_thread_main, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		fprintf(stderr, "%s: Failed to start the event thread: %s, completing the transfers on the main thread\n", program_path, strerror(ret));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Capture from all devices. Their transfers are completed by one thread,
+ * this one or the event thread, the decoding is spread over the decode pool.
+ */
+static int somagic_capture()
+{
+	struct somagic_device *dev;
+	pthread_t thread;
+	int ret = 0;
 
-	somagic_write_reg(0x1740, 0x40);
+	if (!test_only) {
+		for (dev = device_list; dev != NULL; dev = dev->next) {
+			if (capture_start(dev)) {
+				return 1;
+			}
+			if (control_filename != NULL && control_open(dev)) {
+				control_close(dev);
+				return 1;
+			}
+		}
+		if (decode_pool_start()) {
+			return 1;
+		}
+		capture_cpu_start = cpu_time_us();
+		for (dev = device_list; dev != NULL && !ret; dev = dev->next) {
+			ret = capture_submit(dev);
+		}
+		if (ret) {
+			/* Let the transfers already submitted complete */
+			for (dev = device_list; dev != NULL; dev = dev->next) {
+				atomic_store(&dev->stop_sending_requests, 1);
+			}
+		}
 
-	somagic_write_reg(0x1740, 0x00);
-	usleep(250 * 1000);
-	somagic_write_reg(0x1740, 0x00);
+		if (event_thread && !event_thread_start(&thread)) {
+			while (!atomic_load(&events_done)) {
+				capture_control();
+				usleep(EVENT_THREAD_POLL_US);
+			}
+			pthread_join(thread, NULL);
+		} else {
+			capture_events(1);
+		}
 
-	memcpy(buf, "\x01\x05", 2);
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
-	if (ret != 2) {
-		fprintf(stderr, "190 control msg returned %d, bytes: ", ret);
-		print_bytes(buf, ret);
-		fprintf(stderr, "\n");
+		decode_pool_finish();
+		for (dev = device_list; dev != NULL; dev = dev->next) {
+			control_close(dev);
+			capture_free(dev);
+			finish_processing(dev);
+		}
+		if (print_statistics) {
+			print_cpu_stats();
+		}
 	}
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 265);
-	/*
-	fprintf(stderr, "191 get descriptor returned %d, bytes: ", ret);
-	print_bytes(buf, ret);
-	fprintf(stderr, "\n");
-	*/
 
-	ret = libusb_set_interface_alt_setting(devh, 0, 2);
-	if (ret != 0) {
-		perror("Failed to activate alternate setting for interface");
+	for (dev = device_list; dev != NULL; dev = dev->next) {
+		if (!dev->unplugged && dev->transport->release_interface(dev, 0)) {
+			fprintf(stderr, "%s: Failed to release interface of %s\n", program_path, dev->name);
+			ret = 1;
+		}
+		dev->transport->close(dev);
+		ret |= close_output_files(dev);
+	}
+	return ret;
+}
+
+/*
+ * Daemon mode (see --hotplug): wait for devices to be plugged in, upload the
+ * firmware to those that need it, and capture from one device at a time.
+ * When it is unplugged, or its transfers fail, the capture is torn down and
+ * the next device waiting is used; a device that failed while still plugged
+ * in is used again at once if it had delivered video. Ends once --frames
+ * frames have been captured from a device.
+ */
+static int somagic_hotplug(struct somagic_device *options)
+{
+	struct hotplug_event_t event;
+	struct somagic_device *dev;
+	int done = 0;
+	int ret;
+
+	/* The options are not a device of their own */
+	device_list = NULL;
+	device_count = 0;
+
+	if (firmware_read()) {
+		return 1;
+	}
+	if (options->transport == &usb_transport && usb_init()) {
+		return 1;
+	}
+	if (options->transport->hotplug_register()) {
 		return 1;
 	}
 
-	/* Disable sound - If this line is removed, we start to receive data with the header [0xaa 0xaa 0x00 0x01] */
-	somagic_write_reg(0x1740, 0x00);
-	usleep(30 * 1000);
+	while (!done) {
+		while (hotplug_state.waiting_count == 0) {
+			options->transport->handle_events();
+			hotplug_poll();
+		}
+		event = hotplug_state.waiting[0];
+		hotplug_state.waiting_count--;
+		memmove(hotplug_state.waiting, hotplug_state.waiting + 1, hotplug_state.waiting_count * sizeof *hotplug_state.waiting);
 
-	return 0;
+		dev = somagic_device_alloc();
+		if (dev == NULL) {
+			perror("Failed to allocate memory for the device");
+			return 1;
+		}
+		somagic_device_copy_options(dev, options);
+		dev->usb_dev = event.usb_dev;
+		dev->product = event.product;
+		dev->index = hotplug_state.connections++;
+		if (dev->usb_dev != NULL) {
+			usb_device_name(dev->usb_dev, dev->name, sizeof dev->name);
+		} else {
+			strcpy(dev->name, "sim0");
+		}
+		device_list = dev;
+		device_count = 1;
+		hotplug_state.active = dev;
+
+		fprintf(stderr, "%s: Capturing from %s\n", program_path, dev->name);
+		ret = open_output_files(dev);
+		if (!ret) {
+			ret = somagic_init(dev);
+			if (ret) {
+				if (dev->devh != NULL || dev->sim != NULL) {
+					dev->transport->close(dev);
+				}
+				close_output_files(dev);
+			} else {
+				ret = somagic_capture();
+			}
+		}
+		fprintf(stderr, "%s: Stopped capturing from %s%s\n", program_path, dev->name, dev->unplugged ? ", unplugged" : "");
+		done = dev->frame_count != -1 && dev->frames_generated >= dev->frame_count;
+
+		if (!dev->unplugged && !done && dev->frames_generated > 0 && hotplug_state.waiting_count < HOTPLUG_QUEUE_MAX) {
+			/* Still plugged in, so use it again */
+			event.usb_dev = dev->usb_dev;
+			dev->usb_dev = NULL;
+			hotplug_state.waiting[hotplug_state.waiting_count++] = event;
+		}
+		hotplug_state.active = NULL;
+		device_list = NULL;
+		device_count = 0;
+		somagic_device_free(dev);
+	}
+
+	somagic_device_free(options);
+	return ret;
 }
 
 static void version()
@@ -1127,6 +6445,16 @@ static void usage()
         /*               00000000011111111112222222222333333333344444444445555555555666666666677777777778 */
         /*               12345678901234567890123456789012345678901234567890123456789012345678901234567890 */
 	fprintf(stderr, "Usage: "PROGRAM_NAME" [options]\n");
+	fprintf(stderr, "      --all-devices          Capture from every device found (see --vo)\n");
+	fprintf(stderr, "      --autotune=GOAL        Adjust the iso transfers and their packets while\n");
+	fprintf(stderr, "                             capturing, from measured callbacks and losses\n");
+	fprintf(stderr, "                             Goal     Tuned for\n");
+	fprintf(stderr, "                             latency  Smallest transfers\n");
+	fprintf(stderr, "                             cpu      Fewest callbacks per second\n");
+	fprintf(stderr, "                             off      Fixed settings (default)\n");
+	fprintf(stderr, "      --benchmark            Measure decoding speed on synthetic streams (and\n");
+	fprintf(stderr, "                             on the --replay file) and pixel format\n");
+	fprintf(stderr, "                             conversion, instead of capturing\n");
 	fprintf(stderr, "  -B, --brightness=VALUE     Luminance brightness control,\n");
 	fprintf(stderr, "                             0 to 255 (default: 128)\n");
 	fprintf(stderr, "                             Value  Brightness\n");
@@ -1145,19 +6473,59 @@ static void usage()
 	fprintf(stderr, "                                 0   0.000000 (luminance off)\n");
 	fprintf(stderr, "                               -64  -1.000000 (inverse)\n");
 	fprintf(stderr, "                              -128  -2.000000 (inverse)\n");
+	fprintf(stderr, "      --control=PATH         Accept picture and input changes while capturing\n");
+	fprintf(stderr, "                             on a Unix domain socket at PATH (see man page)\n");
+	fprintf(stderr, "      --convert-threads=COUNT\n");
+	fprintf(stderr, "                             Number of threads converting each frame to the\n");
+	fprintf(stderr, "                             --pixel-format, in bands of lines (default: 1)\n");
 	fprintf(stderr, "  -c, --cvbs                 Use CVBS (composite) input on the EasyCAP DC60\n");
 	fprintf(stderr, "                             and EzCAP USB 2.0, numbered inputs on the\n");
 	fprintf(stderr, "                             EasyCAP002 (default)\n");
  	fprintf(stderr, "  -i, --cvbs-input=VALUE     Select CVBS (composite) input to use, 1 to 4,\n");
 	fprintf(stderr, "                             EasyCAP002 only (default: 3)\n");
+	fprintf(stderr, "      --decode-buffers=COUNT Number of completed transfers that may wait for\n");
+	fprintf(stderr, "                             a decode thread, 0 to decode in the USB\n");
+	fprintf(stderr, "                             callback (default: 16)\n");
+	fprintf(stderr, "      --decode-threads=COUNT Number of decode threads shared by the devices,\n");
+	fprintf(stderr, "                             0 for one per device, up to the number of\n");
+	fprintf(stderr, "                             CPUs (default: 0)\n");
+	fprintf(stderr, "      --device=DEVICE        Capture from DEVICE, given as BUS-PORT[.PORT]...\n");
+	fprintf(stderr, "                             or BUS:ADDRESS; may be repeated (default: the\n");
+	fprintf(stderr, "                             first device found)\n");
+	fprintf(stderr, "      --event-cpu=CPU        Pin the event thread to CPU (implies\n");
+	fprintf(stderr, "                             --event-thread)\n");
+	fprintf(stderr, "      --event-priority=PRIO  Run the event thread with SCHED_FIFO priority\n");
+	fprintf(stderr, "                             PRIO, 1 to 99 (implies --event-thread)\n");
+	fprintf(stderr, "      --event-thread         Complete and resubmit the iso transfers on a\n");
+	fprintf(stderr, "                             thread of their own, with the iso buffers\n");
+	fprintf(stderr, "                             locked in memory\n");
+	fprintf(stderr, "      --field-rate           Output each field as soon as it is decoded, as\n");
+	fprintf(stderr, "                             a frame of half the height at 50 or 59.94 Hz,\n");
+	fprintf(stderr, "                             top field first; --frames counts fields\n");
+	fprintf(stderr, "      --firmware=FILENAME    Firmware for --hotplug (default:\n");
+	fprintf(stderr, "                             "SOMAGIC_FIRMWARE_PATH")\n");
 	fprintf(stderr, "  -f, --frames=COUNT         Number of frames to generate,\n");
 	fprintf(stderr, "                             -1 for unlimited (default: -1)\n");
+	fprintf(stderr, "      --hotplug              Keep running: upload the firmware to devices as\n");
+	fprintf(stderr, "                             they are plugged in, and capture from each in\n");
+	fprintf(stderr, "                             turn, starting over when one is unplugged\n");
 	fprintf(stderr, "  -H, --hue=VALUE            Hue phase in degrees, -128 to 127 (default: 0),\n");
 	fprintf(stderr, "                             Value  Phase\n");
 	fprintf(stderr, "                              -128  -180.00000\n");
 	fprintf(stderr, "                                 0     0.00000\n");
 	fprintf(stderr, "                                 1     1.40635\n");
 	fprintf(stderr, "                               127   178.59375\n");
+	fprintf(stderr, "      --i2c-burst=COUNT      Most consecutive I2C registers written by one\n");
+	fprintf(stderr, "                             control transfer, 1 to 32 (default: 32)\n");
+	fprintf(stderr, "      --iso-memory=TYPE      Memory for the iso transfer buffers\n");
+	fprintf(stderr, "                             Type       Memory\n");
+	fprintf(stderr, "                             device     Filled by the USB controller without\n");
+	fprintf(stderr, "                                        a copy, if the kernel supports it,\n");
+	fprintf(stderr, "                                        else pages (default)\n");
+	fprintf(stderr, "                             pages      Page aligned memory\n");
+	fprintf(stderr, "                             hugepages  Huge pages, else pages\n");
+	fprintf(stderr, "      --iso-packets=COUNT    Packets (125 us each) per iso transfer,\n");
+	fprintf(stderr, "                             1 to 64 (default: 64)\n");
 	fprintf(stderr, "      --iso-transfers=COUNT  Number of concurrent iso transfers (default: 4)\n");
 	fprintf(stderr, "      --lum-aperture=MODE    Luminance aperture factor (default: 1)\n");
 	fprintf(stderr, "                             Mode  Aperture Factor\n");
@@ -1181,6 +6549,34 @@ static void usage()
 	fprintf(stderr, "      --pal-4.43             PAL-4.43 / PAL 60 [525 lines, 29.97 Hz]\n");
 	fprintf(stderr, "      --pal-m                PAL-M (Brazil)    [525 lines, 29.97 Hz]\n");
 	fprintf(stderr, "      --pal-combination-n    PAL Combination-N [625 lines, 25 Hz]\n");
+	fprintf(stderr, "      --pixel-format=FORMAT  Pixel format of the video output\n");
+	fprintf(stderr, "                             (default: uyvy, yuv422p with --y4m)\n");
+	fprintf(stderr, "                             Format   Layout\n");
+	fprintf(stderr, "                             uyvy     Packed 4:2:2, Cb Y Cr Y\n");
+	fprintf(stderr, "                             yuyv     Packed 4:2:2, Y Cb Y Cr\n");
+	fprintf(stderr, "                             i420     Planar 4:2:0\n");
+	fprintf(stderr, "                             nv12     Y plane, interleaved Cb Cr 4:2:0\n");
+	fprintf(stderr, "                             yuv422p  Planar 4:2:2\n");
+	fprintf(stderr, "                             rgb24    R G B (BT.601 limited range)\n");
+	fprintf(stderr, "                             bgra     B G R 255 (BT.601 limited range)\n");
+	fprintf(stderr, "      --queue=COUNT          Number of completed frames that may wait for\n");
+	fprintf(stderr, "                             output (default: 4)\n");
+	fprintf(stderr, "      --queue-policy=POLICY  Action when the frame queue is full\n");
+	fprintf(stderr, "                             (default: block)\n");
+	fprintf(stderr, "                             Policy       Action\n");
+	fprintf(stderr, "                             block        Wait for output (default)\n");
+	fprintf(stderr, "                             drop-oldest  Drop the oldest queued frame\n");
+	fprintf(stderr, "                             drop-newest  Drop the new frame\n");
+	fprintf(stderr, "      --raw-dump=FILENAME    Record the unparsed iso stream to FILENAME, and\n");
+	fprintf(stderr, "                             an index of its transfers to FILENAME.idx;\n");
+	fprintf(stderr, "                             %%d is replaced by the device number\n");
+	fprintf(stderr, "      --replay=FILENAME      Decode a raw dump (see --raw-dump) instead of\n");
+	fprintf(stderr, "                             capturing from the device\n");
+	fprintf(stderr, "      --replay-pace=PACE     Replay speed (default: realtime)\n");
+	fprintf(stderr, "                             Pace      Speed\n");
+	fprintf(stderr, "                             realtime  50 or 59.94 fields per second\n");
+	fprintf(stderr, "                             fast      As fast as possible, report the\n");
+	fprintf(stderr, "                                       decoding rate\n");
 	fprintf(stderr, "  -S, --saturation=VALUE     Chrominance saturation control,\n");
 	fprintf(stderr, "                             -128 to 127 (default: 64)\n");
 	fprintf(stderr, "                             Value  Saturation\n");
@@ -1193,13 +6589,27 @@ static void usage()
 	fprintf(stderr, "  -s, --s-video              Use S-VIDEO input, EasyCAP DC60 and EzCAP USB 2.0\n");
 	fprintf(stderr, "                             only\n");
 	fprintf(stderr, "      --secam                SECAM             [625 lines, 25 Hz]\n");
+	fprintf(stderr, "      --serial-init          Write the init registers one control transfer at\n");
+	fprintf(stderr, "                             a time, to compare the startup time\n");
+	fprintf(stderr, "      --simulate[=COUNT]     Capture from COUNT simulated devices (default: 1),\n");
+	fprintf(stderr, "                             and report their control transfers, startup\n");
+	fprintf(stderr, "                             time and throughput\n");
+	fprintf(stderr, "      --stats                Print statistics on exit (and on SIGUSR1)\n");
 	fprintf(stderr, "      --sync=VALUE           Sync algorithm (default: 2)\n");
 	fprintf(stderr, "                             Value  Algorithm\n");
 	fprintf(stderr, "                                 1  TB\n");
 	fprintf(stderr, "                                 2  MD (default)\n");
 	fprintf(stderr, "      --test-only            Perform capture setup, but do not capture\n");
-	fprintf(stderr, "      --vo=FILENAME          Raw UYVY video output file (or pipe) filename\n");
-	fprintf(stderr, "                             (default is standard output)\n");
+	fprintf(stderr, "      --vo=FILENAME          Raw video output file (or pipe) filename,\n");
+	fprintf(stderr, "                             %%d is replaced by the device number; required\n");
+	fprintf(stderr, "                             with several devices (default is standard\n");
+	fprintf(stderr, "                             output)\n");
+	fprintf(stderr, "      --watchdog=MS          Restart the stream of a device that delivers no\n");
+	fprintf(stderr, "                             video for MS milliseconds, or whose transfers\n");
+	fprintf(stderr, "                             keep failing, without closing the output\n");
+	fprintf(stderr, "                             (default: 0, never)\n");
+	fprintf(stderr, "      --y4m                  Write the video as a YUV4MPEG2 stream instead\n");
+	fprintf(stderr, "                             of raw frames (pixel format yuv422p or i420)\n");
 	fprintf(stderr, "      --help                 Display usage\n");
 	fprintf(stderr, "      --version              Display version information\n");
 	fprintf(stderr, "\n");
@@ -1214,27 +6624,55 @@ static void usage()
 	fprintf(stderr, PROGRAM_NAME" -n --luminance=2 --lum-aperture=3 | mplayer -vf yadif,screenshot -demuxer rawvideo -rawvideo \"ntsc:format=uyvy:fps=30000/1001\" -aspect 4:3 -\n");
 }
 
-static int parse_cmdline(int argc, char **argv) {
+static int parse_cmdline(struct somagic_device *dev, int argc, char **argv) {
 	int c;
 	int i = 0;
 	int option_index = 0;
 	static struct option long_options[] = {
 		{"help", 0, 0, 0},              /* index 0  */
-		{"iso-transfers", 1, 0, 0},     /* index 1  */
-		{"lum-aperture", 1, 0, 0},      /* index 2  */
-		{"lum-prefilter", 0, 0, 0},     /* index 3  */
-		{"luminance", 1, 0, 0},         /* index 4  */
-		{"ntsc-4.43-50", 0, 0, 0},      /* index 5  */
-		{"ntsc-4.43-60", 0, 0, 0},      /* index 6  */
-		{"ntsc-n", 0, 0, 0},            /* index 7  */
-		{"pal-4.43", 0, 0, 0},          /* index 8  */
-		{"pal-m", 0, 0, 0},             /* index 9  */
-		{"pal-combination-n", 0, 0, 0}, /* index 10 */
-		{"secam", 0, 0, 0},             /* index 11 */
-		{"sync", 1, 0, 0},              /* index 12 */
-		{"test-only", 0, 0, 0},         /* index 13 */
-		{"version", 0, 0, 0},           /* index 14 */
-		{"vo", 1, 0, 0},                /* index 15 */
+		{"all-devices", 0, 0, 0},       /* index 1  */
+		{"autotune", 1, 0, 0},          /* index 2  */
+		{"benchmark", 0, 0, 0},         /* index 3  */
+		{"control", 1, 0, 0},           /* index 4  */
+		{"convert-threads", 1, 0, 0},   /* index 5  */
+		{"decode-buffers", 1, 0, 0},    /* index 6  */
+		{"decode-threads", 1, 0, 0},    /* index 7  */
+		{"device", 1, 0, 0},            /* index 8  */
+		{"event-cpu", 1, 0, 0},         /* index 9  */
+		{"event-priority", 1, 0, 0},    /* index 10 */
+		{"event-thread", 0, 0, 0},      /* index 11 */
+		{"field-rate", 0, 0, 0},        /* index 12 */
+		{"firmware", 1, 0, 0},          /* index 13 */
+		{"hotplug", 0, 0, 0},           /* index 14 */
+		{"i2c-burst", 1, 0, 0},         /* index 15 */
+		{"iso-memory", 1, 0, 0},        /* index 16 */
+		{"iso-packets", 1, 0, 0},       /* index 17 */
+		{"iso-transfers", 1, 0, 0},     /* index 18 */
+		{"lum-aperture", 1, 0, 0},      /* index 19 */
+		{"lum-prefilter", 0, 0, 0},     /* index 20 */
+		{"luminance", 1, 0, 0},         /* index 21 */
+		{"ntsc-4.43-50", 0, 0, 0},      /* index 22 */
+		{"ntsc-4.43-60", 0, 0, 0},      /* index 23 */
+		{"ntsc-n", 0, 0, 0},            /* index 24 */
+		{"pal-4.43", 0, 0, 0},          /* index 25 */
+		{"pal-m", 0, 0, 0},             /* index 26 */
+		{"pal-combination-n", 0, 0, 0}, /* index 27 */
+		{"pixel-format", 1, 0, 0},      /* index 28 */
+		{"queue", 1, 0, 0},             /* index 29 */
+		{"queue-policy", 1, 0, 0},      /* index 30 */
+		{"raw-dump", 1, 0, 0},          /* index 31 */
+		{"replay", 1, 0, 0},            /* index 32 */
+		{"replay-pace", 1, 0, 0},       /* index 33 */
+		{"secam", 0, 0, 0},             /* index 34 */
+		{"serial-init", 0, 0, 0},       /* index 35 */
+		{"simulate", 2, 0, 0},          /* index 36 */
+		{"stats", 0, 0, 0},             /* index 37 */
+		{"sync", 1, 0, 0},              /* index 38 */
+		{"test-only", 0, 0, 0},         /* index 39 */
+		{"version", 0, 0, 0},           /* index 40 */
+		{"vo", 1, 0, 0},                /* index 41 */
+		{"watchdog", 1, 0, 0},          /* index 42 */
+		{"y4m", 0, 0, 0},               /* index 43 */
 		{"brightness", 1, 0, 'B'},
 		{"cvbs", 0, 0, 'c'},
 		{"cvbs-input", 1, 0, 'i'},
@@ -1259,71 +6697,243 @@ static int parse_cmdline(int argc, char **argv) {
 			case 0: /* --help */
 				usage();
 				exit(0);
-			case 1: /* --iso-transfers */
-				num_iso_transfers = atoi(optarg);
-				if (num_iso_transfers < 1) {
-					fprintf(stderr, "Invalid iso transfers count '%i', must be at least 1\n", num_iso_transfers);
+			case 1: /* --all-devices */
+				all_devices = 1;
+				break;
+			case 2: /* --autotune */
+				if (strcmp(optarg, "latency") == 0) {
+					dev->autotune = AUTOTUNE_LATENCY;
+				} else if (strcmp(optarg, "cpu") == 0) {
+					dev->autotune = AUTOTUNE_CPU;
+				} else if (strcmp(optarg, "off") == 0) {
+					dev->autotune = AUTOTUNE_OFF;
+				} else {
+					fprintf(stderr, "Invalid autotune goal '%s', must be latency, cpu or off\n", optarg);
+					return 1;
+				}
+				break;
+			case 3: /* --benchmark */
+				benchmark = 1;
+				break;
+			case 4: /* --control */
+				control_filename = optarg;
+				break;
+			case 5: /* --convert-threads */
+				convert_threads = atoi(optarg);
+				if (convert_threads < 1 || convert_threads > 64) {
+					fprintf(stderr, "Invalid conversion thread count '%i', must be 1 to 64\n", convert_threads);
+					return 1;
+				}
+				break;
+			case 6: /* --decode-buffers */
+				dev->decode_buffers = atoi(optarg);
+				if (dev->decode_buffers < 0) {
+					fprintf(stderr, "Invalid decode buffer count '%i', must be at least 0\n", dev->decode_buffers);
+					return 1;
+				}
+				break;
+			case 7: /* --decode-threads */
+				decode_threads = atoi(optarg);
+				if (decode_threads < 0) {
+					fprintf(stderr, "Invalid decode thread count '%i', must be at least 0\n", decode_threads);
+					return 1;
+				}
+				break;
+			case 8: /* --device */
+				device_selection = realloc(device_selection, (device_selection_count + 1) * sizeof *device_selection);
+				if (device_selection == NULL) {
+					perror("Failed to allocate memory for the device selection");
+					return 1;
+				}
+				device_selection[device_selection_count++] = optarg;
+				break;
+			case 9: /* --event-cpu */
+				event_cpu = atoi(optarg);
+				if (event_cpu < 0 || event_cpu >= CPU_SETSIZE) {
+					fprintf(stderr, "Invalid event thread CPU '%i', must be from 0 to %d\n", event_cpu, CPU_SETSIZE - 1);
+					return 1;
+				}
+				event_thread = 1;
+				break;
+			case 10: /* --event-priority */
+				event_priority = atoi(optarg);
+				if (event_priority < sched_get_priority_min(SCHED_FIFO) || event_priority > sched_get_priority_max(SCHED_FIFO)) {
+					fprintf(stderr, "Invalid event thread priority '%i', must be from %d to %d\n", event_priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+					return 1;
+				}
+				event_thread = 1;
+				break;
+			case 11: /* --event-thread */
+				event_thread = 1;
+				break;
+			case 12: /* --field-rate */
+				field_rate = 1;
+				break;
+			case 13: /* --firmware */
+				firmware_filename = optarg;
+				break;
+			case 14: /* --hotplug */
+				hotplug = 1;
+				break;
+			case 15: /* --i2c-burst */
+				dev->i2c_burst_max = atoi(optarg);
+				if (dev->i2c_burst_max < 1 || dev->i2c_burst_max > I2C_BURST_MAX) {
+					fprintf(stderr, "Invalid I2C burst length '%i', must be from 1 to %d\n", dev->i2c_burst_max, I2C_BURST_MAX);
+					return 1;
+				}
+				break;
+			case 16: /* --iso-memory */
+				if (strcmp(optarg, "device") == 0) {
+					dev->iso_memory = ISO_MEMORY_DEVICE;
+				} else if (strcmp(optarg, "pages") == 0) {
+					dev->iso_memory = ISO_MEMORY_PAGES;
+				} else if (strcmp(optarg, "hugepages") == 0) {
+					dev->iso_memory = ISO_MEMORY_HUGEPAGES;
+				} else {
+					fprintf(stderr, "Invalid iso memory type '%s', must be device, pages or hugepages\n", optarg);
+					return 1;
+				}
+				break;
+			case 17: /* --iso-packets */
+				dev->iso_packets = atoi(optarg);
+				if (dev->iso_packets < 1 || dev->iso_packets > ISO_PACKETS) {
+					fprintf(stderr, "Invalid iso packets count '%i', must be from 1 to %d\n", dev->iso_packets, ISO_PACKETS);
+					return 1;
+				}
+				break;
+			case 18: /* --iso-transfers */
+				dev->num_iso_transfers = atoi(optarg);
+				if (dev->num_iso_transfers < 1) {
+					fprintf(stderr, "Invalid iso transfers count '%i', must be at least 1\n", dev->num_iso_transfers);
+					return 1;
+				}
+				break;
+			case 19: /* --lum-aperture */
+				dev->luminance_aperture = atoi(optarg);
+				if (dev->luminance_aperture < 0 || dev->luminance_aperture > 3) {
+					fprintf(stderr, "Invalid luminance aperture '%i', must be from 0 to 3\n", dev->luminance_mode);
+					return 1;
+				}
+				break;
+			case 20: /* --lum-prefilter */
+				dev->luminance_prefilter = 1;
+				break;
+			case 21: /* --luminance */
+				dev->luminance_mode = atoi(optarg);
+				if (dev->luminance_mode < 0 || dev->luminance_mode > 3) {
+					fprintf(stderr, "Invalid luminance mode '%i', must be from 0 to 3\n", dev->luminance_mode);
 					return 1;
 				}
 				break;
-			case 2: /* --lum-aperture */
-				luminance_aperture = atoi(optarg);
-				if (luminance_aperture < 0 || luminance_aperture > 3) {
-					fprintf(stderr, "Invalid luminance aperture '%i', must be from 0 to 3\n", luminance_mode);
+			case 22: /* --ntsc-4.43-50 */
+				dev->tv_standard = NTSC_50;
+				break;
+			case 23: /* --ntsc-4.43-60 */
+				dev->tv_standard = NTSC_60;
+				break;
+			case 24: /* --ntsc-n */
+				dev->tv_standard = NTSC_N;
+				break;
+			case 25: /* --pal-4.43 */
+				dev->tv_standard = PAL_60;
+				break;
+			case 26: /* --pal-m */
+				dev->tv_standard = PAL_M;
+				break;
+			case 27: /* --pal-combination-n */
+				dev->tv_standard = PAL_COMBO_N;
+				break;
+			case 28: /* --pixel-format */
+				for (pixel_format = PIXEL_UYVY; pixel_format <= PIXEL_BGRA; pixel_format++) {
+					if (strcmp(optarg, pixel_format_names[pixel_format]) == 0) {
+						break;
+					}
+				}
+				if (pixel_format > PIXEL_BGRA) {
+					fprintf(stderr, "Invalid pixel format '%s', must be uyvy, yuyv, i420, nv12, yuv422p, rgb24 or bgra\n", optarg);
 					return 1;
 				}
 				break;
-			case 3: /* --lum-prefilter */
-				luminance_prefilter = 1;
+			case 29: /* --queue */
+				dev->queue_length = atoi(optarg);
+				if (dev->queue_length < 1) {
+					fprintf(stderr, "Invalid queue length '%i', must be at least 1\n", dev->queue_length);
+					return 1;
+				}
 				break;
-			case 4: /* --luminance */
-				luminance_mode = atoi(optarg);
-				if (luminance_mode < 0 || luminance_mode > 3) {
-					fprintf(stderr, "Invalid luminance mode '%i', must be from 0 to 3\n", luminance_mode);
+			case 30: /* --queue-policy */
+				if (strcmp(optarg, "block") == 0) {
+					dev->queue_policy = QUEUE_BLOCK;
+				} else if (strcmp(optarg, "drop-oldest") == 0) {
+					dev->queue_policy = QUEUE_DROP_OLDEST;
+				} else if (strcmp(optarg, "drop-newest") == 0) {
+					dev->queue_policy = QUEUE_DROP_NEWEST;
+				} else {
+					fprintf(stderr, "Invalid queue policy '%s', must be block, drop-oldest or drop-newest\n", optarg);
 					return 1;
 				}
 				break;
-			case 5: /* --ntsc-4.43-50 */
-				tv_standard = NTSC_50;
+			case 31: /* --raw-dump */
+				raw_dump_filename = optarg;
 				break;
-			case 6: /* --ntsc-4.43-60 */
-				tv_standard = NTSC_60;
+			case 32: /* --replay */
+				replay_filename = optarg;
 				break;
-			case 7: /* --ntsc-n */
-				tv_standard = NTSC_N;
+			case 33: /* --replay-pace */
+				if (strcmp(optarg, "realtime") == 0) {
+					replay_pace = REPLAY_REALTIME;
+				} else if (strcmp(optarg, "fast") == 0) {
+					replay_pace = REPLAY_FAST;
+				} else {
+					fprintf(stderr, "Invalid replay pace '%s', must be realtime or fast\n", optarg);
+					return 1;
+				}
 				break;
-			case 8: /* --pal-4.43 */
-				tv_standard = PAL_60;
+			case 34: /* --secam */
+				dev->tv_standard = SECAM;
 				break;
-			case 9: /* --pal-m */
-				tv_standard = PAL_M;
+			case 35: /* --serial-init */
+				serial_init = 1;
 				break;
-			case 10: /* --pal-combination-n */
-				tv_standard = PAL_COMBO_N;
+			case 36: /* --simulate */
+				dev->transport = &sim_transport;
+				if (optarg != NULL) {
+					simulated_devices = atoi(optarg);
+					if (simulated_devices < 1) {
+						fprintf(stderr, "Invalid simulated device count '%i', must be at least 1\n", simulated_devices);
+						return 1;
+					}
+				}
 				break;
-			case 11: /* --secam */
-				tv_standard = SECAM;
+			case 37: /* --stats */
+				print_statistics = 1;
 				break;
-			case 12: /* --sync */
-				sync_algorithm = atoi(optarg);
-				if (sync_algorithm < 1 || sync_algorithm > 2) {
-					fprintf(stderr, "Invalid sync algorithm '%i', must be from 1 to 2\n", sync_algorithm);
+			case 38: /* --sync */
+				dev->sync_algorithm = atoi(optarg);
+				if (dev->sync_algorithm < 1 || dev->sync_algorithm > 2) {
+					fprintf(stderr, "Invalid sync algorithm '%i', must be from 1 to 2\n", dev->sync_algorithm);
 					return 1;
 				}
 				break;
-			case 13: /* --test-only */
+			case 39: /* --test-only */
 				test_only = 1;
 				break;
-			case 14: /* --version */
+			case 40: /* --version */
 				version();
 				exit(0);
-			case 15: /* --vo */
-				video_fd = open(optarg, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-				if (video_fd == -1) {
-					fprintf(stderr, "%s: Failed to open video output file '%s': %s\n", program_path, optarg, strerror(errno));
+			case 41: /* --vo */
+				video_filename = optarg;
+				break;
+			case 42: /* --watchdog */
+				watchdog_timeout = atoi(optarg);
+				if (watchdog_timeout < 0) {
+					fprintf(stderr, "Invalid watchdog timeout '%i', must be at least 0\n", watchdog_timeout);
 					return 1;
 				}
 				break;
+			case 43: /* --y4m */
+				y4m_output = 1;
+				break;
 			default:
 				usage();
 				return 1;
@@ -1335,10 +6945,10 @@ static int parse_cmdline(int argc, char **argv) {
 				fprintf(stderr, "Invalid brightness value '%i', must be from 0 to 255\n", i);
 				return 1;
 			}
-			brightness = i;
+			dev->brightness = i;
 			break;
 		case 'c':
-			input_type = CVBS;
+			dev->input_type = CVBS;
 			break;
 		case 'C':
 			i = atoi(optarg);
@@ -1346,10 +6956,10 @@ static int parse_cmdline(int argc, char **argv) {
 				fprintf(stderr, "Invalid contrast value '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			contrast = (int8_t)i;
+			dev->contrast = (int8_t)i;
 			break;
 		case 'f':
-			frame_count = atoi(optarg);
+			dev->frame_count = atoi(optarg);
 			break;
 		case 'H':
 			i = atoi(optarg);
@@ -1357,22 +6967,22 @@ static int parse_cmdline(int argc, char **argv) {
 				fprintf(stderr, "Invalid hue phase '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			hue = (int8_t)i;
+			dev->hue = (int8_t)i;
 			break;
 		case 'i':
 			i = atoi(optarg);
 			switch (i) {
 			case 1:
-				cvbs_input = VIDEO1;
+				dev->cvbs_input = VIDEO1;
 				break;
 			case 2:
-				cvbs_input = VIDEO2;
+				dev->cvbs_input = VIDEO2;
 				break;
 			case 3:
-				cvbs_input = VIDEO3;
+				dev->cvbs_input = VIDEO3;
 				break;
 			case 4:
-				cvbs_input = VIDEO4;
+				dev->cvbs_input = VIDEO4;
 				break;
 			default:
 				fprintf(stderr, "Invalid CVBS input '%i', must be from 1 to 4\n", i);
@@ -1380,13 +6990,13 @@ static int parse_cmdline(int argc, char **argv) {
 			}
 			break;
 		case 'n':
-			tv_standard = NTSC;
+			dev->tv_standard = NTSC;
 			break;
 		case 'p':
-			tv_standard = PAL;
+			dev->tv_standard = PAL;
 			break;
 		case 's':
-			input_type = SVIDEO;
+			dev->input_type = SVIDEO;
 			break;
 		case 'S':
 			i = atoi(optarg);
@@ -1394,7 +7004,7 @@ static int parse_cmdline(int argc, char **argv) {
 				fprintf(stderr, "Invalid saturation value '%i', must be from -128 to 127\n", i);
 				return 1;
 			}
-			saturation = (int8_t)i;
+			dev->saturation = (int8_t)i;
 			break;
 		default:
 			usage();
@@ -1405,16 +7015,36 @@ static int parse_cmdline(int argc, char **argv) {
 		usage();
 		return 1;
 	}
-	if (input_type == SVIDEO && luminance_mode != 0) {
+	if (dev->input_type == SVIDEO && dev->luminance_mode != 0) {
 		fprintf(stderr, "Luminance mode must be 0 for S-VIDEO\n");
 		return 1;
 	}
+	if (device_selection_count > 0 && all_devices) {
+		fprintf(stderr, "--device and --all-devices cannot be combined\n");
+		return 1;
+	}
+	if (hotplug && (all_devices || benchmark || replay_filename != NULL)) {
+		fprintf(stderr, "--hotplug cannot be combined with --all-devices, --benchmark or --replay\n");
+		return 1;
+	}
+	if (y4m_output && benchmark) {
+		fprintf(stderr, "--y4m cannot be combined with --benchmark, which switches standards\n");
+		return 1;
+	}
+	if (pixel_format == -1) {
+		pixel_format = y4m_output ? PIXEL_YUV422P : PIXEL_UYVY;
+	}
+	if (y4m_output && pixel_format != PIXEL_YUV422P && pixel_format != PIXEL_I420) {
+		fprintf(stderr, "--y4m needs a planar pixel format, yuv422p or i420\n");
+		return 1;
+	}
 
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
+	struct somagic_device *dev;
 	int ret;
 
 	program_path = malloc(strlen(argv[0]) + 1);
@@ -1424,23 +7054,72 @@ int main(int argc, char **argv)
 	}
 	strcpy(program_path, argv[0]);
 
-	/* Parse command line arguments */
-	ret = parse_cmdline(argc, argv);
-	if (ret) {
-		return ret;
+	trc_scan_select();
+	convert_select();
+
+	dev = somagic_device_new();
+	if (dev == NULL) {
+		perror("Failed to allocate memory for the device");
+		return 1;
 	}
 
-	/* Initialize somagic registers */
-	ret = somagic_init();
+	/* Parse command line arguments */
+	ret = parse_cmdline(dev, argc, argv);
 	if (ret) {
 		return ret;
 	}
+	if (convert_bands_start()) {
+		return 1;
+	}
 
-	/* Perform capture */
-	ret = somagic_capture();
-	if (ret) {
-		return ret;
+	if (benchmark) {
+		ret = open_output_files(dev);
+		if (!ret) {
+			ret = somagic_benchmark(dev);
+		}
+	} else if (replay_filename != NULL) {
+		/* Decode a raw dump instead of capturing */
+		ret = open_output_files(dev);
+		if (!ret) {
+			ret = somagic_replay(dev);
+		}
+	} else if (hotplug) {
+		ret = somagic_hotplug(dev);
+	} else {
+		ret = find_devices(dev);
+		if (!ret && device_count > 1) {
+			/* Each device needs its own output */
+			if (video_filename == NULL || strstr(video_filename, "%d") == NULL) {
+				fprintf(stderr, "%s: Capturing from %d devices, --vo must be given a filename with %%d\n", program_path, device_count);
+				ret = 1;
+			} else if (raw_dump_filename != NULL && strstr(raw_dump_filename, "%d") == NULL) {
+				fprintf(stderr, "%s: Capturing from %d devices, --raw-dump must be given a filename with %%d\n", program_path, device_count);
+				ret = 1;
+			} else if (control_filename != NULL && strstr(control_filename, "%d") == NULL) {
+				fprintf(stderr, "%s: Capturing from %d devices, --control must be given a path with %%d\n", program_path, device_count);
+				ret = 1;
+			}
+		}
+
+		/* Initialize somagic registers of each device, then perform capture */
+		for (dev = device_list; dev != NULL && !ret; dev = dev->next) {
+			ret = open_output_files(dev);
+			if (!ret) {
+				ret = somagic_init(dev);
+			}
+		}
+		if (!ret) {
+			ret = somagic_capture();
+		}
 	}
 
-	return 0;
+	convert_bands_finish();
+	while (device_list != NULL) {
+		somagic_device_free(device_list);
+	}
+	free(device_selection);
+	if (usb_context != NULL) {
+		libusb_exit(usb_context);
+	}
+	return ret;
 }
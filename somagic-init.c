@@ -37,9 +37,11 @@
 #include <getopt.h>
 #include <libusb-1.0/libusb.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PROGRAM_NAME "somagic-init"
@@ -61,6 +63,22 @@ static const int NEW_PRODUCT[PRODUCT_COUNT] = {
 
 static struct libusb_device_handle *devh;
 
+/* Bus and port path of the device, to recognize it after it reconnects */
+static uint8_t usb_bus;
+static uint8_t usb_ports[7];
+static int usb_port_count;
+
+/* Firmware transfers to keep in flight (see --upload-depth) */
+#define UPLOAD_DEPTH_MAX 32
+static int upload_depth = 8;
+
+/* Print statistics on exit: 0 = no, 1 = yes */
+static int print_statistics = 0;
+
+/* Wait for the device to reconnect with the new firmware (see --verify): 0 = no, 1 = yes */
+#define VERIFY_TIMEOUT 5000
+static int verify_reconnect = 0;
+
 #ifdef DEBUG
 static void list_devices()
 {
@@ -95,17 +113,6 @@ static void print_bytes(unsigned char *bytes, int len)
 }
 #endif
 
-static void release_usb_device(int ret)
-{
-	ret = libusb_release_interface(devh, 0);
-	if (!ret) {
-		perror("Failed to release interface");
-	}
-	libusb_close(devh);
-	libusb_exit(NULL);
-	exit(1);
-}
-
 static struct libusb_device *find_device(int vendor, int product)
 {
 	struct libusb_device **list;
@@ -128,6 +135,473 @@ static struct libusb_device *find_device(int vendor, int product)
 	return dev;
 }
 
+/*
+ * USB transport. The device is normally reached through libusb, but can be
+ * replaced by a simulation of it (see --simulate). The functions follow their
+ * libusb counterparts, for the device opened by open().
+ */
+struct transport_t {
+	int (*open)(int new_product);
+	void (*close)(void);
+	int (*claim_interface)(int interface_number);
+	int (*release_interface)(int interface_number);
+	int (*set_configuration)(int configuration);
+	int (*set_interface_alt_setting)(int interface_number, int alternate_setting);
+	int (*get_descriptor)(uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length);
+	int (*control_transfer)(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+	int (*submit_transfer)(struct libusb_transfer *tfr);
+	int (*cancel_transfer)(struct libusb_transfer *tfr);
+	int (*handle_events)(void);
+	int (*reconnected)(int new_product);  /* 1 if the device is back with new firmware */
+};
+
+/* Open the uninitialized device. new_product is its product id after initialization if known, otherwise 0 */
+static int usb_open(int new_product)
+{
+	struct libusb_device *dev;
+
+	libusb_init(NULL);
+	#ifdef DEBUG
+	libusb_set_debug(NULL, 255);
+	list_devices();
+	#else
+	libusb_set_debug(NULL, 0);
+	#endif
+
+	dev = find_device(VENDOR, ORIGINAL_PRODUCT);
+	if (!dev) {
+		if (new_product) {
+			dev = find_device(VENDOR, new_product);
+			if (dev) {
+				fprintf(stderr, "USB device already initialized\n");
+			} else {
+				fprintf(stderr, "USB device %04x:%04x was not found. Is the device attached?\n", VENDOR, ORIGINAL_PRODUCT);
+			}
+		} else {
+			fprintf(stderr, "USB device %04x:%04x was not found. The device might not be attached or might already be initialized\n", VENDOR, ORIGINAL_PRODUCT);
+		}
+		return 1;
+	}
+
+	usb_bus = libusb_get_bus_number(dev);
+	usb_port_count = libusb_get_port_numbers(dev, usb_ports, sizeof usb_ports);
+	libusb_open(dev, &devh);
+	if (!devh) {
+		perror("Failed to open USB device");
+		return 1;
+	}
+	libusb_unref_device(dev);
+	return 0;
+}
+
+static void usb_close()
+{
+	libusb_close(devh);
+	libusb_exit(NULL);
+}
+
+static int usb_claim_interface(int interface_number)
+{
+	return libusb_claim_interface(devh, interface_number);
+}
+
+static int usb_release_interface(int interface_number)
+{
+	return libusb_release_interface(devh, interface_number);
+}
+
+static int usb_set_configuration(int configuration)
+{
+	return libusb_set_configuration(devh, configuration);
+}
+
+static int usb_set_interface_alt_setting(int interface_number, int alternate_setting)
+{
+	return libusb_set_interface_alt_setting(devh, interface_number, alternate_setting);
+}
+
+static int usb_get_descriptor(uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length)
+{
+	return libusb_get_descriptor(devh, desc_type, desc_index, data, length);
+}
+
+static int usb_control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	return libusb_control_transfer(devh, request_type, request, value, index, data, length, timeout);
+}
+
+static int usb_submit_transfer(struct libusb_transfer *tfr)
+{
+	tfr->dev_handle = devh;
+	return libusb_submit_transfer(tfr);
+}
+
+static int usb_cancel_transfer(struct libusb_transfer *tfr)
+{
+	return libusb_cancel_transfer(tfr);
+}
+
+static int usb_handle_events()
+{
+	return libusb_handle_events(NULL);
+}
+
+/*
+ * Look for the device on its bus and port with one of the product ids the
+ * firmware gives it (new_product, or any of them if not known)
+ */
+static int usb_reconnected(int new_product)
+{
+	struct libusb_device **list;
+	struct libusb_device_descriptor descriptor;
+	struct libusb_device *item;
+	uint8_t ports[7];
+	int found = 0;
+	int i;
+	int p;
+	ssize_t count;
+
+	count = libusb_get_device_list(NULL, &list);
+	for (i = 0; i < count && !found; i++) {
+		item = list[i];
+		libusb_get_device_descriptor(item, &descriptor);
+		if (descriptor.idVendor != VENDOR || libusb_get_bus_number(item) != usb_bus) {
+			continue;
+		}
+		if (libusb_get_port_numbers(item, ports, sizeof ports) != usb_port_count || memcmp(ports, usb_ports, usb_port_count)) {
+			continue;
+		}
+		for (p = 0; p < PRODUCT_COUNT; p++) {
+			if (descriptor.idProduct == NEW_PRODUCT[p] && (!new_product || new_product == NEW_PRODUCT[p])) {
+				found = 1;
+			}
+		}
+	}
+	libusb_free_device_list(list, 1);
+	return found;
+}
+
+static const struct transport_t usb_transport = {
+	usb_open,
+	usb_close,
+	usb_claim_interface,
+	usb_release_interface,
+	usb_set_configuration,
+	usb_set_interface_alt_setting,
+	usb_get_descriptor,
+	usb_control_transfer,
+	usb_submit_transfer,
+	usb_cancel_transfer,
+	usb_handle_events,
+	usb_reconnected
+};
+
+/*
+ * Simulated device: accepts the firmware upload (request 0x05 with [05 ff]
+ * and 62 bytes of firmware) and the reconnect request (0x07), and reports
+ * how the upload went. Once, part way through the upload, it NAKs a firmware
+ * transfer until it times out, like a device that is briefly busy, and takes
+ * the transfers after it as a real loader would: unless the host cancels
+ * them, they land out of order.
+ */
+#define SIM_BUSY_AT 64
+
+static struct {
+	int new_product;
+	int control_transfers;
+	int firmware_transfers;
+	int firmware_bytes;
+	int busy_done;
+	int reconnected;
+	struct timespec open_time;
+	struct libusb_transfer *pending[UPLOAD_DEPTH_MAX];
+	int cancelled[UPLOAD_DEPTH_MAX];
+	int pending_count;
+} sim;
+
+static int sim_open(int new_product)
+{
+	memset(&sim, 0, sizeof sim);
+	sim.new_product = new_product;
+	clock_gettime(CLOCK_MONOTONIC, &sim.open_time);
+	return 0;
+}
+
+static void sim_close()
+{
+}
+
+static int sim_interface(int interface_number)
+{
+	return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_set_configuration(int configuration)
+{
+	return configuration == 1 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_set_interface_alt_setting(int interface_number, int alternate_setting)
+{
+	return interface_number == 0 && alternate_setting == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_get_descriptor(uint8_t desc_type, uint8_t desc_index, unsigned char *data, int length)
+{
+	(void)desc_index;
+	memset(data, 0, length);
+	if (length > 1) {
+		data[0] = length;
+		data[1] = desc_type;
+	}
+	return length;
+}
+
+static int sim_control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	struct timespec now;
+
+	(void)request_type;
+	(void)index;
+	(void)timeout;
+	if (request != 0x01) {
+		return LIBUSB_ERROR_PIPE;
+	}
+	sim.control_transfers++;
+	if (value == 0x05 && length == 64 && data[0] == 0x05 && data[1] == 0xff) {
+		if (sim.firmware_transfers == SIM_BUSY_AT && !sim.busy_done) {
+			sim.busy_done = 1;
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		sim.firmware_transfers++;
+		sim.firmware_bytes += 62;
+	} else if (value == 0x07) {
+		sim.reconnected = 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fprintf(stderr, "Simulated firmware upload: %d bytes in %d transfers (%d control transfers in total), %.3f s\n", sim.firmware_bytes, sim.firmware_transfers, sim.control_transfers, (now.tv_sec - sim.open_time.tv_sec) + (now.tv_nsec - sim.open_time.tv_nsec) / 1e9);
+		if (sim.new_product) {
+			fprintf(stderr, "Simulated device reconnected as %04x:%04x\n", VENDOR, sim.new_product);
+		}
+	}
+	return length;
+}
+
+static int sim_submit_transfer(struct libusb_transfer *tfr)
+{
+	if (sim.pending_count == UPLOAD_DEPTH_MAX) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	sim.cancelled[sim.pending_count] = 0;
+	sim.pending[sim.pending_count++] = tfr;
+	return 0;
+}
+
+/* A cancelled transfer still completes in turn, but never reaches the device */
+static int sim_cancel_transfer(struct libusb_transfer *tfr)
+{
+	int i;
+
+	for (i = 0; i < sim.pending_count; i++) {
+		if (sim.pending[i] == tfr && !sim.cancelled[i]) {
+			sim.cancelled[i] = 1;
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Complete the oldest transfer submitted */
+static int sim_handle_events()
+{
+	struct libusb_transfer *tfr;
+	struct libusb_control_setup *setup;
+	int cancelled;
+	int ret;
+
+	if (sim.pending_count == 0) {
+		return 0;
+	}
+	tfr = sim.pending[0];
+	cancelled = sim.cancelled[0];
+	sim.pending_count--;
+	memmove(sim.pending, sim.pending + 1, sim.pending_count * sizeof *sim.pending);
+	memmove(sim.cancelled, sim.cancelled + 1, sim.pending_count * sizeof *sim.cancelled);
+
+	if (cancelled) {
+		tfr->status = LIBUSB_TRANSFER_CANCELLED;
+		tfr->actual_length = 0;
+		tfr->callback(tfr);
+		return 0;
+	}
+	setup = libusb_control_transfer_get_setup(tfr);
+	ret = sim_control_transfer(setup->bmRequestType, setup->bRequest, libusb_le16_to_cpu(setup->wValue), libusb_le16_to_cpu(setup->wIndex), libusb_control_transfer_get_data(tfr), libusb_le16_to_cpu(setup->wLength), tfr->timeout);
+	tfr->status = (ret == LIBUSB_ERROR_TIMEOUT) ? LIBUSB_TRANSFER_TIMED_OUT : (ret < 0) ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+	tfr->actual_length = ret < 0 ? 0 : ret;
+	tfr->callback(tfr);
+	return 0;
+}
+
+static int sim_reconnected(int new_product)
+{
+	(void)new_product;
+	return sim.reconnected;
+}
+
+static const struct transport_t sim_transport = {
+	sim_open,
+	sim_close,
+	sim_interface,
+	sim_interface,
+	sim_set_configuration,
+	sim_set_interface_alt_setting,
+	sim_get_descriptor,
+	sim_control_transfer,
+	sim_submit_transfer,
+	sim_cancel_transfer,
+	sim_handle_events,
+	sim_reconnected
+};
+
+static const struct transport_t *transport = &usb_transport;
+
+static void release_usb_device(int ret)
+{
+	ret = transport->release_interface(0);
+	if (!ret) {
+		perror("Failed to release interface");
+	}
+	transport->close();
+	exit(1);
+}
+
+/*
+ * Firmware upload. Each transfer carries [05 ff] and the next 62 bytes of
+ * the firmware, which the loader takes in order. Transfers on the control
+ * endpoint complete in the order they were submitted, so up to upload_depth
+ * of them are kept in flight rather than waiting for each to complete.
+ * If the device NAKs a transfer until it times out, the transfers queued
+ * behind it are cancelled before they reach the loader, which would take
+ * them out of order, and the upload resumes at the failed transfer with half
+ * as many in flight, after a pause that doubles with each retry of the same
+ * transfer.
+ */
+#define FIRMWARE_CHUNK 62
+#define UPLOAD_RETRIES 6
+
+static struct {
+	struct libusb_transfer **tfr;  /* chunk n in slot n % UPLOAD_DEPTH_MAX */
+	int next;      /* next chunk to submit */
+	int accepted;  /* transfers the device has taken, in order */
+	int failed;    /* first transfer that failed: -1 = none */
+	int status;    /* its libusb_transfer_status */
+	int misordered;  /* a transfer after the failed one was taken */
+	int in_flight;
+	int retries;
+} upload;
+
+static void upload_done(struct libusb_transfer *tfr)
+{
+	int chunk = (intptr_t)tfr->user_data;
+	int i;
+
+	upload.in_flight--;
+	if (tfr->status == LIBUSB_TRANSFER_COMPLETED && tfr->actual_length == 2 + FIRMWARE_CHUNK) {
+		if (upload.failed == -1) {
+			upload.accepted = chunk + 1;
+		} else {
+			/* Completed before it could be cancelled */
+			upload.misordered = 1;
+		}
+	} else if (upload.failed == -1) {
+		upload.failed = chunk;
+		upload.status = tfr->status;
+		for (i = chunk + 1; i < upload.next; i++) {
+			transport->cancel_transfer(upload.tfr[i % UPLOAD_DEPTH_MAX]);
+		}
+	}
+}
+
+static int firmware_upload(const char *firmware, int firmware_length)
+{
+	struct libusb_transfer *tfr[UPLOAD_DEPTH_MAX];
+	unsigned char buf[UPLOAD_DEPTH_MAX][LIBUSB_CONTROL_SETUP_SIZE + 2 + FIRMWARE_CHUNK];
+	int chunks = (firmware_length + FIRMWARE_CHUNK - 1) / FIRMWARE_CHUNK;
+	int depth = upload_depth;
+	int delay = 1000;
+	int last_failed = -1;
+	int tries = 0;
+	int ret = 0;
+	int slot;
+	int i;
+
+	for (slot = 0; slot < UPLOAD_DEPTH_MAX; slot++) {
+		tfr[slot] = libusb_alloc_transfer(0);
+		if (tfr[slot] == NULL) {
+			perror("Failed to allocate memory for the firmware transfers");
+			for (i = 0; i < slot; i++) {
+				libusb_free_transfer(tfr[i]);
+			}
+			return 1;
+		}
+	}
+
+	memset(&upload, 0, sizeof upload);
+	upload.tfr = tfr;
+	while (upload.accepted < chunks && !ret) {
+		upload.failed = -1;
+		upload.next = upload.accepted;
+		while ((upload.next < chunks && upload.failed == -1 && !ret) || upload.in_flight) {
+			while (upload.next < chunks && upload.in_flight < depth && upload.failed == -1) {
+				/* In order completion means the slot of chunk next - UPLOAD_DEPTH_MAX is free */
+				slot = upload.next % UPLOAD_DEPTH_MAX;
+				libusb_fill_control_setup(buf[slot], LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000005, 0x0000000, 2 + FIRMWARE_CHUNK);
+				memcpy(buf[slot] + LIBUSB_CONTROL_SETUP_SIZE, "\x05\xff", 2);
+				memset(buf[slot] + LIBUSB_CONTROL_SETUP_SIZE + 2, 0, FIRMWARE_CHUNK);
+				memcpy(buf[slot] + LIBUSB_CONTROL_SETUP_SIZE + 2, firmware + upload.next * FIRMWARE_CHUNK, upload.next == chunks - 1 ? firmware_length - upload.next * FIRMWARE_CHUNK : FIRMWARE_CHUNK);
+				libusb_fill_control_transfer(tfr[slot], devh, buf[slot], upload_done, (void *)(intptr_t)upload.next, 1000);
+				i = transport->submit_transfer(tfr[slot]);
+				if (i) {
+					fprintf(stderr, "Failed to submit firmware transfer: %s\n", libusb_error_name(i));
+					ret = 1;
+					break;
+				}
+				upload.in_flight++;
+				upload.next++;
+			}
+			if (upload.in_flight) {
+				transport->handle_events();
+			}
+		}
+		if (ret || upload.failed == -1) {
+			continue;
+		}
+
+		if (upload.failed != last_failed) {
+			last_failed = upload.failed;
+			tries = 0;
+			delay = 1000;
+		}
+		if (upload.misordered) {
+			fprintf(stderr, "Firmware transfer %d failed (status %d) after later ones were taken, reconnect the device and try again with --upload-depth=1\n", upload.failed, upload.status);
+			ret = 1;
+		} else if (++tries > UPLOAD_RETRIES) {
+			fprintf(stderr, "Firmware transfer %d failed %d times (status %d), giving up\n", upload.failed, UPLOAD_RETRIES, upload.status);
+			ret = 1;
+		} else {
+			/* Back off */
+			upload.retries++;
+			depth = depth > 1 ? depth / 2 : 1;
+			usleep(delay);
+			delay *= 2;
+		}
+	}
+
+	for (slot = 0; slot < UPLOAD_DEPTH_MAX; slot++) {
+		libusb_free_transfer(tfr[slot]);
+	}
+	return ret;
+}
+
 static void version()
 {
 	fprintf(stderr, PROGRAM_NAME" "VERSION"\n");
@@ -142,7 +616,14 @@ static void usage()
 	fprintf(stderr, "Usage: "PROGRAM_NAME" [options]\n");
 	fprintf(stderr, "  -f, --firmware=FILENAME  Use firmware file FILENAME\n");
 	fprintf(stderr, "                           (default: "SOMAGIC_FIRMWARE_PATH")\n");
+	fprintf(stderr, "      --simulate           Upload to a simulated device, and report the\n");
+	fprintf(stderr, "                           transfers and time taken\n");
 	fprintf(stderr, "      --skip-check         Do not attempt to validate firmware\n");
+	fprintf(stderr, "      --stats              Print the upload time and retries on exit\n");
+	fprintf(stderr, "      --upload-depth=COUNT Firmware transfers to keep in flight, 1 to %d\n", UPLOAD_DEPTH_MAX);
+	fprintf(stderr, "                           (default: 8)\n");
+	fprintf(stderr, "      --verify             Wait for the device to reconnect with the new\n");
+	fprintf(stderr, "                           firmware, and fail if it does not\n");
 	fprintf(stderr, "      --help               Display usage\n");
 	fprintf(stderr, "      --version            Display version information\n");
 	fprintf(stderr, "\n");
@@ -154,27 +635,29 @@ static void usage()
 int main(int argc, char **argv)
 {
 	int ret;
-	struct libusb_device *dev;
 	unsigned char buf[65535];
 	char *firmware;
 	FILE *infile;
 	int i;
-	#ifdef DEBUG
-	int j;
-	#endif
 	char *firmware_path = SOMAGIC_FIRMWARE_PATH;
 	int p;
 	int firmware_length;
 	unsigned char digest[4];
 	int validate_firmware = 1;
+	struct timespec start;
+	struct timespec end;
 
 	/* Parsing */
 	int c;
 	int option_index = 0;
 	static struct option long_options[] = {
-		{"help", 0, 0, 0},       /* index 0 */
-		{"skip-check", 0, 0, 0}, /* index 1 */
-		{"version", 0, 0, 0},    /* index 2 */
+		{"help", 0, 0, 0},         /* index 0 */
+		{"simulate", 0, 0, 0},     /* index 1 */
+		{"skip-check", 0, 0, 0},   /* index 2 */
+		{"stats", 0, 0, 0},        /* index 3 */
+		{"upload-depth", 1, 0, 0}, /* index 4 */
+		{"verify", 0, 0, 0},       /* index 5 */
+		{"version", 0, 0, 0},      /* index 6 */
 		{"firmware", 1, 0, 'f'},
 		{0, 0, 0, 0}
 	};
@@ -191,10 +674,26 @@ int main(int argc, char **argv)
 			case 0: /* --help */
 				usage();
 				return 0;
-			case 1: /* --skip-check */
+			case 1: /* --simulate */
+				transport = &sim_transport;
+				break;
+			case 2: /* --skip-check */
 				validate_firmware = 0;
 				break;
-			case 2: /* --version */
+			case 3: /* --stats */
+				print_statistics = 1;
+				break;
+			case 4: /* --upload-depth */
+				upload_depth = atoi(optarg);
+				if (upload_depth < 1 || upload_depth > UPLOAD_DEPTH_MAX) {
+					fprintf(stderr, "Invalid upload depth '%i', must be from 1 to %d\n", upload_depth, UPLOAD_DEPTH_MAX);
+					return 1;
+				}
+				break;
+			case 5: /* --verify */
+				verify_reconnect = 1;
+				break;
+			case 6: /* --version */
 				version();
 				return 0;
 			default:
@@ -258,122 +757,101 @@ int main(int argc, char **argv)
 		}
 	}
 
-	libusb_init(NULL);
-	#ifdef DEBUG
-	libusb_set_debug(NULL, 255);
-	list_devices();
-	#else
-	libusb_set_debug(NULL, 0);
-	#endif
-
-	dev = find_device(VENDOR, ORIGINAL_PRODUCT);
-	if (!dev) {
-		if (validate_firmware) {
-			dev = find_device(VENDOR, NEW_PRODUCT[p]);
-			if (dev) {
-		                fprintf(stderr, "USB device already initialized\n");
-			} else {
-		                fprintf(stderr, "USB device %04x:%04x was not found. Is the device attached?\n", VENDOR, ORIGINAL_PRODUCT);
-			}
-		} else {
-	                fprintf(stderr, "USB device %04x:%04x was not found. The device might not be attached or might already be initialized\n", VENDOR, ORIGINAL_PRODUCT);
-		}
-                return 1;
-	}
-
-	ret = libusb_open(dev, &devh);
-	if (!devh) {
-		perror("Failed to open USB device");
+	if (transport->open(validate_firmware ? NEW_PRODUCT[p] : 0)) {
 		return 1;
 	}
-	libusb_unref_device(dev);
 
 	signal(SIGTERM, release_usb_device);
-	ret = libusb_claim_interface(devh, 0);
+	ret = transport->claim_interface(0);
 	if (ret != 0) {
 		perror("Failed to claim device interface");
 		return 1;
 	}
 
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
+	ret = transport->set_interface_alt_setting(0, 0);
 	if (ret != 0) {
 		perror("Failed to activate alternate setting for interface");
 		return 1;
 	}
 
-	ret = libusb_get_descriptor(devh, 0x0000001, 0x0000000, buf, 0x0000012);
+	ret = transport->get_descriptor(0x0000001, 0x0000000, buf, 0x0000012);
 	#ifdef DEBUG
 	printf("1 get descriptor returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	printf("\n");
 	#endif
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 0x0000009);
+	ret = transport->get_descriptor(0x0000002, 0x0000000, buf, 0x0000009);
 	#ifdef DEBUG
 	printf("2 get descriptor returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	printf("\n");
 	#endif
-	ret = libusb_get_descriptor(devh, 0x0000002, 0x0000000, buf, 0x0000022);
+	ret = transport->get_descriptor(0x0000002, 0x0000000, buf, 0x0000022);
 	#ifdef DEBUG
 	printf("3 get descriptor returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	printf("\n");
 	#endif
-	ret = libusb_release_interface(devh, 0);
+	ret = transport->release_interface(0);
 	if (ret != 0) {
 		perror("Failed to release interface (before set_configuration)");
 		return 1;
 	}
-	ret = libusb_set_configuration(devh, 0x0000001);
+	ret = transport->set_configuration(0x0000001);
 	if (ret != 0) {
 		perror("Failed to set active device configuration");
 		return 1;
 	}
-	ret = libusb_claim_interface(devh, 0);
+	ret = transport->claim_interface(0);
 	if (ret != 0) {
 		perror("Failed to claim device interface (after set_configuration)");
 		return 1;
 	}
-	ret = libusb_set_interface_alt_setting(devh, 0, 0);
+	ret = transport->set_interface_alt_setting(0, 0);
 	if (ret != 0) {
 		perror("Failed to set active alternate setting for interface (after set_configuration)");
 		return 1;
 	}
 
 	usleep(1 * 1000);
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
+	ret = transport->control_transfer(LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE + LIBUSB_ENDPOINT_IN, 0x0000001, 0x0000001, 0x0000000, buf, 2, 1000);
 	#ifdef DEBUG
 	printf("5 control msg returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	printf("\n");
 	#endif
 
-	#ifdef DEBUG
-	for (i = 0, j = 6; i < firmware_length; i += 62, j++) {
-	#else
-	for (i = 0; i < firmware_length; i += 62) {
-	#endif
-		memcpy(buf, "\x05\xff", 2);
-		memcpy(buf + 2, firmware + i, 62);
-		ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000005, 0x0000000, buf, 64, 1000);
-		#ifdef DEBUG
-		printf("%i control msg returned %d, bytes: ", j, ret);
-		print_bytes(buf, ret);
-		printf("\n");
-		#endif
-		usleep(1 * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (firmware_upload(firmware, firmware_length)) {
+		transport->close();
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (print_statistics) {
+		fprintf(stderr, "Firmware uploaded: %d bytes in %.3f s (%d retries)\n", firmware_length, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, upload.retries);
 	}
 
 	memcpy(buf, "\x07\x00", 2);
-	ret = libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000007, 0x0000000, buf, 2, 1000);
+	ret = transport->control_transfer(LIBUSB_REQUEST_TYPE_VENDOR + LIBUSB_RECIPIENT_DEVICE, 0x0000001, 0x0000007, 0x0000000, buf, 2, 1000);
 	#ifdef DEBUG
 	printf("127 control msg returned %d, bytes: ", ret);
 	print_bytes(buf, ret);
 	printf("\n");
 	#endif
 
-	libusb_close(devh);
-	libusb_exit(NULL);
+	if (verify_reconnect) {
+		/* The firmware gives the device its new product id, so seeing that proves it runs */
+		for (i = 0; i < VERIFY_TIMEOUT / 100 && !transport->reconnected(validate_firmware ? NEW_PRODUCT[p] : 0); i++) {
+			usleep(100 * 1000);
+		}
+		if (i == VERIFY_TIMEOUT / 100) {
+			fprintf(stderr, "USB device did not reconnect with the new firmware within %d ms\n", VERIFY_TIMEOUT);
+			transport->close();
+			return 1;
+		}
+	}
+
+	transport->close();
 
 	return 0;
 }